@@ -9,8 +9,13 @@
  *****************************************************************************/
 #include <WinSock2.h>
 #include <Mstcpip.h>
+#include <afunix.h>
+#include <iphlpapi.h>
+#include <stdlib.h>
 #include "debugPrint.h"
 
+#pragma comment (lib, "Iphlpapi.lib")
+
 
 /******************************************************************************
  * Defs & Macros
@@ -99,6 +104,106 @@ lblErrorCleanup:
 	return FALSE;
 }
 
+/******************************************************************************
+ * CreateUnixListenSocket Function
+ * Create a listening AF_UNIX stream socket bound to pszPath (Windows 10 1803
+ * and later). A file left over at the path by a previous run is replaced.
+ *****************************************************************************/
+static BOOL CreateUnixListenSocket(OUT SOCKET	* pListenSocket, 
+								   IN LPCSTR	pszPath, 
+								   int			iBacklog = SOMAXCONN)
+{
+	sockaddr_un localAddr = {0};
+
+	if (strlen(pszPath) >= sizeof(localAddr.sun_path))
+	{
+		DEBUG_PRINT_ERROR("Socket path %s is too long", pszPath);
+		return FALSE;
+	}
+
+	/* Create the socket */
+	SOCKET listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (INVALID_SOCKET == listenSocket)
+	{
+		DEBUG_PRINT_WSA_ERROR("socket");
+		goto lblErrorCleanup;
+	}
+
+	/* Bind the socket, binding fails if the path exists */
+	localAddr.sun_family = AF_UNIX;
+	memcpy(localAddr.sun_path, pszPath, strlen(pszPath) + 1);
+	(void)DeleteFileA(pszPath);
+	if (SOCKET_ERROR == ::bind(listenSocket, (SOCKADDR *)&localAddr, sizeof(localAddr)))
+	{
+		DEBUG_PRINT_WSA_ERROR("bind");
+		goto lblErrorCleanup;
+	}
+
+	/* Start listening */
+	if (SOCKET_ERROR == listen(listenSocket, iBacklog))
+	{
+		DEBUG_PRINT_WSA_ERROR("listen");
+		goto lblErrorCleanup;
+	}
+
+	*pListenSocket = listenSocket;
+	return TRUE;
+
+lblErrorCleanup:
+	SAFE_CLOSE_SOCKET(listenSocket);
+
+	return FALSE;
+}
+
+/******************************************************************************
+ * CreateWakeSocket Function
+ * Create a non-blocking loopback UDP socket, which can be added to a select 
+ * set so other threads can wake it up by sending a datagram to its port.
+ *****************************************************************************/
+static BOOL CreateWakeSocket(OUT SOCKET * pWakeSocket, OUT USHORT * puPort)
+{
+	sockaddr_in localAddr = {0};
+
+	SOCKET wakeSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (INVALID_SOCKET == wakeSocket)
+	{
+		DEBUG_PRINT_WSA_ERROR("socket");
+		goto lblErrorCleanup;
+	}
+
+	localAddr.sin_family = AF_INET;
+	localAddr.sin_addr.s_addr = inet_addr(LOCALHOST_ADDR);
+	localAddr.sin_port = 0;
+	if (SOCKET_ERROR == ::bind(wakeSocket, (SOCKADDR *)&localAddr, sizeof(localAddr)))
+	{
+		DEBUG_PRINT_WSA_ERROR("bind");
+		goto lblErrorCleanup;
+	}
+
+	int localAddrSize = sizeof(localAddr);
+	if (SOCKET_ERROR == getsockname(wakeSocket, (SOCKADDR *)&localAddr, &localAddrSize))
+	{
+		DEBUG_PRINT_WSA_ERROR("getsockname");
+		goto lblErrorCleanup;
+	}
+
+	u_long ulNonBlocking = 1;
+	if (SOCKET_ERROR == ioctlsocket(wakeSocket, FIONBIO, &ulNonBlocking))
+	{
+		DEBUG_PRINT_WSA_ERROR("ioctlsocket");
+		goto lblErrorCleanup;
+	}
+
+	*pWakeSocket = wakeSocket;
+	*puPort = ntohs(localAddr.sin_port);
+	return TRUE;
+
+lblErrorCleanup:
+	SAFE_CLOSE_SOCKET(wakeSocket);
+
+	return FALSE;
+}
+
 /******************************************************************************
  * ConnectSocket Function
  *****************************************************************************/
@@ -489,6 +594,89 @@ static BOOL SocketDisableTcpDelay(SOCKET hSock)
 	return TRUE;
 }
 
+/******************************************************************************
+ * SocketGetPeerProcessId Function
+ * Find the process at the other end of a local stream socket, either an
+ * AF_UNIX or a loopback TCP one. Returns 0 if it can't be found.
+ *****************************************************************************/
+static DWORD SocketGetPeerProcessId(SOCKET hSock)
+{
+	sockaddr_storage tLocalAddr = { 0 };
+	int iLocalAddrSize = sizeof(tLocalAddr);
+	if (SOCKET_ERROR == getsockname(hSock, (SOCKADDR *)&tLocalAddr, &iLocalAddrSize))
+	{
+		DEBUG_PRINT_WSA_ERROR("getsockname");
+		return 0;
+	}
+
+	if (AF_UNIX == tLocalAddr.ss_family)
+	{
+		ULONG ulPeerPid = 0;
+		DWORD cbBytesReturned = 0;
+		if (SOCKET_ERROR == WSAIoctl(hSock, SIO_AF_UNIX_GETPEERPID, NULL, 0, &ulPeerPid, sizeof(ulPeerPid), &cbBytesReturned, NULL, NULL))
+		{
+			DEBUG_PRINT_WSA_ERROR("WSAIoctl");
+			return 0;
+		}
+
+		return ulPeerPid;
+	}
+
+	if (AF_INET != tLocalAddr.ss_family)
+	{
+		return 0;
+	}
+
+	sockaddr_in tPeerAddr = { 0 };
+	int iPeerAddrSize = sizeof(tPeerAddr);
+	if (SOCKET_ERROR == getpeername(hSock, (SOCKADDR *)&tPeerAddr, &iPeerAddrSize))
+	{
+		DEBUG_PRINT_WSA_ERROR("getpeername");
+		return 0;
+	}
+
+	/* The table may grow between the calls, retry a few times */
+	PMIB_TCPTABLE_OWNER_PID ptTable = NULL;
+	DWORD dwTableSize = sizeof(MIB_TCPTABLE_OWNER_PID);
+	DWORD dwResult = ERROR_INSUFFICIENT_BUFFER;
+	for (int iTry = 0; (iTry < 3) && (ERROR_INSUFFICIENT_BUFFER == dwResult); iTry++)
+	{
+		free(ptTable);
+		ptTable = (PMIB_TCPTABLE_OWNER_PID)malloc(dwTableSize);
+		if (NULL == ptTable)
+		{
+			return 0;
+		}
+		dwResult = GetExtendedTcpTable(ptTable, &dwTableSize, FALSE, AF_INET, TCP_TABLE_OWNER_PID_CONNECTIONS, 0);
+	}
+	if (NO_ERROR != dwResult)
+	{
+		DEBUG_PRINT_ERROR("GetExtendedTcpTable has failed: %u", dwResult);
+		free(ptTable);
+		return 0;
+	}
+
+	/* The peer's end of the connection is the one whose local address is the
+	 * peer's, and whose remote address is ours. Ports are in network order */
+	const sockaddr_in * ptLocalAddr = (const sockaddr_in *)&tLocalAddr;
+	DWORD dwPeerPid = 0;
+	for (DWORD i = 0; i < ptTable->dwNumEntries; i++)
+	{
+		const MIB_TCPROW_OWNER_PID * ptRow = &(ptTable->table[i]);
+		if ((ptRow->dwLocalAddr == tPeerAddr.sin_addr.s_addr) &&
+			((USHORT)ptRow->dwLocalPort == tPeerAddr.sin_port) &&
+			(ptRow->dwRemoteAddr == ptLocalAddr->sin_addr.s_addr) &&
+			((USHORT)ptRow->dwRemotePort == ptLocalAddr->sin_port))
+		{
+			dwPeerPid = ptRow->dwOwningPid;
+			break;
+		}
+	}
+	free(ptTable);
+
+	return dwPeerPid;
+}
+
 #ifdef __cplusplus
 
 namespace MCE
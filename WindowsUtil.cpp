@@ -86,6 +86,94 @@ void FreeNullSecurityAttributes(LPSECURITY_ATTRIBUTES ptSecurityAttributes)
 	}
 }
 
+/******************************************************************************
+ * CreateProcessUserSecurityAttributes Function
+ *****************************************************************************/
+BOOL CreateProcessUserSecurityAttributes(DWORD dwProcessId, DWORD dwAccessMask, OUT LPSECURITY_ATTRIBUTES ptSecurityAttributes)
+{
+	BOOL bRet = FALSE;
+	HANDLE hProcess = NULL;
+	HANDLE hToken = NULL;
+	TOKEN_USER * ptTokenUser = NULL;
+	PSECURITY_DESCRIPTOR ptSecurityDesc = NULL;
+	PACL ptAcl = NULL;
+	DWORD dwTokenUserSize = 0;
+	DWORD dwAclSize = 0;
+
+	if (NULL == ptSecurityAttributes)
+	{
+		return FALSE;
+	}
+
+	/* Find the process' user */
+	hProcess = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, dwProcessId);
+	if (NULL == hProcess)
+	{
+		DEBUG_PRINT_WIN32_ERROR("OpenProcess");
+		goto lblCleanup;
+	}
+	if (FALSE == OpenProcessToken(hProcess, TOKEN_QUERY, &hToken))
+	{
+		DEBUG_PRINT_WIN32_ERROR("OpenProcessToken");
+		goto lblCleanup;
+	}
+	(void)GetTokenInformation(hToken, TokenUser, NULL, 0, &dwTokenUserSize);
+	ptTokenUser = (TOKEN_USER *)LocalAlloc(LPTR, dwTokenUserSize);
+	if (NULL == ptTokenUser)
+	{
+		goto lblCleanup;
+	}
+	if (FALSE == GetTokenInformation(hToken, TokenUser, ptTokenUser, dwTokenUserSize, &dwTokenUserSize))
+	{
+		DEBUG_PRINT_WIN32_ERROR("GetTokenInformation");
+		goto lblCleanup;
+	}
+
+	/* The SECURITY_DESCRIPTOR is followed by its DACL in the same allocation,
+	 * with a single ACE for the user */
+	dwAclSize = sizeof(ACL) + sizeof(ACCESS_ALLOWED_ACE) - sizeof(DWORD) + GetLengthSid(ptTokenUser->User.Sid);
+	ptSecurityDesc = (PSECURITY_DESCRIPTOR)LocalAlloc(LPTR, SECURITY_DESCRIPTOR_MIN_LENGTH + dwAclSize);
+	if (NULL == ptSecurityDesc)
+	{
+		goto lblCleanup;
+	}
+	ptAcl = (PACL)((BYTE *)ptSecurityDesc + SECURITY_DESCRIPTOR_MIN_LENGTH);
+	if ((FALSE == InitializeSecurityDescriptor(ptSecurityDesc, SECURITY_DESCRIPTOR_REVISION)) ||
+		(FALSE == InitializeAcl(ptAcl, dwAclSize, ACL_REVISION)) ||
+		(FALSE == AddAccessAllowedAce(ptAcl, ACL_REVISION, dwAccessMask, ptTokenUser->User.Sid)) ||
+		(FALSE == SetSecurityDescriptorDacl(ptSecurityDesc, TRUE, ptAcl, FALSE)))
+	{
+		DEBUG_PRINT_WIN32_ERROR("SetSecurityDescriptorDacl");
+		goto lblCleanup;
+	}
+
+	ptSecurityAttributes->nLength = sizeof(SECURITY_ATTRIBUTES);
+	ptSecurityAttributes->lpSecurityDescriptor = ptSecurityDesc;
+	ptSecurityAttributes->bInheritHandle = FALSE;
+	ptSecurityDesc = NULL;
+	bRet = TRUE;
+
+lblCleanup:
+	if (NULL != ptSecurityDesc)
+	{
+		LocalFree(ptSecurityDesc);
+	}
+	if (NULL != ptTokenUser)
+	{
+		LocalFree(ptTokenUser);
+	}
+	if (NULL != hToken)
+	{
+		CloseHandle(hToken);
+	}
+	if (NULL != hProcess)
+	{
+		CloseHandle(hProcess);
+	}
+
+	return bRet;
+}
+
 /******************************************************************************
  * CreateUuidStringWithFormat Function
  * Internal helper function for CreateUuidString and CreateUniqueObjectName.
@@ -123,6 +123,13 @@ BOOL CreateNullSecurityAttributes(OUT LPSECURITY_ATTRIBUTES ptSecurityAttributes
  *****************************************************************************/
 void FreeNullSecurityAttributes(LPSECURITY_ATTRIBUTES ptSecurityAttributes);
 
+/******************************************************************************
+ * CreateProcessUserSecurityAttributes Function
+ * Create a SECURITY_ATTRIBUTES whose DACL only allows the user running the
+ * given process, with the given access. Free it with FreeNullSecurityAttributes.
+ *****************************************************************************/
+BOOL CreateProcessUserSecurityAttributes(DWORD dwProcessId, DWORD dwAccessMask, OUT LPSECURITY_ATTRIBUTES ptSecurityAttributes);
+
 /******************************************************************************
  * CreateUuidString Function
  * Create a UUID string, similar to the output 
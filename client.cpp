@@ -49,10 +49,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "client.h"
 #include "device.h"
 #include "conf.h"
+#include "eventloop.h"
+#include "shmring.h"
+#include "plistscan.h"
 
 #define CMD_BUF_SIZE	0x10000
 #define REPLY_BUF_SIZE	0x10000
-#define CLIENT_SOCKET_BUFFERS_SIZE (0x10000)
 
 #define LIBUSBMXD_PLIST_BUNDLE_ID ("org.libimobiledevice.usbmuxd")
 
@@ -73,16 +75,72 @@ struct mux_client {
 	unsigned char *ib_buf;
 	uint32_t ib_size;
 	uint32_t ib_capacity;
+	uint32_t ib_offset;		// start of the received bytes not parsed yet
 	short events, devents;
 	uint32_t connect_tag;
 	int connect_device;
+	int connect_bulk;			// connecting to a Bulk class port, see client_bulk_buffers_size
 	enum client_state state;
 	uint32_t proto_version;
+	struct event_source *source;
+	struct event_loop *home_loop;	// the main loop, where unbound clients live
+	pthread_mutex_t *shard_lock;	// set while bound to a device shard, see client_bind()
+	enum plist_format_t plist_format;	// format of the last plist request, replies use it too
+	struct shm_ring *ring;			// set if the connection's data goes through shared memory
+	int ring_eof;					// the socket of a shared memory client was closed
 };
 
 static struct collection client_list;
 pthread_mutex_t client_list_mutex;
 
+// Whether ListDevices includes the devices not made visible yet, from
+// MCE_INCLUDE_HIDDEN_DEVICES
+static int device_list_include_hidden;
+
+// Socket buffer sizes of the clients connected to a Bulk class port, from
+// MCE_CLIENT_BULK_SOCKET_BUFFERS_SIZE. The sockets are made idle at the
+// listener's sizes, and only grow once they carry a bulk stream
+static int client_bulk_buffers_size;
+
+// The serialized ListDevices reply in each plist format, valid while the
+// device list generation stays the same
+struct device_list_reply {
+	char *data;
+	uint32_t size;
+	uint32_t generation;
+};
+static struct device_list_reply device_list_cache[PLIST_FORMAT_BINARY + 1];
+
+// Clients handed back by the device shards after a refused connect, waiting
+// for the main loop to list and register them again
+static struct collection client_handbacks;
+static pthread_mutex_t client_handback_mutex;
+
+/**
+ * Wake a shared memory client up, see shmring.h. The byte is only a
+ * signal, so a full socket buffer means the client has one pending anyway.
+ *
+ * @param client The client to wake up.
+ */
+static void client_kick(struct mux_client *client)
+{
+	char kick = 0;
+	(void)send(client->fd, &kick, sizeof(kick), 0);
+}
+
+/**
+ * Whether the client sent bytes right behind its Connect request, which
+ * belong to the connection and are handed to the device before the socket.
+ *
+ * @param client The client.
+ */
+static int client_has_leftovers(struct mux_client *client)
+{
+	return client->ib_buf && (client->ib_offset < client->ib_size);
+}
+
+static void client_update_connected_events(struct mux_client *client);
+
 /**
  * Receive raw data from the client socket.
  *
@@ -98,6 +156,35 @@ int client_read(struct mux_client *client, void *buffer, uint32_t len)
 		usbmuxd_log(LL_ERROR, "Attempted to read from client %d not in CONNECTED state", client->fd);
 		return -1;
 	}
+	if(client->ring) {
+		int kick;
+		uint32_t size = shm_ring_read(client->ring, buffer, len, &kick);
+		if(kick)
+			client_kick(client);
+		if(size > 0)
+			return (int)size;
+		// a corrupt ring ends the connection like a closed socket
+		if(shm_ring_corrupt(client->ring))
+			client->ring_eof = 1;
+		if(client->ring_eof)
+			return 0;
+		WSASetLastError(WSAEWOULDBLOCK);
+		return -1;
+	}
+	if(client_has_leftovers(client)) {
+		uint32_t size = client->ib_size - client->ib_offset;
+		if(size > len)
+			size = len;
+		memcpy(buffer, client->ib_buf + client->ib_offset, size);
+		client->ib_offset += size;
+		if(client->ib_offset == client->ib_size) {
+			// no longer need this
+			free(client->ib_buf);
+			client->ib_buf = NULL;
+			client_update_connected_events(client);
+		}
+		return (int)size;
+	}
 	return recv(client->fd, (char *)buffer, len, 0);
 }
 
@@ -119,6 +206,27 @@ int client_write(struct mux_client *client, void *buffer, uint32_t len)
 		return -1;
 	}
 
+	if(client->ring) {
+		int kick;
+		if(client->ring_eof) {
+			WSASetLastError(WSAECONNRESET);
+			return -1;
+		}
+		sret = (int)shm_ring_write(client->ring, buffer, len, &kick);
+		if(kick)
+			client_kick(client);
+		if((sret == 0) && shm_ring_corrupt(client->ring)) {
+			client->ring_eof = 1;
+			WSASetLastError(WSAECONNRESET);
+			return -1;
+		}
+		if(sret == 0) {
+			WSASetLastError(WSAEWOULDBLOCK);
+			return -1;
+		}
+		return sret;
+	}
+
 	sret = send(client->fd, (const char *)buffer, len, 0);
 	if (sret < 0) {
 		if (WSAGetLastError() == WSAEWOULDBLOCK) {
@@ -130,6 +238,62 @@ int client_write(struct mux_client *client, void *buffer, uint32_t len)
 	return sret;
 }
 
+/**
+ * Update the event mask the client socket is registered with
+ * in the main event loop.
+ *
+ * @param client The client to update.
+ * @param events The new event mask.
+ */
+static void client_update_events(struct mux_client *client, short events)
+{
+	client->events = events;
+	event_loop_modify(client->source, events);
+}
+
+/**
+ * Get the events the device asked for that a shared memory client can
+ * take right now. The client is asked to kick us for the others.
+ *
+ * @param client The connected client.
+ * @return The ready events, POLLIN and/or POLLOUT.
+ */
+static short client_ring_events(struct mux_client *client)
+{
+	short events = 0;
+	if((client->devents & POLLIN) && (client->ring_eof || shm_ring_poll_read(client->ring)))
+		events |= POLLIN;
+	if((client->devents & POLLOUT) && (client->ring_eof || shm_ring_poll_write(client->ring)))
+		events |= POLLOUT;
+	// the device gets to see the end of a corrupt ring, and nothing re-arms it
+	if(shm_ring_corrupt(client->ring))
+		client->ring_eof = 1;
+	return events;
+}
+
+/**
+ * Register a connected client for the events the device asked for. The
+ * socket of a shared memory client is watched for kicks, and for
+ * writability while the rings are ready, which brings the loop right back.
+ *
+ * @param client The connected client.
+ */
+static void client_update_connected_events(struct mux_client *client)
+{
+	if(!client->ring) {
+		short events = client->devents;
+		// leftovers are readable right away, writability brings the loop back for them
+		if(client_has_leftovers(client) && (events & POLLIN))
+			events |= POLLOUT;
+		client_update_events(client, events);
+		return;
+	}
+	short events = client->ring_eof ? 0 : POLLIN;
+	if(client_ring_events(client))
+		events |= POLLOUT;
+	client_update_events(client, events);
+}
+
 /**
  * Set event mask to use for ppoll()ing the client socket.
  * Typically POLLOUT and/or POLLIN. Note that this overrides
@@ -148,7 +312,7 @@ int client_set_events(struct mux_client *client, short events)
 	}
 	client->devents = events;
 	if(client->state == CLIENT_CONNECTED)
-		client->events = events;
+		client_update_connected_events(client);
 	return 0;
 }
 
@@ -157,19 +321,21 @@ int client_set_events(struct mux_client *client, short events)
  * and create a new mux_client instance for it, and store
  * the client in the client list.
  *
+ * @param loop the event loop to register the client socket with.
  * @param listenfd the socket fd to accept() on.
  * @param reject_connection should we accept the connection and close it (reject it)
  * @return The connection fd for the client, or < 0 for error
  *   in which case errno will be set.
  */
-int client_accept(int listenfd, int reject_connection)
+int client_accept(struct event_loop *loop, int listenfd, int reject_connection)
 {
-	struct sockaddr_in addr;
+	struct sockaddr_storage addr;
 	int cfd;
-	int len = sizeof(struct sockaddr_in);
+	int len = sizeof(addr);
 	cfd = accept(listenfd, (struct sockaddr *)&addr, &len);
 	if (cfd < 0) {
-		usbmuxd_log(LL_ERROR, "accept() failed (%s)", strerror(errno));
+		if (WSAGetLastError() != WSAEWOULDBLOCK)
+			usbmuxd_log(LL_ERROR, "accept() failed (%d)", WSAGetLastError());
 		return cfd;
 	}
 
@@ -179,24 +345,8 @@ int client_accept(int listenfd, int reject_connection)
 		return 0;
 	}
 
-	/* Set the new socket's buffer sizes */
-	int socket_buf_size = CLIENT_SOCKET_BUFFERS_SIZE;
-	if ((setsockopt(cfd, SOL_SOCKET, SO_SNDBUF, (const char *)&socket_buf_size, sizeof(DWORD)) < 0) ||
-		(setsockopt(cfd, SOL_SOCKET, SO_RCVBUF, (const char *)&socket_buf_size, sizeof(DWORD)) < 0))
-	{
-		usbmuxd_log(LL_ERROR, "setsockopt has failed");
-		closesocket(cfd);
-		return -1;
-	}
-
-	/* Switch the socket to a non-blocking mode */
-	unsigned long non_blocking_mode = 1;
-	if (ioctlsocket(cfd, FIONBIO, &non_blocking_mode) < 0)
-	{
-		usbmuxd_log(LL_ERROR, "ioctlsocket has failed");
-		closesocket(cfd);
-		return -1;
-	}
+	/* The buffer sizes and the non-blocking mode come with the socket, it
+	 * inherits them from the listening socket, see client_setup_listen_socket() */
 
 	struct mux_client *client;
 	client = (struct mux_client *)malloc(sizeof(struct mux_client));
@@ -211,6 +361,16 @@ int client_accept(int listenfd, int reject_connection)
 	client->ib_capacity = CMD_BUF_SIZE;
 	client->state = CLIENT_COMMAND;
 	client->events = POLLIN;
+	client->home_loop = loop;
+	client->source = event_loop_add(loop, cfd, EVENT_OWNER_CLIENT, client, client->events);
+	if (!client->source) {
+		usbmuxd_log(LL_ERROR, "Failed to register client fd %d with the event loop", cfd);
+		closesocket(cfd);
+		free(client->ob_buf);
+		free(client->ib_buf);
+		free(client);
+		return -1;
+	}
 
 	pthread_mutex_lock(&client_list_mutex);
 	collection_add(&client_list, client);
@@ -220,6 +380,90 @@ int client_accept(int listenfd, int reject_connection)
 	return client->fd;
 }
 
+/**
+ * Accept the clients waiting on a listening socket, up to a limit so that
+ * a burst of connections doesn't hold up the rest of the loop.
+ *
+ * @param loop the event loop to register the client sockets with.
+ * @param listenfd the non-blocking socket fd to accept() on.
+ * @param max_clients the most clients to accept in this call.
+ * @return The number of clients accepted, or -1 if accept() failed with
+ *   no client accepted.
+ */
+int client_accept_pending(struct event_loop *loop, int listenfd, int max_clients)
+{
+	int accepted = 0;
+	while (accepted < max_clients) {
+		if (client_accept(loop, listenfd, 0) < 0) {
+			if (WSAGetLastError() == WSAEWOULDBLOCK)
+				break;
+			return accepted ? accepted : -1;
+		}
+		accepted++;
+	}
+	return accepted;
+}
+
+/**
+ * Set the send and receive buffer sizes of a socket.
+ *
+ * @param fd the socket.
+ * @param buffers_size the size of each buffer.
+ * @return 0 on success, -1 on error.
+ */
+static int set_socket_buffers_size(int fd, int buffers_size)
+{
+	if ((setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const char *)&buffers_size, sizeof(buffers_size)) < 0) ||
+		(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char *)&buffers_size, sizeof(buffers_size)) < 0))
+		return -1;
+	return 0;
+}
+
+/**
+ * Set up a listening socket for clients. Accepted sockets inherit its
+ * options, which spares setting them on each client.
+ *
+ * @param listenfd the listening socket.
+ * @param buffers_size the socket buffer sizes of its clients, 0 to leave
+ *   them to the OS autotuning.
+ * @return 0 on success, -1 on error.
+ */
+int client_setup_listen_socket(int listenfd, int buffers_size)
+{
+	struct sockaddr_storage addr;
+	int len = sizeof(addr);
+	if (getsockname(listenfd, (struct sockaddr *)&addr, &len) < 0) {
+		usbmuxd_log(LL_ERROR, "getsockname() failed (%d)", WSAGetLastError());
+		return -1;
+	}
+
+	/* Unix sockets don't have buffer sizes */
+	if ((addr.ss_family != AF_UNIX) && (buffers_size > 0) && (set_socket_buffers_size(listenfd, buffers_size) < 0))
+	{
+		usbmuxd_log(LL_ERROR, "setsockopt has failed");
+		return -1;
+	}
+
+	/* Device data is forwarded as it arrives, often a length prefix and then
+	 * its payload, which Nagle would hold back for the client's delayed ACK.
+	 * Preflight's lockdown exchanges come through here too */
+	int tcp_no_delay = 1;
+	if ((addr.ss_family != AF_UNIX) &&
+		(setsockopt(listenfd, IPPROTO_TCP, TCP_NODELAY, (const char *)&tcp_no_delay, sizeof(tcp_no_delay)) < 0))
+	{
+		usbmuxd_log(LL_ERROR, "setsockopt has failed");
+		return -1;
+	}
+
+	unsigned long non_blocking_mode = 1;
+	if (ioctlsocket(listenfd, FIONBIO, &non_blocking_mode) < 0)
+	{
+		usbmuxd_log(LL_ERROR, "ioctlsocket has failed");
+		return -1;
+	}
+	return 0;
+}
+
 void client_close(struct mux_client *client)
 {
 	usbmuxd_log(LL_INFO, "Disconnecting client fd %d", client->fd);
@@ -228,39 +472,103 @@ void client_close(struct mux_client *client)
 		client->state = CLIENT_DEAD;
 		device_abort_connect(client->connect_device, client);
 	}
+	event_loop_remove(client->source);
 	closesocket(client->fd);
+	shm_ring_destroy(client->ring);
 	if(client->ob_buf)
 		free(client->ob_buf);
 	if(client->ib_buf)
 		free(client->ib_buf);
-	pthread_mutex_lock(&client_list_mutex);
-	collection_remove(&client_list, client);
-	pthread_mutex_unlock(&client_list_mutex);
+	if(!client->shard_lock) {
+		pthread_mutex_lock(&client_list_mutex);
+		collection_remove(&client_list, client);
+		pthread_mutex_unlock(&client_list_mutex);
+	}
 	free(client);
 }
 
-int client_add_fds(fd_set * read_fds, fd_set * write_fds)
+/**
+ * Register a client's socket with a device shard's loop, ahead of binding
+ * the client to the shard. The shard doesn't dispatch it until the caller
+ * releases the shard lock, by which time the registration was either
+ * passed to client_bind() or removed.
+ *
+ * @param client The client, in the CONNECTING1 state.
+ * @param loop The shard's event loop.
+ *
+ * @return The registration, or NULL on failure.
+ */
+struct event_source *client_register(struct mux_client *client, struct event_loop *loop)
+{
+	struct event_source *source = event_loop_add(loop, client->fd, EVENT_OWNER_CLIENT, client, client->events);
+	if(!source)
+		usbmuxd_log(LL_ERROR, "Failed to register client fd %d with its device loop", client->fd);
+	return source;
+}
+
+/**
+ * Hand a client over to a device shard for the lifetime of its connection.
+ * The client is taken off the client list and its socket is served by the
+ * shard's loop from now on. Called from the main loop, with the client list
+ * and the shard locked.
+ *
+ * @param client The client, in the CONNECTING1 state.
+ * @param source The client's registration with the shard's loop, see
+ *   client_register().
+ * @param lock The shard's lock, which guards the client from now on.
+ */
+void client_bind(struct mux_client *client, struct event_source *source, pthread_mutex_t *lock)
 {
-	int clients_count = 0;
+	collection_remove(&client_list, client);
+	event_loop_remove(client->source);
+	client->source = source;
+	client->shard_lock = lock;
+}
+
+/**
+ * Give a bound client back to the main loop once its connect was refused.
+ * Called from the shard, which must not touch the client afterwards.
+ *
+ * @param client The client, back in the COMMAND state.
+ */
+static void client_unbind(struct mux_client *client)
+{
+	event_loop_remove(client->source);
+	client->source = NULL;
+	client->shard_lock = NULL;
+	pthread_mutex_lock(&client_handback_mutex);
+	collection_add(&client_handbacks, client);
+	pthread_mutex_unlock(&client_handback_mutex);
+	event_loop_wake(client->home_loop);
+}
+
+/**
+ * List and register again the clients handed back by the device shards.
+ * Called from the main loop.
+ */
+void client_process_handbacks(void)
+{
+	struct collection handbacks = {NULL, 0};
+	pthread_mutex_lock(&client_handback_mutex);
+	if(collection_count(&client_handbacks) > 0) {
+		handbacks = client_handbacks;
+		collection_init(&client_handbacks);
+	}
+	pthread_mutex_unlock(&client_handback_mutex);
+	if(!handbacks.list)
+		return;
+
 	pthread_mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *client, &client_list, struct mux_client *)
-	{
-		if ((client->events) & POLLIN)
-		{
-			FD_SET(client->fd, read_fds);
-		}
-		if ((client->events) & POLLOUT)
-		{
-			FD_SET(client->fd, write_fds);
+	FOREACH(struct mux_client *client, &handbacks, struct mux_client *) {
+		collection_add(&client_list, client);
+		client->source = event_loop_add(client->home_loop, client->fd, EVENT_OWNER_CLIENT, client, client->events);
+		if(!client->source) {
+			usbmuxd_log(LL_ERROR, "Failed to register client fd %d with the event loop", client->fd);
+			client_close(client);
 		}
-
-		/* To make sure we have enough available fds to use, we'll assume all client 
-		 * have data */
-		clients_count++;
 	} ENDFOREACH
 	pthread_mutex_unlock(&client_list_mutex);
-
-	return clients_count;
+	collection_free(&handbacks);
 }
 
 static int send_pkt(struct mux_client *client, uint32_t tag, enum usbmuxd_msgtype msg, void *payload, int payload_length)
@@ -290,21 +598,40 @@ static int send_pkt(struct mux_client *client, uint32_t tag, enum usbmuxd_msgtyp
 	if(payload && payload_length)
 		memcpy(client->ob_buf + client->ob_size + sizeof(hdr), payload, payload_length);
 	client->ob_size += hdr.length;
-	client->events |= POLLOUT;
+	client_update_events(client, client->events | POLLOUT);
 	return hdr.length;
 }
 
+/**
+ * Serialize a plist for a client.
+ *
+ * @param plist The plist to serialize.
+ * @param format PLIST_FORMAT_XML or PLIST_FORMAT_BINARY.
+ * @param data Set to the serialized plist, to be freed with plist_free_memory(),
+ *   or NULL on error.
+ * @param size Set to the length of the serialized plist.
+ */
+static void plist_serialize(plist_t plist, enum plist_format_t format, char **data, uint32_t *size)
+{
+	*data = NULL;
+	*size = 0;
+	if (format == PLIST_FORMAT_BINARY)
+		plist_to_bin(plist, data, size);
+	else
+		plist_to_xml(plist, data, size);
+	if (!*data)
+		usbmuxd_log(LL_ERROR, "%s: Could not serialize plist", __func__);
+}
+
 static int send_plist_pkt(struct mux_client *client, uint32_t tag, plist_t plist)
 {
 	int res = -1;
-	char *xml = NULL;
-	uint32_t xmlsize = 0;
-	plist_to_xml(plist, &xml, &xmlsize);
-	if (xml) {
-		res = send_pkt(client, tag, MESSAGE_PLIST, xml, xmlsize);
-		plist_free_memory(xml);
-	} else {
-		usbmuxd_log(LL_ERROR, "%s: Could not convert plist to xml", __func__);
+	char *data = NULL;
+	uint32_t size = 0;
+	plist_serialize(plist, client->plist_format, &data, &size);
+	if (data) {
+		res = send_pkt(client, tag, MESSAGE_PLIST, data, size);
+		plist_free_memory(data);
 	}
 	return res;
 }
@@ -326,6 +653,25 @@ static int send_result(struct mux_client *client, uint32_t tag, uint32_t result)
 	return res;
 }
 
+/**
+ * Reply to a connect request. Clients that asked for shared memory get the
+ * name and ring size of the section along with the result.
+ */
+static int send_connect_result(struct mux_client *client, uint32_t tag, uint32_t result)
+{
+	if(!client->ring)
+		return send_result(client, tag, result);
+
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "MessageType", plist_new_string("Result"));
+	plist_dict_set_item(dict, "Number", plist_new_uint(result));
+	plist_dict_set_item(dict, "SharedMemoryName", plist_new_string(shm_ring_name(client->ring)));
+	plist_dict_set_item(dict, "SharedMemorySize", plist_new_uint(shm_ring_size(client->ring)));
+	int res = send_plist_pkt(client, tag, dict);
+	plist_free(dict);
+	return res;
+}
+
 int client_notify_connect(struct mux_client *client, enum usbmuxd_result result)
 {
 	usbmuxd_log(LL_SPEW, "client_notify_connect fd %d result %d", client->fd, result);
@@ -335,16 +681,28 @@ int client_notify_connect(struct mux_client *client, enum usbmuxd_result result)
 		usbmuxd_log(LL_ERROR, "client_notify_connect when client %d is not in CONNECTING1 state", client->fd);
 		return -1;
 	}
-	if(send_result(client, client->connect_tag, result) < 0)
+	if(client->ring && (result != RESULT_OK)) {
+		shm_ring_destroy(client->ring);
+		client->ring = NULL;
+	}
+	if(send_connect_result(client, client->connect_tag, result) < 0)
 		return -1;
 	if(result == RESULT_OK) {
 		client->state = CLIENT_CONNECTING2;
-		client->events = POLLOUT; // wait for the result packet to go through
-		// no longer need this
-		free(client->ib_buf);
-		client->ib_buf = NULL;
+		client_update_events(client, POLLOUT); // wait for the result packet to go through
+		// no longer need this, unless it holds the first bytes of the connection
+		if(client->ring || !client_has_leftovers(client)) {
+			free(client->ib_buf);
+			client->ib_buf = NULL;
+		}
 	} else {
 		client->state = CLIENT_COMMAND;
+		// take commands again, client_unbind registers the client with these
+		client->events |= POLLIN;
+		if(client->shard_lock)
+			client_unbind(client);
+		else
+			client_update_events(client, client->events);
 	}
 	return 0;
 }
@@ -380,28 +738,23 @@ static plist_t create_device_pairing_event_plist(struct device_info *dev, const
 	return dict;
 }
 
-static int send_device_list(struct mux_client *client, uint32_t tag)
+/**
+ * Build the serialized reply to ListDevices, for the current device list.
+ *
+ * @param format The plist format of the reply.
+ * @param data Set to the reply, to be freed with plist_free_memory().
+ * @param size Set to the length of the reply.
+ */
+static void create_device_list_reply(enum plist_format_t format, char **data, uint32_t *size)
 {
-	int res = -1;
 	plist_t dict = plist_new_dict();
 	plist_t devices = plist_new_array();
 
 	struct device_info *devs = NULL;
 	struct device_info *dev;
 	int i;
-	mce_log("send_device_list");
-	///////////////////////////////////////////////////////
-	// add support for MCE_INCLUDE_HIDDEN_DEVICES env var
-	int include_hidden = 0;
-	TCHAR includeHiddenVar[0x40] = { 0 };
-	if (GetEnvironmentVariable(TEXT("MCE_INCLUDE_HIDDEN_DEVICES"), includeHiddenVar, sizeof(includeHiddenVar) / sizeof(TCHAR))){
-		if (0 == _tcsicmp(includeHiddenVar, TEXT("true"))) {
-			include_hidden = 1;
-		}
-	}
-	///////////////////////////////////////////////////////
 
-	int count = device_get_list(include_hidden, &devs);
+	int count = device_get_list(device_list_include_hidden, &devs);
 	dev = devs;
 	for (i = 0; devs && i < count; i++) {
 		plist_t device = create_device_attached_plist(dev++);
@@ -412,6 +765,101 @@ static int send_device_list(struct mux_client *client, uint32_t tag)
 	if (devs)
 		free(devs);
 
+	plist_dict_set_item(dict, "DeviceList", devices);
+	plist_serialize(dict, format, data, size);
+	plist_free(dict);
+}
+
+/**
+ * Reply to ListDevices. The reply is cached until the device list
+ * changes, as some tools poll it several times a second. Only called
+ * from the main loop, with the client list locked.
+ */
+static int send_device_list(struct mux_client *client, uint32_t tag)
+{
+	mce_log("send_device_list");
+	uint32_t generation = device_get_list_generation();
+	struct device_list_reply *cache = &device_list_cache[client->plist_format];
+	if (!cache->data || (cache->generation != generation)) {
+		if (cache->data)
+			plist_free_memory(cache->data);
+		// a change racing with the rebuild only costs another one next time
+		create_device_list_reply(client->plist_format, &cache->data, &cache->size);
+		cache->generation = generation;
+	}
+	if (!cache->data)
+		return -1;
+	return send_pkt(client, tag, MESSAGE_PLIST, cache->data, cache->size);
+}
+
+static plist_t create_connection_statistics_plist(struct connection_stats *cs)
+{
+	const char *priority_name = device_priority_name(cs->priority);
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "SourcePort", plist_new_uint(cs->sport));
+	plist_dict_set_item(dict, "PortNumber", plist_new_uint(cs->dport));
+	if (priority_name)
+		plist_dict_set_item(dict, "Priority", plist_new_string(priority_name));
+	plist_dict_set_item(dict, "BytesSent", plist_new_uint(cs->tx_bytes));
+	plist_dict_set_item(dict, "BytesReceived", plist_new_uint(cs->rx_bytes));
+	plist_dict_set_item(dict, "PacketsSent", plist_new_uint(cs->tx_packets));
+	plist_dict_set_item(dict, "PacketsReceived", plist_new_uint(cs->rx_packets));
+	plist_dict_set_item(dict, "WindowStalls", plist_new_uint(cs->window_stalls));
+	plist_dict_set_item(dict, "AckTimeouts", plist_new_uint(cs->ack_timeouts));
+	plist_dict_set_item(dict, "SendWindow", plist_new_uint(cs->send_window));
+	plist_dict_set_item(dict, "ReceiveWindow", plist_new_uint(cs->recv_window));
+	plist_dict_set_item(dict, "QueuedBytes", plist_new_uint(cs->queued));
+	return dict;
+}
+
+static plist_t create_device_statistics_plist(struct device_stats *ds)
+{
+	int i;
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "DeviceID", plist_new_uint(ds->id));
+	plist_dict_set_item(dict, "LocationID", plist_new_uint(ds->location));
+	plist_dict_set_item(dict, "BytesSent", plist_new_uint(ds->tx_bytes));
+	plist_dict_set_item(dict, "BytesReceived", plist_new_uint(ds->rx_bytes));
+	plist_dict_set_item(dict, "PacketsSent", plist_new_uint(ds->tx_packets));
+	plist_dict_set_item(dict, "PacketsReceived", plist_new_uint(ds->rx_packets));
+	plist_dict_set_item(dict, "ResetsSent", plist_new_uint(ds->rst_sent));
+	plist_dict_set_item(dict, "ResetsReceived", plist_new_uint(ds->rst_received));
+	plist_dict_set_item(dict, "ConnectionsOpened", plist_new_uint(ds->connections_opened));
+	plist_dict_set_item(dict, "ConnectionsRefused", plist_new_uint(ds->connections_refused));
+	plist_dict_set_item(dict, "ConnectTimeouts", plist_new_uint(ds->connect_timeouts));
+
+	plist_t usb = plist_new_dict();
+	plist_dict_set_item(usb, "BytesSent", plist_new_uint(ds->usb.tx_bytes));
+	plist_dict_set_item(usb, "TransfersSent", plist_new_uint(ds->usb.tx_transfers));
+	plist_dict_set_item(usb, "ZeroLengthPackets", plist_new_uint(ds->usb.tx_zlps));
+	plist_dict_set_item(usb, "BytesReceived", plist_new_uint(ds->usb.rx_bytes));
+	plist_dict_set_item(usb, "TransfersReceived", plist_new_uint(ds->usb.rx_transfers));
+	plist_dict_set_item(usb, "PendingBytes", plist_new_uint(ds->usb.tx_pending));
+	plist_dict_set_item(usb, "MaxPendingBytes", plist_new_uint(ds->usb.tx_pending_max));
+	plist_dict_set_item(dict, "USB", usb);
+
+	plist_t connections = plist_new_array();
+	for (i = 0; i < ds->num_connections; i++) {
+		plist_array_append_item(connections, create_connection_statistics_plist(&ds->connections[i]));
+	}
+	plist_dict_set_item(dict, "Connections", connections);
+	return dict;
+}
+
+static int send_statistics(struct mux_client *client, uint32_t tag)
+{
+	int res = -1;
+	int i;
+	plist_t dict = plist_new_dict();
+	plist_t devices = plist_new_array();
+
+	struct device_stats *stats = NULL;
+	int count = device_get_statistics(&stats);
+	for (i = 0; stats && i < count; i++) {
+		plist_array_append_item(devices, create_device_statistics_plist(&stats[i]));
+	}
+	device_free_statistics(stats, count);
+
 	plist_dict_set_item(dict, "DeviceList", devices);
 	res = send_plist_pkt(client, tag, dict);
 	plist_free(dict);
@@ -442,26 +890,9 @@ static int send_pair_record(struct mux_client *client, uint32_t tag, const char*
 		return send_result(client, tag, EINVAL);
 	}
 
-	config_get_device_record(record_id, &record_data, &record_size);
-	
-	if (record_data) {
-		plist_t pair_record_dict = NULL;
-		plist_from_xml(record_data, record_size, &pair_record_dict);
-		if (pair_record_dict) {
-			if ((NULL == plist_dict_get_item(pair_record_dict, "DeviceCertificate")) ||
-				(NULL == plist_dict_get_item(pair_record_dict, "HostID")) ||
-				(NULL == plist_dict_get_item(pair_record_dict, "SystemBUID")))
-			{
-				usbmuxd_log(LL_ERROR, "Partial pairing record");
-				plist_free(pair_record_dict);
-				free(record_data);
-				return send_result(client, tag, ENOENT);
-			}
+	/* records missing keys are refused, as if there were none */
+	config_get_complete_device_record(record_id, &record_data, &record_size);
 
-			plist_free(pair_record_dict);
-		}
-	}
-	
 	if (record_data) {
 		plist_t dict = plist_new_dict();
 		plist_dict_set_item(dict, "PairRecordData", plist_new_data(record_data, record_size));
@@ -474,6 +905,24 @@ static int send_pair_record(struct mux_client *client, uint32_t tag, const char*
 	return res;
 }
 
+static void create_device_record(struct usbmuxd_device_record *dmsg, struct device_info *dev)
+{
+	memset(dmsg, 0, sizeof(*dmsg));
+	dmsg->device_id = dev->id;
+	strncpy(dmsg->serial_number, dev->serial, 256);
+	dmsg->serial_number[255] = 0;
+	dmsg->location = dev->location;
+	dmsg->product_id = dev->pid;
+}
+
+static plist_t create_device_detached_plist(uint32_t device_id)
+{
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "MessageType", plist_new_string("Detached"));
+	plist_dict_set_item(dict, "DeviceID", plist_new_uint(device_id));
+	return dict;
+}
+
 static int notify_device_add(struct mux_client *client, struct device_info *dev)
 {
 	mce_log("notify_device_add id:%d location:%d serial:%s pid:%x", dev->id, dev->location, dev->serial, dev->pid);
@@ -486,33 +935,54 @@ static int notify_device_add(struct mux_client *client, struct device_info *dev)
 	} else {
 		/* binary packet */
 		struct usbmuxd_device_record dmsg;
-		memset(&dmsg, 0, sizeof(dmsg));
-		dmsg.device_id = dev->id;
-		strncpy(dmsg.serial_number, dev->serial, 256);
-		dmsg.serial_number[255] = 0;
-		dmsg.location = dev->location;
-		dmsg.product_id = dev->pid;
+		create_device_record(&dmsg, dev);
 		res = send_pkt(client, 0, MESSAGE_DEVICE_ADD, &dmsg, sizeof(dmsg));
 	}
 	return res;
 }
 
-static int notify_device_remove(struct mux_client *client, uint32_t device_id)
+/**
+ * Send a device event to all listening clients. The event is serialized
+ * once per protocol version and plist format, instead of once per client.
+ * XML, which most clients use, is made before locking the client list,
+ * the binary plist only once a client needs it.
+ *
+ * @param dict The event for protocol version 1 clients.
+ * @param msg The message type for protocol version 0 clients.
+ * @param payload The binary payload for protocol version 0 clients, or
+ *   NULL if they don't get this event.
+ * @param payload_length Length of the binary payload.
+ */
+static void broadcast_device_event(plist_t dict, enum usbmuxd_msgtype msg, void *payload, int payload_length)
 {
-	mce_log("notify_device_remove id:%d ", device_id);
-	int res = -1;
-	if (client->proto_version == 1) {
-		/* XML plist packet */
-		plist_t dict = plist_new_dict();
-		plist_dict_set_item(dict, "MessageType", plist_new_string("Detached"));
-		plist_dict_set_item(dict, "DeviceID", plist_new_uint(device_id));
-		res = send_plist_pkt(client, 0, dict);
-		plist_free(dict);
-	} else {
-		/* binary packet */
-		res = send_pkt(client, 0, MESSAGE_DEVICE_REMOVE, &device_id, sizeof(uint32_t));
+	char *data[PLIST_FORMAT_BINARY + 1] = { NULL, NULL };
+	uint32_t size[PLIST_FORMAT_BINARY + 1] = { 0, 0 };
+	int serialized[PLIST_FORMAT_BINARY + 1] = { 1, 0 };
+	plist_serialize(dict, PLIST_FORMAT_XML, &data[PLIST_FORMAT_XML], &size[PLIST_FORMAT_XML]);
+
+	pthread_mutex_lock(&client_list_mutex);
+	FOREACH(struct mux_client *client, &client_list, struct mux_client *)
+	{
+		if (client->state != CLIENT_LISTEN)
+			continue;
+		if (client->proto_version == 1) {
+			enum plist_format_t format = client->plist_format;
+			if (!serialized[format]) {
+				plist_serialize(dict, format, &data[format], &size[format]);
+				serialized[format] = 1;
+			}
+			if (data[format])
+				send_pkt(client, 0, MESSAGE_PLIST, data[format], size[format]);
+		} else if (payload) {
+			send_pkt(client, 0, msg, payload, payload_length);
+		}
+	} ENDFOREACH
+	pthread_mutex_unlock(&client_list_mutex);
+
+	for (int i = 0; i <= PLIST_FORMAT_BINARY; i++) {
+		if (data[i])
+			plist_free_memory(data[i]);
 	}
-	return res;
 }
 
 static int start_listen(struct mux_client *client)
@@ -594,48 +1064,105 @@ static int handle_save_pair_record_command(struct mux_client *client, struct usb
 	return 0;
 }
 
-static int handle_connect_command(struct mux_client *client, struct usbmuxd_header *hdr, plist_t command_dict)
+/**
+ * Start connecting a client to a device port. The client goes to the
+ * CONNECTING1 state up front, since once the device accepts the request the
+ * client belongs to the device's shard.
+ *
+ * @param client The client, in the COMMAND state.
+ * @param tag The tag of the Connect request.
+ * @param device_id The device to connect to.
+ * @param port The device port, in host byte order.
+ * @param ring_size The size of the shared memory rings asked for, or 0.
+ * @return 1 if the connect is underway, in which case the client may already
+ *   be served by a device shard and must not be touched anymore, 0 if it was
+ *   refused, or -1 if the refusal could not be sent.
+ */
+static int start_connect(struct mux_client *client, uint32_t tag, uint32_t device_id, uint16_t port, uint32_t ring_size)
 {
-	int res = -1;
-	uint64_t val;
-	uint16_t portnum = 0;
-	uint32_t device_id = 0;
+	if(ring_size) {
+		// not fatal, the client falls back to the socket if the reply has no section
+		client->ring = shm_ring_create(ring_size, client->fd);
+		if(!client->ring)
+			usbmuxd_log(LL_WARNING, "Client %d gets no shared memory rings", client->fd);
+	}
+	client->connect_tag = tag;
+	client->connect_device = device_id;
+	client->connect_bulk = (device_get_port_priority(port) == CONN_PRIO_BULK);
+	client->state = CLIENT_CONNECTING1;
+	// bytes sent behind the Connect belong to the connection, leave them in
+	// the socket until it is established
+	client_update_events(client, client->events & ~POLLIN);
+	int res = device_start_connect(device_id, port, client);
+	if(res < 0) {
+		client->state = CLIENT_COMMAND;
+		client_update_events(client, client->events | POLLIN);
+		shm_ring_destroy(client->ring);
+		client->ring = NULL;
+		if(send_result(client, tag, -res) < 0)
+			return -1;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * Fill in the fields of a parsed Connect request, the way the plist scanner
+ * would have.
+ *
+ * @param command_dict The request.
+ * @param command Set to the request's fields.
+ */
+static void get_connect_command(plist_t command_dict, struct plist_command *command)
+{
+	memset(command, 0, sizeof(*command));
 
-	// get device id
 	plist_t node = plist_dict_get_item(command_dict, "DeviceID");
-	if (!node) {
+	if (node) {
+		plist_get_uint_val(node, &command->device_id);
+		command->fields |= PLIST_COMMAND_DEVICE_ID;
+	}
+	node = plist_dict_get_item(command_dict, "PortNumber");
+	if (node) {
+		plist_get_uint_val(node, &command->port_number);
+		command->fields |= PLIST_COMMAND_PORT_NUMBER;
+	}
+	node = plist_dict_get_item(command_dict, "SharedMemoryRing");
+	if (node && (plist_get_node_type(node) == PLIST_UINT)) {
+		plist_get_uint_val(node, &command->shared_memory_ring);
+		command->fields |= PLIST_COMMAND_SHARED_MEMORY_RING;
+	}
+}
+
+static int handle_connect_command(struct mux_client *client, struct usbmuxd_header *hdr, const struct plist_command *command)
+{
+	// get device id
+	if (!(command->fields & PLIST_COMMAND_DEVICE_ID)) {
 		usbmuxd_log(LL_ERROR, "Received connect request without device_id!");
 		if (send_result(client, hdr->tag, RESULT_BADDEV) < 0)
 			return -1;
 		return 0;
 	}
-	val = 0;
-	plist_get_uint_val(node, &val);
-	device_id = (uint32_t)val;
+	uint32_t device_id = (uint32_t)command->device_id;
 
 	// get port number
-	node = plist_dict_get_item(command_dict, "PortNumber");
-	if (!node) {
+	if (!(command->fields & PLIST_COMMAND_PORT_NUMBER)) {
 		usbmuxd_log(LL_ERROR, "Received connect request without port number!");
 		if (send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
 			return -1;
 		return 0;
 	}
-	val = 0;
-	plist_get_uint_val(node, &val);
-	portnum = (uint16_t)val;
+	uint16_t portnum = (uint16_t)command->port_number;
 
-	usbmuxd_log(LL_DEBUG, "Client %d connection request to device %d port %d", client->fd, device_id, ntohs(portnum));
-	res = device_start_connect(device_id, ntohs(portnum), client);
-	if(res < 0) {
-		if (send_result(client, hdr->tag, -res) < 0)
-			return -1;
-	} else {
-		client->connect_tag = hdr->tag;
-		client->connect_device = device_id;
-		client->state = CLIENT_CONNECTING1;
+	// optional, see shmring.h
+	uint32_t ring_size = 0;
+	if (command->fields & PLIST_COMMAND_SHARED_MEMORY_RING) {
+		uint64_t val = command->shared_memory_ring;
+		ring_size = (val > SHM_RING_MAX_SIZE) ? SHM_RING_MAX_SIZE : (uint32_t)val;
 	}
-	return 0;
+
+	usbmuxd_log(LL_DEBUG, "Client %d connection request to device %d port %d", client->fd, device_id, ntohs(portnum));
+	return start_connect(client, hdr->tag, device_id, ntohs(portnum), ring_size);
 }
 
 static int handle_read_pair_record_command(struct mux_client *client, struct usbmuxd_header *hdr, plist_t command_dict)
@@ -780,6 +1307,40 @@ static int handle_device_monitor_command(struct mux_client *client, struct usbmu
 	return 0;
 }
 
+static int handle_set_port_priority_command(struct mux_client *client, struct usbmuxd_header *hdr, plist_t command_dict)
+{
+	/* Get the port number (in host byte order, unlike Connect's) */
+	uint64_t port = 0;
+	plist_t port_node = plist_dict_get_item(command_dict, "PortNumber");
+	if (port_node && (PLIST_UINT == plist_get_node_type(port_node))) {
+		plist_get_uint_val(port_node, &port);
+	}
+
+	/* Get the priority class */
+	int priority = -1;
+	char *priority_name = plist_dict_get_string_val(command_dict, "Priority");
+	if (priority_name) {
+		priority = device_parse_priority(priority_name);
+		plist_free_memory(priority_name);
+	}
+
+	mce_log("handle_set_port_priority_command port:%d priority:%d", (int)port, priority);
+	if (!port || (port > 0xFFFF) || (priority < 0)) {
+		usbmuxd_log(LL_ERROR, "Invalid SetPortPriority request");
+		return send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0 ? -1 : 0;
+	}
+
+	uint32_t rval = RESULT_OK;
+	if (device_set_port_priority((uint16_t)port, (enum conn_priority)priority) < 0) {
+		rval = ENOMEM;
+	}
+
+	if (send_result(client, hdr->tag, rval) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
 static int handle_client_plist_command(struct mux_client *client, struct usbmuxd_header *hdr)
 {
 	int res = -1;
@@ -790,7 +1351,30 @@ static int handle_client_plist_command(struct mux_client *client, struct usbmuxd
 	char * payload = (char*)(hdr)+sizeof(struct usbmuxd_header);
 	uint32_t payload_size = hdr->length - sizeof(struct usbmuxd_header);
 
-	plist_from_xml(payload, payload_size, &command_dict);
+	/* Reply in the format the request came in */
+	if ((payload_size >= 8) && (0 == memcmp(payload, "bplist00", 8)))
+		client->plist_format = PLIST_FORMAT_BINARY;
+	else
+		client->plist_format = PLIST_FORMAT_XML;
+
+	/* The most frequent commands only need a few fields, which are scanned
+	   straight out of the payload. Anything else is parsed with libplist */
+	struct plist_command command;
+	if (plist_scan_command(payload, payload_size, client->plist_format, &command) == 0) {
+		if (plist_command_is(&command, "Connect"))
+			return handle_connect_command(client, hdr, &command);
+		if (plist_command_is(&command, "ListDevices"))
+			return send_device_list(client, hdr->tag) < 0 ? -1 : 0;
+		if (plist_command_is(&command, "Listen"))
+			return handle_listen_command(client, hdr);
+		if (plist_command_is(&command, "ReadBUID"))
+			return send_system_buid(client, hdr->tag) < 0 ? -1 : 0;
+	}
+
+	if (client->plist_format == PLIST_FORMAT_BINARY)
+		plist_from_bin(payload, payload_size, &command_dict);
+	else
+		plist_from_xml(payload, payload_size, &command_dict);
 	if (!command_dict) {
 		mce_log( "Could not parse plist from payload!");
 		return -1;
@@ -811,7 +1395,8 @@ static int handle_client_plist_command(struct mux_client *client, struct usbmuxd
 
 	/* Connect */
 	} else if (!strcmp(message, "Connect")) {
-		res = handle_connect_command(client, hdr, command_dict);
+		get_connect_command(command_dict, &command);
+		res = handle_connect_command(client, hdr, &command);
 
 	/* ListDevices */
 	} else if (!strcmp(message, "ListDevices")) {
@@ -845,6 +1430,14 @@ static int handle_client_plist_command(struct mux_client *client, struct usbmuxd
 	} else if (!strcmp(message, "DeviceMonitor")) {
 		res = handle_device_monitor_command(client, hdr, command_dict);
 
+	/* GetStatistics */
+	} else if (!strcmp(message, "GetStatistics")) {
+		res = send_statistics(client, hdr->tag) < 0 ? -1 : 0;
+
+	/* SetPortPriority */
+	} else if (!strcmp(message, "SetPortPriority")) {
+		res = handle_set_port_priority_command(client, hdr, command_dict);
+
 	/* Unknown */
 	} else {
 		usbmuxd_log(LL_ERROR, "Unexpected command '%s' received!", message);
@@ -860,17 +1453,8 @@ static int handle_client_plist_command(struct mux_client *client, struct usbmuxd
 
 static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 {
-	int res;
 	usbmuxd_log(LL_DEBUG, "Client command in fd %d len %d ver %d msg %d tag %d", client->fd, hdr->length, hdr->version, hdr->message, hdr->tag);
 
-	if(client->state != CLIENT_COMMAND) {
-		usbmuxd_log(LL_ERROR, "Client %d command received in the wrong state", client->fd);
-		if(send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
-			return -1;
-		client_close(client);
-		return -1;
-	}
-
 	if((hdr->version != 0) && (hdr->version != 1)) {
 		usbmuxd_log(LL_INFO, "Client %d version mismatch: expected 0 or 1, got %d", client->fd, hdr->version);
 		send_result(client, hdr->tag, RESULT_BADVERSION);
@@ -890,16 +1474,7 @@ static int client_command(struct mux_client *client, struct usbmuxd_header *hdr)
 		case MESSAGE_CONNECT:
 			ch = (struct usbmuxd_connect_request *)hdr;
 			usbmuxd_log(LL_DEBUG, "Client %d connection request to device %d port %d", client->fd, ch->device_id, ntohs(ch->port));
-			res = device_start_connect(ch->device_id, ntohs(ch->port), client);
-			if(res < 0) {
-				if(send_result(client, hdr->tag, -res) < 0)
-					return -1;
-			} else {
-				client->connect_tag = hdr->tag;
-				client->connect_device = ch->device_id;
-				client->state = CLIENT_CONNECTING1;
-			}
-			return 0;
+			return start_connect(client, hdr->tag, ch->device_id, ntohs(ch->port), 0);
 		default:
 			usbmuxd_log(LL_ERROR, "Client %d invalid command %d", client->fd, hdr->message);
 			if(send_result(client, hdr->tag, RESULT_BADCOMMAND) < 0)
@@ -914,7 +1489,7 @@ static void process_send(struct mux_client *client)
 	int res;
 	if(!client->ob_size) {
 		usbmuxd_log(LL_WARNING, "Client %d OUT process but nothing to send?", client->fd);
-		client->events &= ~POLLOUT;
+		client_update_events(client, client->events & ~POLLOUT);
 		return;
 	}
 	res = send(client->fd, (const char *)(client->ob_buf), client->ob_size, 0);
@@ -925,11 +1500,15 @@ static void process_send(struct mux_client *client)
 	}
 	if((uint32_t)res == client->ob_size) {
 		client->ob_size = 0;
-		client->events &= ~POLLOUT;
+		client_update_events(client, client->events & ~POLLOUT);
 		if(client->state == CLIENT_CONNECTING2) {
 			usbmuxd_log(LL_DEBUG, "Client %d switching to CONNECTED state", client->fd);
 			client->state = CLIENT_CONNECTED;
-			client->events = client->devents;
+			// not fatal, the stream just goes through the smaller buffers
+			if(client->connect_bulk && !client->ring && (client_bulk_buffers_size > 0) &&
+				(set_socket_buffers_size(client->fd, client_bulk_buffers_size) < 0))
+				usbmuxd_log(LL_DEBUG, "Client %d keeps its socket buffer sizes: %d", client->fd, WSAGetLastError());
+			client_update_connected_events(client);
 			// no longer need this
 			free(client->ob_buf);
 			client->ob_buf = NULL;
@@ -939,154 +1518,152 @@ static void process_send(struct mux_client *client)
 		memmove(client->ob_buf, client->ob_buf + res, client->ob_size);
 	}
 }
+/**
+ * Read whatever the client sent and run every complete command in it, so
+ * that a command takes a single recv() and pipelined commands don't wait for
+ * another loop iteration each.
+ *
+ * @param client The client, in the COMMAND or LISTEN state.
+ */
 static void process_recv(struct mux_client *client)
 {
 	int res;
-	int did_read = 0;
-	if(client->ib_size < sizeof(struct usbmuxd_header)) {
-		res = recv(client->fd, (char *)(client->ib_buf) + client->ib_size, sizeof(struct usbmuxd_header) - client->ib_size, 0);
-		if(res <= 0) {
-			usbmuxd_log(LL_ERROR, "DBG: RECV client fd %d failed: %u", client->fd, WSAGetLastError());
-			
-			if(res < 0)
-				usbmuxd_log(LL_ERROR, "Receive from client fd %d failed: %s", client->fd, strerror(errno));
-			else
-				usbmuxd_log(LL_INFO, "Client %d connection closed", client->fd);
-			client_close(client);
-			return;
-		}
-		client->ib_size += res;
-		if(client->ib_size < sizeof(struct usbmuxd_header))
-			return;
-		did_read = 1;
-	}
-	struct usbmuxd_header *hdr = (struct usbmuxd_header *)client->ib_buf;
-	if(hdr->length > client->ib_capacity) {
-		usbmuxd_log(LL_INFO, "Client %d message is too long (%d bytes)", client->fd, hdr->length);
-		client_close(client);
-		return;
+
+	// move what is left from the last read to the front
+	if(client->ib_offset) {
+		client->ib_size -= client->ib_offset;
+		memmove(client->ib_buf, client->ib_buf + client->ib_offset, client->ib_size);
+		client->ib_offset = 0;
 	}
-	if(hdr->length < sizeof(struct usbmuxd_header)) {
-		usbmuxd_log(LL_ERROR, "Client %d message is too short (%d bytes)", client->fd, hdr->length);
+
+	res = recv(client->fd, (char *)(client->ib_buf) + client->ib_size, client->ib_capacity - client->ib_size, 0);
+	if(res <= 0) {
+		if(res < 0)
+			usbmuxd_log(LL_ERROR, "Receive from client fd %d failed: %u", client->fd, WSAGetLastError());
+		else
+			usbmuxd_log(LL_INFO, "Client %d connection closed", client->fd);
 		client_close(client);
 		return;
 	}
-	if(client->ib_size < hdr->length) {
-		if(did_read)
-			return; //maybe we would block, so defer to next loop
-		res = recv(client->fd, (char *)(client->ib_buf) + client->ib_size, hdr->length - client->ib_size, 0);
-		if(res < 0) {
-			usbmuxd_log(LL_ERROR, "Receive from client fd %d failed: %s", client->fd, strerror(errno));
+	client->ib_size += res;
+
+	while(client->ib_size - client->ib_offset >= sizeof(struct usbmuxd_header)) {
+		struct usbmuxd_header *hdr = (struct usbmuxd_header *)(client->ib_buf + client->ib_offset);
+		if(hdr->length > client->ib_capacity) {
+			usbmuxd_log(LL_INFO, "Client %d message is too long (%d bytes)", client->fd, hdr->length);
 			client_close(client);
 			return;
-		} else if(res == 0) {
-			usbmuxd_log(LL_INFO, "Client %d connection closed", client->fd);
+		}
+		if(hdr->length < sizeof(struct usbmuxd_header)) {
+			usbmuxd_log(LL_ERROR, "Client %d message is too short (%d bytes)", client->fd, hdr->length);
+			client_close(client);
+			return;
+		}
+		if(client->ib_size - client->ib_offset < hdr->length)
+			return;
+
+		if(client->state != CLIENT_COMMAND) {
+			usbmuxd_log(LL_ERROR, "Client %d command received in the wrong state", client->fd);
+			send_result(client, hdr->tag, RESULT_BADCOMMAND);
 			client_close(client);
 			return;
 		}
-		client->ib_size += res;
-		if(client->ib_size < hdr->length)
+
+		// consume first, anything after a Connect is the connection's data
+		client->ib_offset += hdr->length;
+		if(client_command(client, hdr) > 0)
+			return;
+		if(client->state != CLIENT_COMMAND)
 			return;
 	}
-	client_command(client, hdr);
-	client->ib_size = 0;
 }
 
-int client_process(fd_set * read_fds, fd_set * write_fds)
+/**
+ * Consume the kicks a shared memory client sent, and find out whether it
+ * closed its socket.
+ *
+ * @param client The connected client.
+ */
+static void client_drain_kicks(struct mux_client *client)
 {
-	pthread_mutex_lock(&client_list_mutex);
-	FOREACH(struct mux_client *client, &client_list, struct mux_client *)
-	{
-		short events = 0;
-		if (FD_ISSET(client->fd, read_fds))
-		{
-			events |= POLLIN;
-		}
-		if (FD_ISSET(client->fd, write_fds))
-		{
-			events |= POLLOUT;
-		}
+	char kicks[64];
+	int res;
+	while((res = recv(client->fd, kicks, sizeof(kicks), 0)) > 0)
+		;
+	if((res == 0) || (WSAGetLastError() != WSAEWOULDBLOCK)) {
+		usbmuxd_log(LL_INFO, "Client %d connection closed", client->fd);
+		client->ring_eof = 1;
+	}
+}
 
+/**
+ * Handle the socket events the main loop reported for a client.
+ *
+ * @param client The client whose socket is ready.
+ * @param events The ready events, POLLIN and/or POLLOUT.
+ */
+void client_process(struct mux_client *client, short events)
+{
+	// bound clients are served by their device shard, which already holds its lock
+	pthread_mutex_t *lock = client->shard_lock ? client->shard_lock : &client_list_mutex;
+	pthread_mutex_lock(lock);
+	if (client->state == CLIENT_CONNECTED && client->ring) {
+		if (events & POLLIN)
+			client_drain_kicks(client);
+		events = client_ring_events(client);
 		if (events)
-		{
-			if (client->state == CLIENT_CONNECTED)
-			{
-				usbmuxd_log(LL_SPEW, "client_process in CONNECTED state");
-				device_client_process(client->connect_device, client, events);
-			}
-			else
-			{
-				if (events & POLLIN)
-				{
-					process_recv(client);
-				}
-				else if (events & POLLOUT)
-				{
-					//not both in case client died as part of process_recv
-					process_send(client);
-				}
-			}
-		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
-
-	return 0;
+			device_client_process(client->connect_device, client, events);
+		else
+			client_update_connected_events(client);
+	} else if (client->state == CLIENT_CONNECTED) {
+		usbmuxd_log(LL_SPEW, "client_process in CONNECTED state");
+		if (client_has_leftovers(client))
+			events = (events & client->devents) | (client->devents & POLLIN);
+		device_client_process(client->connect_device, client, events);
+	} else if (events & POLLIN) {
+		process_recv(client);
+	} else if (events & POLLOUT) {
+		//not both in case client died as part of process_recv
+		process_send(client);
+	}
+	pthread_mutex_unlock(lock);
 }
 
 void client_device_add(struct device_info *dev)
 {
 	device_set_visible(dev->id);
 
-	pthread_mutex_lock(&client_list_mutex);
 	usbmuxd_log(LL_MCE, "client_device_add: id %d, location 0x%x, serial %s", dev->id, dev->location, dev->serial);
-	
-	FOREACH(struct mux_client *client, &client_list, struct mux_client *)
-	{
-		if(client->state == CLIENT_LISTEN)
-			notify_device_add(client, dev);
-	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
+	struct usbmuxd_device_record dmsg;
+	create_device_record(&dmsg, dev);
+	plist_t dict = create_device_attached_plist(dev);
+	broadcast_device_event(dict, MESSAGE_DEVICE_ADD, &dmsg, sizeof(dmsg));
+	plist_free(dict);
 }
 
 void client_device_remove(int device_id)
 {
-	pthread_mutex_lock(&client_list_mutex);
 	uint32_t id = device_id;
 	usbmuxd_log(LL_MCE, "client_device_remove: id %d", device_id);
-	FOREACH(struct mux_client *client, &client_list, struct mux_client *)
-	{
-		if(client->state == CLIENT_LISTEN)
-			notify_device_remove(client, id);
-	} ENDFOREACH
-	pthread_mutex_unlock(&client_list_mutex);
+	plist_t dict = create_device_detached_plist(id);
+	broadcast_device_event(dict, MESSAGE_DEVICE_REMOVE, &id, sizeof(uint32_t));
+	plist_free(dict);
 }
 
 static void client_device_pairing_event(struct device_info *dev, const char * event, int validate_device)
 {
-	/* Lock the devices list, to make sure the device exists while we send
-	 * an event about it */
-	device_lock_devices();
-	
-	if (!validate_device || device_exists(dev->id, 0)) {
-		pthread_mutex_lock(&client_list_mutex);
+	/* The devices list isn't held while sending, as it ranks below the
+	 * client list in the lock order. A removal racing with the event is
+	 * reported to the clients right after it anyway */
+	if (!validate_device || device_exists(dev->id, 1)) {
 		usbmuxd_log(LL_DEBUG, "client_device_pairing_event: id %d, location 0x%x, serial %s, event - %s", dev->id, dev->location, dev->serial, event);
-		FOREACH(struct mux_client *client, &client_list, struct mux_client *)
-		{
-			/* We only support XML plist */
-			if ((client->state == CLIENT_LISTEN) && (client->proto_version == 1)) {
-				plist_t dict = create_device_pairing_event_plist(dev, event);
-				if (send_plist_pkt(client, 0, dict) < 0) {
-					usbmuxd_log(LL_ERROR, "client_device_pairing_event: Failed to send plist");
-				}
-				plist_free(dict);
-			}
-		} ENDFOREACH
-		pthread_mutex_unlock(&client_list_mutex);	
+		/* We only support XML plist */
+		plist_t dict = create_device_pairing_event_plist(dev, event);
+		broadcast_device_event(dict, MESSAGE_PLIST, NULL, 0);
+		plist_free(dict);
 	} else {
 		usbmuxd_log(LL_DEBUG, "client_device_pairing_event: Device id %d, location 0x%x, was removed - ignoring %s event", dev->id, dev->location, event); \
 	}
-	
-	device_unlock_devices();
 }
 
 void client_device_removed_during_add(struct device_info *dev)
@@ -1121,14 +1698,30 @@ void client_init(void)
 	usbmuxd_log(LL_DEBUG, "client_init");
 	collection_init(&client_list);
 	pthread_mutex_init(&client_list_mutex, NULL);
+	collection_init(&client_handbacks);
+	pthread_mutex_init(&client_handback_mutex, NULL);
+
+	char include_hidden[0x40];
+	device_list_include_hidden = (env_get_string("MCE_INCLUDE_HIDDEN_DEVICES", include_hidden, sizeof(include_hidden)) > 0) &&
+		(0 == _stricmp(include_hidden, "true"));
+	memset(device_list_cache, 0, sizeof(device_list_cache));
+	client_bulk_buffers_size = env_get_int("MCE_CLIENT_BULK_SOCKET_BUFFERS_SIZE", CLIENT_BULK_SOCKET_BUFFERS_SIZE);
 }
 
 void client_shutdown(void)
 {
 	usbmuxd_log(LL_DEBUG, "client_shutdown");
+	client_process_handbacks();
 	FOREACH(struct mux_client *client, &client_list, struct mux_client *) {
 		client_close(client);
 	} ENDFOREACH
 	pthread_mutex_destroy(&client_list_mutex);
 	collection_free(&client_list);
+	pthread_mutex_destroy(&client_handback_mutex);
+	collection_free(&client_handbacks);
+	for (int i = 0; i <= PLIST_FORMAT_BINARY; i++) {
+		if (device_list_cache[i].data)
+			plist_free_memory(device_list_cache[i].data);
+	}
+	memset(device_list_cache, 0, sizeof(device_list_cache));
 }
@@ -23,10 +23,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #define __CLIENT_H__
 
 #include <stdint.h>
+#include <pthread.h>
 #include "usbmuxd-proto.h"
 
+// Default client socket buffer sizes, for all clients and for the clients
+// connected to a Bulk class port. 0 leaves the sizes to the OS autotuning
+#define CLIENT_SOCKET_BUFFERS_SIZE (0x10000)
+#define CLIENT_BULK_SOCKET_BUFFERS_SIZE (0x100000)
+
 struct device_info;
 struct mux_client;
+struct event_loop;
+struct event_source;
 
 int client_read(struct mux_client *client, void *buffer, uint32_t len);
 int client_write(struct mux_client *client, void *buffer, uint32_t len);
@@ -42,9 +50,13 @@ void client_device_password_protected(struct device_info *dev);
 void client_device_user_denied_pairing(struct device_info *dev);
 void client_device_error_already_exits(struct device_info *dev);
 
-int client_accept(int fd, int reject_connection);
-int client_process(fd_set * read_fds, fd_set * write_fds);
-int client_add_fds(fd_set * read_fds, fd_set * write_fds);
+int client_accept(struct event_loop *loop, int fd, int reject_connection);
+int client_accept_pending(struct event_loop *loop, int listenfd, int max_clients);
+int client_setup_listen_socket(int listenfd, int buffers_size);
+void client_process(struct mux_client *client, short events);
+struct event_source *client_register(struct mux_client *client, struct event_loop *loop);
+void client_bind(struct mux_client *client, struct event_source *source, pthread_mutex_t *lock);
+void client_process_handbacks(void);
 
 void client_init(void);
 void client_shutdown(void);
@@ -54,6 +54,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #endif
 
 #include <errno.h>
+#include <pthread.h>
 
 #ifdef WIN32
 #include <shlobj.h>
@@ -102,7 +103,21 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  * pre-generated keys, certs and ids. */
 #define LOCAL_CONFIG_FILE "etc"DIR_SEP_S"LockdownConfiguration"CONFIG_EXT
 
+/* How often, in ms, the SystemConfiguration file is checked for changes */
+#define CONFIG_REFRESH_INTERVAL 5000
+
 static char *__config_dir = NULL;
+static int __config_dir_created = 0;
+
+/* The SystemConfiguration file in use and the SystemBUID read from it, kept
+ * until the file is seen to change. Guarded by config_mutex */
+static pthread_mutex_t config_mutex;
+static char *config_file = NULL;
+static int config_local = 0;
+static time_t config_file_mtime = 0;
+static uint64_t config_checked = 0;
+static uint64_t config_refresh_interval = CONFIG_REFRESH_INTERVAL;
+static char *config_system_buid = NULL;
 
 #ifdef WIN32
 static char *config_utf16_to_utf8(wchar_t *unistr, long len, long *items_read, long *items_written)
@@ -139,7 +154,7 @@ static char *config_utf16_to_utf8(wchar_t *unistr, long len, long *items_read, l
 }
 #endif
 
-int config_has_local_config()
+static int config_stat_local_config()
 {
 	struct stat config_file_st;
 
@@ -239,14 +254,61 @@ static int mkdir_with_parents(const char *dir, int mode)
 }
 
 /**
- * Creates a freedesktop compatible configuration directory.
+ * Creates a freedesktop compatible configuration directory. Once it exists,
+ * it isn't looked at again until config_config_dir_lost says it is gone.
  */
 static void config_create_config_dir(void)
 {
+	if (__config_dir_created)
+		return;
+
 	const char *config_path = config_get_config_dir();
 	struct stat st;
-	if (stat(config_path, &st) != 0) {
-		mkdir_with_parents(config_path, 0755);
+	if ((stat(config_path, &st) == 0) || (mkdir_with_parents(config_path, 0755) == 0)) {
+		__config_dir_created = 1;
+	}
+}
+
+static void config_config_dir_lost(void)
+{
+	__config_dir_created = 0;
+}
+
+static const char *config_active_file(int local)
+{
+	return local ? LOCAL_CONFIG_FILE : config_file;
+}
+
+static time_t config_get_mtime(const char *file)
+{
+	struct stat st;
+	if (!file || (stat(file, &st) != 0))
+		return 0;
+	return st.st_mtime;
+}
+
+/**
+ * Drops what was read from the SystemConfiguration file if it changed, or
+ * if the local config appeared or went away. The files are looked at once
+ * every config_refresh_interval ms at most. Must be called with config_mutex
+ * held.
+ */
+static void config_refresh(void)
+{
+	uint64_t now = mstime64();
+	if (config_checked && ((now - config_checked) < config_refresh_interval))
+		return;
+	config_checked = now;
+
+	int local = config_stat_local_config();
+	time_t mtime = config_get_mtime(config_active_file(local));
+	if ((local != config_local) || (mtime != config_file_mtime)) {
+		if (config_system_buid)
+			usbmuxd_log(LL_DEBUG, "%s changed, reloading it", config_active_file(local));
+		free(config_system_buid);
+		config_system_buid = NULL;
+		config_local = local;
+		config_file_mtime = mtime;
 	}
 }
 
@@ -325,24 +387,20 @@ static int internal_set_value(const char *config_file, const char *key, plist_t
 	return 1;
 }
 
+/* Must be called with config_mutex held */
 static int config_set_value(const char *key, plist_t value)
 {
-	const char *config_path = NULL;
-	char *config_file = NULL;
-
-	if (config_has_local_config()) {
-		return internal_set_value(LOCAL_CONFIG_FILE, key, value);
+	config_refresh();
+	if (!config_local) {
+		/* Make sure config directory exists */
+		config_create_config_dir();
 	}
-	
-	/* Make sure config directory exists */
-	config_create_config_dir();
 
-	config_path = config_get_config_dir();
-	config_file = string_concat(config_path, DIR_SEP_S, CONFIG_FILE, NULL);
-	
-	int result = internal_set_value(config_file, key, value);
+	const char *file = config_active_file(config_local);
+	int result = internal_set_value(file, key, value);
 
-	free(config_file);
+	/* Our own change needs no reload */
+	config_file_mtime = config_get_mtime(file);
 
 	return result;
 }
@@ -367,23 +425,26 @@ static int internal_get_value(const char* config_file, const char *key, plist_t
 	return 1;
 }
 
+/* Must be called with config_mutex held */
 static int config_get_value(const char *key, plist_t *value)
 {
-	const char *config_path = NULL;
-	char *config_file = NULL;
-
-	if (config_has_local_config()) {
-		return internal_get_value(LOCAL_CONFIG_FILE, key, value);
-	}
-	
-	config_path = config_get_config_dir();
-	config_file = string_concat(config_path, DIR_SEP_S, CONFIG_FILE, NULL);
-	
-	int result = internal_get_value(config_file, key, value);
+	config_refresh();
+	return internal_get_value(config_active_file(config_local), key, value);
+}
 
-	free(config_file);
+/**
+ * Determines whether the local, preconfigured, config file is used.
+ *
+ * @return 1 if LOCAL_CONFIG_FILE is used or 0 otherwise.
+ */
+int config_has_local_config()
+{
+	pthread_mutex_lock(&config_mutex);
+	config_refresh();
+	int res = config_local;
+	pthread_mutex_unlock(&config_mutex);
 
-	return result;
+	return res;
 }
 
 /**
@@ -396,31 +457,308 @@ static int config_set_system_buid(const char *system_buid)
 	return config_set_value(CONFIG_SYSTEM_BUID_KEY, plist_new_string(system_buid));
 }
 
+/* Parsed pairing records are kept in memory, so that reading one does not
+ * touch the disk. Saving or removing a record updates the cache right away,
+ * and a writer thread brings the record files up to date behind it. */
+struct device_record {
+	char *udid;
+	char *data;		/* the record as XML, NULL while its removal is pending */
+	uint64_t size;
+	char *host_id;
+	int partial;	/* misses keys the clients need, see device_record_parse */
+	int dirty;		/* changed since it was last written out */
+};
+
+static struct collection device_records;
+static pthread_mutex_t device_records_mutex;
+static CONDITION_VARIABLE device_records_cond;
+static int device_records_writing = 0;
+static int device_records_stopping = 0;
+static HANDLE device_records_thread = NULL;
+
+static char *device_record_path(const char *udid)
+{
+	return string_concat(config_get_config_dir(), DIR_SEP_S, udid, CONFIG_EXT, NULL);
+}
+
 /**
- * Determines whether a pairing record is present for the given device.
+ * Takes the HostID out of a parsed pairing record, and checks that it has
+ * what a client reading it expects.
+ */
+static void device_record_parse(struct device_record *record, plist_t plist)
+{
+	char **host_id = &record->host_id;
+
+	free(record->host_id);
+	record->host_id = NULL;
+	record->partial = 0;
+	if (!plist || plist_get_node_type(plist) != PLIST_DICT)
+		return;
+
+	plist_t n = plist_dict_get_item(plist, CONFIG_HOST_ID_KEY);
+	if (n && (plist_get_node_type(n) == PLIST_STRING)) {
+		COPY_PLIST_STRING_VAL(n, host_id);
+	}
+
+	if (!plist_dict_get_item(plist, "DeviceCertificate") ||
+		!plist_dict_get_item(plist, CONFIG_HOST_ID_KEY) ||
+		!plist_dict_get_item(plist, CONFIG_SYSTEM_BUID_KEY)) {
+		record->partial = 1;
+	}
+}
+
+static void device_record_free(struct device_record *record)
+{
+	collection_remove(&device_records, record);
+	free(record->udid);
+	free(record->data);
+	free(record->host_id);
+	free(record);
+}
+
+/**
+ * Looks a pairing record up in the cache. Must be called with
+ * device_records_mutex held.
  *
- * @param udid The device UDID as given by the device.
+ * @param udid The device UDID.
+ * @param load Whether to read the record from disk if it isn't cached yet.
+ *     Records that aren't on disk aren't cached, so that one written by
+ *     another process shows up, and unknown UDIDs don't pile up.
  *
- * @return 1 if there's a pairing record for the given udid or 0 otherwise.
+ * @return The cached record, or NULL if there is none (or out of memory).
  */
-int config_has_device_record(const char *udid)
+static struct device_record *device_record_get(const char *udid, int load)
+{
+	FOREACH(struct device_record *record, &device_records, struct device_record *) {
+		if (!strcmp(record->udid, udid))
+			return record;
+	} ENDFOREACH
+
+	struct device_record *record = (struct device_record*)calloc(1, sizeof(struct device_record));
+	if (!record)
+		return NULL;
+	record->udid = strdup(udid);
+	if (!record->udid) {
+		free(record);
+		return NULL;
+	}
+
+	if (load) {
+		/* ensure config directory exists */
+		config_create_config_dir();
+
+		char *device_record_file = device_record_path(udid);
+		buffer_read_from_filename(device_record_file, &record->data, &record->size);
+		if (record->data) {
+			plist_t plist = NULL;
+			if ((record->size >= 8) && (memcmp(record->data, "bplist00", 8) == 0)) {
+				plist_from_bin(record->data, record->size, &plist);
+			} else {
+				plist_from_xml(record->data, record->size, &plist);
+			}
+			device_record_parse(record, plist);
+			if (plist)
+				plist_free(plist);
+		}
+		free(device_record_file);
+
+		if (!record->data) {
+			free(record->udid);
+			free(record);
+			return NULL;
+		}
+	}
+
+	collection_add(&device_records, record);
+	return record;
+}
+
+/**
+ * Writes a file through a temporary one next to it, so that it holds either
+ * the old or the new contents whatever happens meanwhile.
+ *
+ * @return 0 on success or a negative errno otherwise.
+ */
+static int write_file_atomically(const char *filename, const char *data, uint64_t size)
 {
 	int res = 0;
-	if (!udid) return 0;
+	char *tmp_filename = string_concat(filename, ".tmp", NULL);
+	if (!tmp_filename)
+		return -ENOMEM;
+
+	FILE *f = fopen(tmp_filename, "wb");
+	if (!f) {
+		res = -errno;
+		free(tmp_filename);
+		return res;
+	}
+	if ((fwrite(data, 1, (size_t)size, f) != size) || (fflush(f) != 0))
+		res = -EIO;
+	fclose(f);
 
+	if (res == 0) {
+#ifdef WIN32
+		if (!MoveFileExA(tmp_filename, filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+			res = -EIO;
+#else
+		if (rename(tmp_filename, filename) != 0)
+			res = -errno;
+#endif
+	}
+	if (res != 0)
+		remove(tmp_filename);
+	free(tmp_filename);
+
+	return res;
+}
+
+/**
+ * Brings a record file up to date, removing it if data is NULL.
+ */
+static void device_record_persist(const char *udid, const char *data, uint64_t size)
+{
 	/* ensure config directory exists */
 	config_create_config_dir();
 
-	/* build file path */
-	const char *config_path = config_get_config_dir();
-	char *device_record_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
+	char *device_record_file = device_record_path(udid);
+	if (data) {
+		int res = write_file_atomically(device_record_file, data, size);
+		if (res != 0) {
+			usbmuxd_log(LL_ERROR, "%s: could not write '%s': %s", __func__, device_record_file, strerror(-res));
+			/* have the next write check for the directory again */
+			config_config_dir_lost();
+		}
+	} else if ((remove(device_record_file) != 0) && (errno != ENOENT)) {
+		usbmuxd_log(LL_ERROR, "%s: could not remove '%s': %s", __func__, device_record_file, strerror(errno));
+	}
+	free(device_record_file);
+}
 
-	struct stat st;
+/**
+ * Hands a changed record to the writer thread. Once the writer is gone, the
+ * record is written right away. Must be called with device_records_mutex held.
+ */
+static void device_record_changed(struct device_record *record)
+{
+	if (device_records_writing) {
+		record->dirty = 1;
+		WakeAllConditionVariable(&device_records_cond);
+	} else {
+		device_record_persist(record->udid, record->data, record->size);
+		if (!record->data)
+			device_record_free(record);
+	}
+}
 
-	if ((stat(device_record_file, &st) == 0) && S_ISREG(st.st_mode))
-		res = 1;
+static unsigned __stdcall device_records_writer(void* userdata)
+{
+	pthread_mutex_lock(&device_records_mutex);
+	for (;;) {
+		struct device_record *dirty = NULL;
+		FOREACH(struct device_record *record, &device_records, struct device_record *) {
+			if (record->dirty) {
+				dirty = record;
+				break;
+			}
+		} ENDFOREACH
 
-	free(device_record_file);
+		if (!dirty) {
+			if (device_records_stopping)
+				break;
+			SleepConditionVariableCS(&device_records_cond, &device_records_mutex, INFINITE);
+			continue;
+		}
+
+		/* Write a copy out, so that the record can change meanwhile. If it
+		 * does, it is marked dirty again and written once more */
+		char *udid = strdup(dirty->udid);
+		char *data = NULL;
+		uint64_t size = dirty->size;
+		if (dirty->data) {
+			data = (char*)malloc((size_t)size);
+			if (data)
+				memcpy(data, dirty->data, (size_t)size);
+		}
+		dirty->dirty = 0;
+		if (!udid || (dirty->data && !data)) {
+			usbmuxd_log(LL_ERROR, "%s: Out of memory, pairing record for %s not written", __func__, dirty->udid);
+			free(udid);
+			free(data);
+			continue;
+		}
+
+		pthread_mutex_unlock(&device_records_mutex);
+		device_record_persist(udid, data, size);
+		free(udid);
+		free(data);
+		pthread_mutex_lock(&device_records_mutex);
+
+		/* Only the writer frees records while it runs, so dirty is still
+		 * valid. A removed record is forgotten once its file is gone */
+		if (!dirty->dirty && !dirty->data)
+			device_record_free(dirty);
+	}
+	device_records_writing = 0;
+	pthread_mutex_unlock(&device_records_mutex);
+
+	return 0;
+}
+
+void config_init(void)
+{
+	/* Resolve the config paths once, and check for changes from now on */
+	pthread_mutex_init(&config_mutex, NULL);
+	config_refresh_interval = env_get_int("MCE_CONFIG_REFRESH_INTERVAL", CONFIG_REFRESH_INTERVAL);
+	config_file = string_concat(config_get_config_dir(), DIR_SEP_S, CONFIG_FILE, NULL);
+	config_create_config_dir();
+
+	collection_init(&device_records);
+	pthread_mutex_init(&device_records_mutex, NULL);
+	InitializeConditionVariable(&device_records_cond);
+	device_records_stopping = 0;
+	device_records_writing = 1;
+
+	/* Not through pthread_create(), config_shutdown() joins the writer */
+	device_records_thread = (HANDLE)_beginthreadex(NULL, 0, device_records_writer, NULL, 0, NULL);
+	if (!device_records_thread) {
+		usbmuxd_log(LL_ERROR, "%s: could not start the pairing record writer, writing records synchronously", __func__);
+		device_records_writing = 0;
+	}
+}
+
+void config_shutdown(void)
+{
+	/* Wait for the writer to write the pending records out. The cache stays,
+	 * records saved from now on are written synchronously */
+	pthread_mutex_lock(&device_records_mutex);
+	device_records_stopping = 1;
+	WakeAllConditionVariable(&device_records_cond);
+	pthread_mutex_unlock(&device_records_mutex);
+
+	if (device_records_thread) {
+		WaitForSingleObject(device_records_thread, INFINITE);
+		CloseHandle(device_records_thread);
+		device_records_thread = NULL;
+	}
+}
+
+/**
+ * Determines whether a pairing record is present for the given device.
+ *
+ * @param udid The device UDID as given by the device.
+ *
+ * @return 1 if there's a pairing record for the given udid or 0 otherwise.
+ */
+int config_has_device_record(const char *udid)
+{
+	int res = 0;
+	if (!udid) return 0;
+
+	pthread_mutex_lock(&device_records_mutex);
+	struct device_record *record = device_record_get(udid, 1);
+	if (record && record->data)
+		res = 1;
+	pthread_mutex_unlock(&device_records_mutex);
 
 	return res;
 }
@@ -435,6 +773,14 @@ int config_has_device_record(const char *udid)
  */
 void config_get_system_buid(char **system_buid)
 {
+	pthread_mutex_lock(&config_mutex);
+	config_refresh();
+	if (config_system_buid) {
+		*system_buid = strdup(config_system_buid);
+		pthread_mutex_unlock(&config_mutex);
+		return;
+	}
+
 	plist_t value = NULL;
 
 	config_get_value(CONFIG_SYSTEM_BUID_KEY, &value);
@@ -455,10 +801,14 @@ void config_get_system_buid(char **system_buid)
 	}
 
 	usbmuxd_log(LL_DEBUG, "using %s as %s", *system_buid, CONFIG_SYSTEM_BUID_KEY);
+	if (*system_buid)
+		config_system_buid = strdup(*system_buid);
+	pthread_mutex_unlock(&config_mutex);
 }
 
 /**
- * Store a pairing record for the given device identifier.
+ * Store a pairing record for the given device identifier. The record is
+ * cached right away and written to disk in the background.
  *
  * @param udid device identifier
  * @param record_data buffer containing a pairing record
@@ -486,23 +836,62 @@ int config_set_device_record(const char *udid, char* record_data, uint64_t recor
 		return -EINVAL;
 	}
 
-	/* ensure config directory exists */
-	config_create_config_dir();
+	/* records are stored as XML */
+	char *xml = NULL;
+	uint32_t xml_size = 0;
+	char *data = NULL;
+	plist_to_xml(plist, &xml, &xml_size);
+	if (xml) {
+		data = (char*)malloc(xml_size);
+		if (data)
+			memcpy(data, xml, xml_size);
+		plist_free_memory(xml);
+	}
 
-	/* build file path */
-	const char *config_path = config_get_config_dir();
-	char *device_record_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
+	pthread_mutex_lock(&device_records_mutex);
+	struct device_record *record = data ? device_record_get(udid, 0) : NULL;
+	if (record) {
+		free(record->data);
+		record->data = data;
+		record->size = xml_size;
+		device_record_parse(record, plist);
+		device_record_changed(record);
+	} else {
+		free(data);
+		res = -ENOMEM;
+	}
+	pthread_mutex_unlock(&device_records_mutex);
+
+	plist_free(plist);
+
+	return res;
+}
+
+static int device_record_copy(const char *udid, int complete, char **record_data, uint64_t *record_size)
+{
+	int res = 0;
 
-	remove(device_record_file);
+	*record_data = NULL;
+	*record_size = 0;
 
-	/* store file */
-	if (!plist_write_to_filename(plist, device_record_file, PLIST_FORMAT_XML)) {
-		usbmuxd_log(LL_DEBUG, "could not open '%s' for writing: %s", device_record_file, strerror(errno));
+	pthread_mutex_lock(&device_records_mutex);
+	struct device_record *record = device_record_get(udid, 1);
+	if (!record || !record->data) {
+		usbmuxd_log(LL_ERROR, "%s: no pairing record for %s", __func__, udid);
+		res = -ENOENT;
+	} else if (complete && record->partial) {
+		usbmuxd_log(LL_ERROR, "Partial pairing record");
 		res = -ENOENT;
+	} else {
+		*record_data = (char*)malloc((size_t)record->size);
+		if (*record_data) {
+			memcpy(*record_data, record->data, (size_t)record->size);
+			*record_size = record->size;
+		} else {
+			res = -ENOMEM;
+		}
 	}
-	free(device_record_file);
-	if (plist)
-		plist_free(plist);
+	pthread_mutex_unlock(&device_records_mutex);
 
 	return res;
 }
@@ -520,28 +909,21 @@ int config_set_device_record(const char *udid, char* record_data, uint64_t recor
  */
 int config_get_device_record(const char *udid, char **record_data, uint64_t *record_size)
 {
-	int res = 0;
-
-	/* ensure config directory exists */
-	config_create_config_dir();
-
-	/* build file path */
-	const char *config_path = config_get_config_dir();
-	char *device_record_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
-
-	/* read file */
-	buffer_read_from_filename(device_record_file, record_data, record_size);
-	if (!*record_data) {
-		usbmuxd_log(LL_ERROR, "%s: failed to read '%s': %s", __func__, device_record_file, strerror(errno));
-		res = -ENOENT;
-	}
-	free(device_record_file);
+	return device_record_copy(udid, 0, record_data, record_size);
+}
 
-	return res;
+/**
+ * Like config_get_device_record, but fails with -ENOENT for a record that
+ * misses the DeviceCertificate, HostID or SystemBUID.
+ */
+int config_get_complete_device_record(const char *udid, char **record_data, uint64_t *record_size)
+{
+	return device_record_copy(udid, 1, record_data, record_size);
 }
 
 /**
- * Remove the pairing record stored for a device from this host.
+ * Remove the pairing record stored for a device from this host. The record
+ * file is removed in the background.
  *
  * @param udid The udid of the device
  *
@@ -551,48 +933,39 @@ int config_remove_device_record(const char *udid)
 {
 	int res = 0;
 
-	/* build file path */
-	const char *config_path = config_get_config_dir();
-	char *device_record_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
-
-	/* remove file */
-	if (remove(device_record_file) != 0) {
-		res = -errno;
-		usbmuxd_log(LL_DEBUG, "could not remove %s: %s", device_record_file, strerror(errno));
+	pthread_mutex_lock(&device_records_mutex);
+	struct device_record *record = device_record_get(udid, 1);
+	if (!record || !record->data) {
+		res = -ENOENT;
+		usbmuxd_log(LL_DEBUG, "could not remove pairing record for %s: %s", udid, strerror(ENOENT));
+	} else {
+		free(record->data);
+		record->data = NULL;
+		record->size = 0;
+		device_record_parse(record, NULL);
+		device_record_changed(record);
 	}
-
-	free(device_record_file);
+	pthread_mutex_unlock(&device_records_mutex);
 
 	return res;
 }
 
-static int config_device_record_get_value(const char *udid, const char *key, plist_t *value)
-{
-	const char *config_path = NULL;
-	char *config_file = NULL;
-
-	config_path = config_get_config_dir();
-	config_file = string_concat(config_path, DIR_SEP_S, udid, CONFIG_EXT, NULL);
-
-	int result = internal_get_value(config_file, key, value);
-
-	free(config_file);
-
-	return result;
-}
-
 void config_device_record_get_host_id(const char *udid, char **host_id)
 {
 	plist_t value = NULL;
 
-	config_device_record_get_value(udid, CONFIG_HOST_ID_KEY, &value);
-
-	if (value && (plist_get_node_type(value) == PLIST_STRING)) {
-		COPY_PLIST_STRING_VAL(value, host_id);
+	pthread_mutex_lock(&device_records_mutex);
+	struct device_record *record = device_record_get(udid, 1);
+	if (record && record->host_id) {
+		*host_id = strdup(record->host_id);
 	}
-	else {
+	pthread_mutex_unlock(&device_records_mutex);
+
+	if (!*host_id) {
 		/* Try to get it from the local config */
+		pthread_mutex_lock(&config_mutex);
 		config_get_value(CONFIG_HOST_ID_KEY, &value);
+		pthread_mutex_unlock(&config_mutex);
 		if (value && (plist_get_node_type(value) == PLIST_STRING)) {
 			COPY_PLIST_STRING_VAL(value, host_id);
 		}
@@ -27,12 +27,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <plist/plist.h>
 
+void config_init(void);
+void config_shutdown(void);
+
 const char *config_get_config_dir();
 
 void config_get_system_buid(char **system_buid);
 
 int config_has_device_record(const char *udid);
 int config_get_device_record(const char *udid, char **record_data, uint64_t *record_size);
+int config_get_complete_device_record(const char *udid, char **record_data, uint64_t *record_size);
 int config_set_device_record(const char *udid, char* record_data, uint64_t record_size);
 int config_remove_device_record(const char *udid);
 
@@ -43,17 +43,64 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "client.h"
 #include "preflight.h"
 #include "usb.h"
+#include "eventloop.h"
 #include "log.h"
 
 static int next_device_id;
 
 #define DEV_MRU 65536
 
-#define CONN_INBUF_SIZE		262144
-#define CONN_OUTBUF_SIZE	65536
+/* Receive window autotuning bounds (see connection_tune_window).
+ * CONN_WIN_MIN/CONN_WIN_MAX can be overridden through the
+ * MCE_CONN_WIN_MIN/MCE_CONN_WIN_MAX environment variables. */
+#define CONN_WIN_MIN		32768
+#define CONN_WIN_INIT		65536
+#define CONN_WIN_MAX		1048576
+/* Largest window representable in th_win (which is in units of 256 bytes) */
+#define CONN_WIN_LIMIT		(0xFFFF << 8)
+/* Drain rate sampling interval */
+#define CONN_WIN_SAMPLE_INTERVAL	100
+/* A connection that hasn't drained anything for this long gets its window shrunk */
+#define CONN_WIN_IDLE_TIMEOUT	1000
 
 #define ACK_TIMEOUT 30
 
+/* A connection that hasn't been accepted or refused by the device within
+ * CONN_CONNECT_TIMEOUT is refused (0 waits forever). Optionally, the SYN
+ * is retransmitted up to CONN_SYN_RETRIES times, starting CONN_SYN_RTO
+ * after the previous one and doubling the interval each time. At most
+ * DEVICE_MAX_CONNECTING SYNs are outstanding per device, further connects
+ * wait in CONN_QUEUED. These can be overridden through the
+ * MCE_CONN_CONNECT_TIMEOUT, MCE_CONN_SYN_RETRIES, MCE_CONN_SYN_RTO and
+ * MCE_DEVICE_MAX_CONNECTING environment variables. */
+#define CONN_CONNECT_TIMEOUT	5000
+#define CONN_SYN_RETRIES		0
+#define CONN_SYN_RTO			1000
+#define DEVICE_MAX_CONNECTING	32
+
+/* Max time a reset connection may take to flush the data it holds to its
+ * client (see connection_start_drain), overridable through
+ * MCE_CONN_DRAIN_TIMEOUT. 0 makes a single attempt at teardown. */
+#define CONN_DRAIN_TIMEOUT		5000
+
+/* Deficit round robin scheduling of client data onto the device (see
+ * device_process_tx). Every backlogged connection is credited with
+ * CONN_DRR_QUANTUM bytes per round, and at most DEVICE_TX_BUDGET bytes
+ * are forwarded to a device per main loop iteration. Both can be
+ * overridden through the MCE_CONN_DRR_QUANTUM/MCE_DEVICE_TX_BUDGET
+ * environment variables. */
+#define CONN_DRR_QUANTUM	MAX_MUX_PACKET_SIZE
+#define DEVICE_TX_BUDGET	(8 * MAX_MUX_PACKET_SIZE)
+/* Bulk class connections are held back while more than this many bytes
+ * are waiting on the USB pipe, so they can't bury control traffic under
+ * megabytes of queued transfers. Overridable through MCE_BULK_TX_INFLIGHT. */
+#define BULK_TX_INFLIGHT	DEVICE_TX_BUDGET
+
+/* Max number of destination ports with a configured priority class
+ * (see device_set_port_priority) */
+#define MAX_PORT_PRIORITIES	64
+#define LOCKDOWN_PORT		62078
+
 /* Max mux packet size (used to calculate max_payload).
  * Value was taken from iTunes, original value was USB_MTU */
 #define MAX_MUX_PACKET_SIZE (0x7FFC)
@@ -72,10 +119,12 @@ enum mux_dev_state {
 };
 
 enum mux_conn_state {
+	CONN_QUEUED,		// waiting for a free connect slot, SYN not sent yet
 	CONN_CONNECTING,	// SYN
 	CONN_CONNECTED,		// SYN/SYNACK/ACK -> active
 	CONN_REFUSED,		// RST received during SYN
 	CONN_DYING,			// RST received
+	CONN_DRAINING,		// reset, still flushing received data to the client
 	CONN_DEAD			// being freed; used to prevent infinite recursion between client<->device freeing
 };
 
@@ -98,6 +147,9 @@ struct version_header
 struct mux_device;
 
 #define CONN_ACK_PENDING 1
+#define CONN_TX_THROTTLED 2
+#define CONN_SYN_SENT 4				// counted in mux_device::connecting
+#define CONN_SYN_RETRANSMITTED 8
 
 struct mux_connection
 {
@@ -113,15 +165,36 @@ struct mux_connection
 	unsigned char *ib_buf;
 	uint32_t ib_size;
 	uint32_t ib_capacity;
-	unsigned char *ob_buf;
-	uint32_t ob_capacity;
 	short events;
 	uint64_t last_ack_time;
+	// connection establishment
+	uint64_t connect_deadline;	// 0 if the connect doesn't time out
+	uint64_t syn_time;			// time of the next SYN retransmit
+	uint32_t syn_rto;			// current SYN retransmit interval
+	int syn_retries;			// SYN retransmits left
+	uint32_t connect_seq;		// CONN_QUEUED order
+	uint64_t drain_deadline;	// CONN_DRAINING give-up time
+	// receive window autotuning
+	uint32_t win_target;		// current window size the buffer is tuned to
+	uint32_t win_adv_edge;		// tx_ack + tx_win as last advertised to the device
+	uint32_t win_drained;		// bytes written to the client in the current sample
+	int win_stalled;			// the device ran out of window during the current sample
+	uint64_t win_sample_time;	// start of the current sample
+	// connection timers
+	uint64_t deadline;			// earliest pending deadline, valid while queued
+	int timer_index;			// position in the shard's timer heap, -1 if not queued
+	// transmit scheduling
+	enum conn_priority priority;
+	int tx_ready;				// the client has data waiting to be forwarded
+	uint32_t deficit;			// DRR credit left over from previous rounds
+	// counters, only the traffic fields are maintained here
+	struct connection_stats stats;
 };
 
 struct mux_device
 {
 	struct usb_device *usbdev;
+	struct device_shard *shard;
 	int id;
 	enum mux_dev_state state;
 	int visible;
@@ -133,50 +206,187 @@ struct mux_device
 	int version;
 	uint16_t rx_seq;
 	uint16_t tx_seq;
+	int drr_next[CONN_PRIO_COUNT];	// connection slot the next DRR round of each class starts at
+	int connecting;				// connections with an outstanding SYN
+	uint32_t next_connect_seq;
 
 	#ifndef USE_PORTDRIVER_SOCKETS
 		SOCKET rx_data_events_socket;
+		struct event_source *rx_data_events_source;
 	#endif
 
 	int is_preflight_worker_running;
+
+	// counters, only the traffic fields are maintained here
+	struct device_stats stats;
 };
 
 static struct collection device_list;
 pthread_mutex_t device_list_mutex;
+// bumped with device_list_mutex held whenever device_get_list() may change
+static uint32_t device_list_generation;
+
+static uint32_t conn_win_min = CONN_WIN_MIN;
+static uint32_t conn_win_max = CONN_WIN_MAX;
+static uint32_t conn_drr_quantum = CONN_DRR_QUANTUM;
+static uint32_t device_tx_budget = DEVICE_TX_BUDGET;
+static uint32_t bulk_tx_inflight = BULK_TX_INFLIGHT;
+static uint32_t conn_connect_timeout = CONN_CONNECT_TIMEOUT;
+static int conn_syn_retries = CONN_SYN_RETRIES;
+static uint32_t conn_syn_rto = CONN_SYN_RTO;
+static int device_max_connecting = DEVICE_MAX_CONNECTING;
+static uint32_t conn_drain_timeout = CONN_DRAIN_TIMEOUT;
+
+struct port_priority
+{
+	uint16_t port;
+	enum conn_priority priority;
+};
+
+static const char *conn_priority_names[CONN_PRIO_COUNT] = { "High", "Normal", "Bulk" };
+static struct port_priority port_priorities[MAX_PORT_PRIORITIES];
+static int port_priorities_count;
+
+/* Connections that have a pending deadline (delayed ACK, idle window),
+ * kept as a binary min-heap ordered by mux_connection::deadline.
+ * Connections without deadlines are not in here at all, so looking up the
+ * next timeout is O(1) and (re)scheduling a connection is O(log n). */
+struct conn_timer_heap
+{
+	struct mux_connection **items;
+	int count;
+	int capacity;
+};
+
+/* Devices are spread over event loop shards, each one served by its own
+ * thread (see usbmuxd.cpp). A shard owns its devices' connections and
+ * timers, as well as the sockets of the clients connected through them,
+ * all of which are only touched with the shard's lock held.
+ * Locks are taken in this order: client_list_mutex, a single shard lock,
+ * device_list_mutex. Shard threads never take client_list_mutex. */
+struct device_shard
+{
+	int index;
+	pthread_mutex_t lock;
+	struct event_loop *loop;
+	struct collection devices;
+	struct conn_timer_heap timers;
+	// device_info of devices whose preflight worker starts once the lock is released
+	struct collection preflight_pending;
+};
+
+static struct device_shard *shards;
+static int shard_count;
+
+static void timer_heap_set(struct conn_timer_heap *heap, int index, struct mux_connection *conn)
+{
+	heap->items[index] = conn;
+	conn->timer_index = index;
+}
 
-static struct mux_device* get_mux_device_for_id(int device_id)
+static void timer_heap_sift_up(struct conn_timer_heap *heap, int index)
 {
-  struct mux_device *dev = NULL;
+	struct mux_connection *conn = heap->items[index];
+	while(index > 0) {
+		int parent = (index - 1) / 2;
+		if(heap->items[parent]->deadline <= conn->deadline)
+			break;
+		timer_heap_set(heap, index, heap->items[parent]);
+		index = parent;
+	}
+	timer_heap_set(heap, index, conn);
+}
+
+static void timer_heap_sift_down(struct conn_timer_heap *heap, int index)
+{
+	struct mux_connection *conn = heap->items[index];
+	while(1) {
+		int child = index * 2 + 1;
+		if(child >= heap->count)
+			break;
+		if((child + 1 < heap->count) && (heap->items[child + 1]->deadline < heap->items[child]->deadline))
+			child++;
+		if(conn->deadline <= heap->items[child]->deadline)
+			break;
+		timer_heap_set(heap, index, heap->items[child]);
+		index = child;
+	}
+	timer_heap_set(heap, index, conn);
+}
+
+static void timer_heap_remove(struct mux_connection *conn)
+{
+	struct conn_timer_heap *heap = &conn->dev->shard->timers;
+	int index = conn->timer_index;
+	if(index < 0)
+		return;
+
+	conn->timer_index = -1;
+	heap->count--;
+	if(index == heap->count)
+		return;
+
+	struct mux_connection *last = heap->items[heap->count];
+	timer_heap_set(heap, index, last);
+	timer_heap_sift_up(heap, index);
+	timer_heap_sift_down(heap, last->timer_index);
+}
+
+static void connection_schedule_timer(struct mux_connection *conn);
+static void update_connection(struct mux_connection *conn);
+static void connection_connect_finished(struct mux_connection *conn);
+
+static int shard_has_device(struct device_shard *shard, struct mux_device *dev)
+{
+	FOREACH(struct mux_device *cdev, &shard->devices, struct mux_device *) {
+		if(cdev == dev)
+			return 1;
+	} ENDFOREACH
+	return 0;
+}
+
+/**
+ * Look up a device and lock the shard it belongs to. A device only leaves
+ * its shard with the shard lock held, so it stays valid until the lock
+ * is released.
+ *
+ * @param device_id Numeric id of the device, or -1 to look it up by usbdev.
+ * @param usbdev The USB device to look up if device_id is -1.
+ *
+ * @return The device with its shard locked, or NULL if there is no such device.
+ */
+static struct mux_device *device_lock(int device_id, struct usb_device *usbdev)
+{
+	struct mux_device *dev = NULL;
+	struct device_shard *shard = NULL;
 	pthread_mutex_lock(&device_list_mutex);
 	FOREACH(struct mux_device *cdev, &device_list, struct mux_device *) {
-		if(cdev->id == device_id) {
+		if((device_id != -1) ? (cdev->id == device_id) : (cdev->usbdev == usbdev)) {
 			dev = cdev;
+			shard = cdev->shard;
 			break;
 		}
 	} ENDFOREACH
 	pthread_mutex_unlock(&device_list_mutex);
-
+	if(!dev)
+		return NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	// it may have been removed (and its memory reused) in between
+	if(!shard_has_device(shard, dev) || ((device_id != -1) ? (dev->id != device_id) : (dev->usbdev != usbdev))) {
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
+	}
 	return dev;
 }
 
-static struct mux_connection* get_mux_connection(int device_id, struct mux_client *client)
+static struct mux_connection* get_mux_connection(struct mux_device *dev, struct mux_client *client)
 {
-	struct mux_connection *conn = NULL;
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list, struct mux_device *) {
-		if(dev->id == device_id) {
-			FOREACH(struct mux_connection *lconn, &dev->connections, struct mux_connection *) {
-				if(lconn->client == client) {
-					conn = lconn;
-					break;
-				}
-			} ENDFOREACH
-			break;
-		}
+	FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
+		if(conn->client == client)
+			return conn;
 	} ENDFOREACH
-	pthread_mutex_unlock(&device_list_mutex);
-
-	return conn;
+	return NULL;
 }
 
 static int get_next_device_id(void)
@@ -197,38 +407,67 @@ static int get_next_device_id(void)
 	}
 }
 
-static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *header, const void *data, int length)
+static int mux_header_size(struct mux_device *dev)
 {
-	unsigned char *buffer;
-	int hdrlen;
-	int res;
+	return (dev->version < 2) ? 8 : sizeof(struct mux_header);
+}
 
+/**
+ * Get the number of header bytes that precede the payload of a packet
+ * (the mux header plus the protocol header).
+ *
+ * @return The header size, or -1 for an invalid protocol.
+ */
+static int packet_header_size(struct mux_device *dev, enum mux_protocol proto)
+{
 	switch(proto) {
 		case MUX_PROTO_VERSION:
-			hdrlen = sizeof(struct version_header);
-			break;
+			return mux_header_size(dev) + sizeof(struct version_header);
 		case MUX_PROTO_SETUP:
-			hdrlen = 0;
-			break;
+			return mux_header_size(dev);
 		case MUX_PROTO_TCP:
-			hdrlen = sizeof(struct tcphdr);
-			break;
+			return mux_header_size(dev) + sizeof(struct tcphdr);
 		default:
-			usbmuxd_log(LL_ERROR, "Invalid protocol %d for outgoing packet (dev %d hdr %p data %p len %d)", proto, dev->id, header, data, length);
 			return -1;
 	}
-	usbmuxd_log(LL_SPEW, "send_packet(%d, 0x%x, %p, %p, %d)", dev->id, proto, header, data, length);
+}
 
-	int mux_header_size = ((dev->version < 2) ? 8 : sizeof(struct mux_header));
+/**
+ * Send a packet whose payload has already been placed in a TX buffer
+ * (obtained through usb_alloc_tx_buffer()) right after the room reserved
+ * for the headers, as given by packet_header_size(). The headers are
+ * written in front of the payload and the buffer is handed to the USB
+ * layer as is, which takes ownership of it.
+ *
+ * @param dev The device to send to.
+ * @param proto Protocol of the packet.
+ * @param header Protocol header to copy into the packet.
+ * @param buffer TX buffer holding the payload.
+ * @param length Payload length.
+ *
+ * @return Number of bytes sent, or < 0 on error.
+ */
+static int send_packet_buffer(struct mux_device *dev, enum mux_protocol proto, void *header, unsigned char *buffer, int length)
+{
+	int mux_hdrlen = mux_header_size(dev);
+	int hdrlen = packet_header_size(dev, proto);
+	int res;
+
+	if(hdrlen < 0) {
+		usbmuxd_log(LL_ERROR, "Invalid protocol %d for outgoing packet (dev %d hdr %p len %d)", proto, dev->id, header, length);
+		usb_free_tx_buffer(buffer);
+		return -1;
+	}
+	usbmuxd_log(LL_SPEW, "send_packet(%d, 0x%x, %p, %p, %d)", dev->id, proto, header, buffer, length);
 
-	int total = mux_header_size + hdrlen + length;
+	int total = hdrlen + length;
 
 	if(total > USB_MTU) {
-		usbmuxd_log(LL_ERROR, "Tried to send packet larger than USB MTU (hdr %d data %d total %d) to device %d", hdrlen, length, total, dev->id);
+		usbmuxd_log(LL_ERROR, "Tried to send packet larger than USB MTU (hdr %d data %d total %d) to device %d", hdrlen - mux_hdrlen, length, total, dev->id);
+		usb_free_tx_buffer(buffer);
 		return -1;
 	}
 
-	buffer = (unsigned char *)malloc(total);
 	struct mux_header *mhdr = (struct mux_header *)buffer;
 	mhdr->protocol = htonl(proto);
 	mhdr->length = htonl(total);
@@ -242,18 +481,38 @@ static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *he
 		mhdr->rx_seq = htons(dev->rx_seq);
 		dev->tx_seq++;
 	}	
-	memcpy(buffer + mux_header_size, header, hdrlen);
-	if(data && length)
-		memcpy(buffer + mux_header_size + hdrlen, data, length);
+	memcpy(buffer + mux_hdrlen, header, hdrlen - mux_hdrlen);
 
 	if((res = usb_send(dev->usbdev, buffer, total)) < 0) {
 		usbmuxd_log(LL_ERROR, "usb_send failed while sending packet (len %d) to device %d: %d", total, dev->id, res);
-		free(buffer);
 		return res;
 	}
+	dev->stats.tx_packets++;
+	dev->stats.tx_bytes += total;
 	return total;
 }
 
+static int send_packet(struct mux_device *dev, enum mux_protocol proto, void *header, const void *data, int length)
+{
+	unsigned char *buffer;
+	int hdrlen = packet_header_size(dev, proto);
+
+	if((hdrlen >= 0) && (hdrlen + length > USB_TX_BUFFER_SIZE)) {
+		usbmuxd_log(LL_ERROR, "Tried to send packet larger than USB MTU (hdr %d data %d) to device %d", hdrlen, length, dev->id);
+		return -1;
+	}
+
+	buffer = usb_alloc_tx_buffer();
+	if(!buffer) {
+		usbmuxd_log(LL_ERROR, "Failed to allocate a TX buffer for device %d", dev->id);
+		return -1;
+	}
+	if((hdrlen >= 0) && data && length)
+		memcpy(buffer + hdrlen, data, length);
+
+	return send_packet_buffer(dev, proto, header, buffer, length);
+}
+
 static uint16_t find_sport(struct mux_device *dev)
 {
 	if(collection_count(&dev->connections) >= 65535)
@@ -286,77 +545,172 @@ static int send_anon_rst(struct mux_device *dev, uint16_t sport, uint16_t dport,
 	usbmuxd_log(LL_DEBUG, "[OUT] dev=%d sport=%d dport=%d flags=0x%x", dev->id, sport, dport, th.th_flags);
 
 	int res = send_packet(dev, MUX_PROTO_TCP, &th, NULL, 0);
+	if(res >= 0)
+		dev->stats.rst_sent++;
+	return res;
+}
+
+static void fill_tcp_header(struct mux_connection *conn, struct tcphdr *th, uint8_t flags)
+{
+	memset(th, 0, sizeof(*th));
+	th->th_sport = htons(conn->sport);
+	th->th_dport = htons(conn->dport);
+	th->th_seq = htonl(conn->tx_seq);
+	th->th_ack = htonl(conn->tx_ack);
+	th->th_flags = flags;
+	th->th_off = sizeof(*th) / 4;
+	th->th_win = htons(conn->tx_win >> 8);
+}
+
+static void tcp_packet_sent(struct mux_connection *conn)
+{
+	conn->tx_acked = conn->tx_ack;
+	conn->win_adv_edge = conn->tx_ack + conn->tx_win;
+	conn->stats.tx_packets++;
+	conn->last_ack_time = mstime64();
+	conn->flags &= ~CONN_ACK_PENDING;
+	if(conn->timer_index >= 0)
+		connection_schedule_timer(conn);
+}
+
+/**
+ * Send a TCP segment whose payload was read straight into a TX buffer,
+ * at offset packet_header_size(dev, MUX_PROTO_TCP).
+ * The buffer is consumed in any case.
+ */
+static int send_tcp_buffer(struct mux_connection *conn, uint8_t flags, unsigned char *buffer, int length)
+{
+	struct tcphdr th;
+	fill_tcp_header(conn, &th, flags);
+
+	int res = send_packet_buffer(conn->dev, MUX_PROTO_TCP, &th, buffer, length);
+	if(res >= 0)
+		tcp_packet_sent(conn);
 	return res;
 }
 
 static int send_tcp(struct mux_connection *conn, uint8_t flags, const unsigned char *data, int length)
 {
 	struct tcphdr th;
-	memset(&th, 0, sizeof(th));
-	th.th_sport = htons(conn->sport);
-	th.th_dport = htons(conn->dport);
-	th.th_seq = htonl(conn->tx_seq);
-	th.th_ack = htonl(conn->tx_ack);
-	th.th_flags = flags;
-	th.th_off = sizeof(th) / 4;
-	th.th_win = htons(conn->tx_win >> 8);
+	fill_tcp_header(conn, &th, flags);
 
 //	usbmuxd_log(LL_DEBUG, "[OUT] dev=%d sport=%d dport=%d seq=%d ack=%d flags=0x%x window=%d[%d] len=%d",
 //		conn->dev->id, conn->sport, conn->dport, conn->tx_seq, conn->tx_ack, flags, conn->tx_win, conn->tx_win >> 8, length);
 
 	int res = send_packet(conn->dev, MUX_PROTO_TCP, &th, data, length);
-	if(res >= 0) {
-		conn->tx_acked = conn->tx_ack;
-		conn->last_ack_time = mstime64();
-		conn->flags &= ~CONN_ACK_PENDING;
-	}
+	if(res >= 0)
+		tcp_packet_sent(conn);
 	return res;
 }
 
+/**
+ * Write as much of a connection's in-buffer to its client as the
+ * client socket takes without blocking.
+ *
+ * @param conn The connection to flush.
+ *
+ * @return The number of bytes written, or a value <= 0 on error.
+ */
+static int connection_flush_client(struct mux_connection *conn)
+{
+	int size = client_write(conn->client, conn->ib_buf, conn->ib_size);
+	if(size <= 0)
+		return size;
+
+	conn->ib_size -= size;
+	if(conn->ib_size)
+		memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
+	return size;
+}
+
+/**
+ * Keep a connection that has been reset around until the data it still
+ * holds for its client has been written, or conn_drain_timeout expires.
+ * The connection is finally released by connection_teardown().
+ *
+ * @param conn The connection to drain.
+ */
+static void connection_start_drain(struct mux_connection *conn)
+{
+	usbmuxd_log(LL_DEBUG, "Draining %d bytes of device %d connection %d->%d", conn->ib_size, conn->dev->id, conn->sport, conn->dport);
+	conn->state = CONN_DRAINING;
+	conn->tx_ready = 0;
+	conn->flags &= ~(CONN_ACK_PENDING | CONN_TX_THROTTLED);
+	conn->drain_deadline = mstime64() + conn_drain_timeout;
+	conn->events = POLLOUT;
+	connection_schedule_timer(conn);
+	client_set_events(conn->client, conn->events);
+}
+
 static void connection_teardown(struct mux_connection *conn)
 {
 	int res;
-	int size;
 
 	if(conn->state == CONN_DEAD)
 		return;
 	usbmuxd_log(LL_DEBUG, "connection_teardown dev %d sport %d dport %d", conn->dev->id, conn->sport, conn->dport);
-	if(conn->dev->state != MUXDEV_DEAD && conn->state != CONN_DYING && conn->state != CONN_REFUSED) {
+	if(conn->dev->state != MUXDEV_DEAD && conn->state != CONN_DYING && conn->state != CONN_REFUSED && conn->state != CONN_QUEUED && conn->state != CONN_DRAINING) {
 		res = send_tcp(conn, TH_RST, NULL, 0);
 		if(res < 0)
 			usbmuxd_log(LL_ERROR, "Error sending TCP RST to device %d (%d->%d)", conn->dev->id, conn->sport, conn->dport);
+		else
+			conn->dev->stats.rst_sent++;
 	}
 	if(conn->client) {
-		if(conn->state == CONN_REFUSED || conn->state == CONN_CONNECTING) {
+		if(conn->state == CONN_REFUSED || conn->state == CONN_CONNECTING || conn->state == CONN_QUEUED) {
 			client_notify_connect(conn->client, RESULT_CONNREFUSED);
 		} else {
-			conn->state = CONN_DEAD;
-			if((conn->events & POLLOUT) && conn->ib_size > 0){
-				while(1){
-					size = client_write(conn->client, conn->ib_buf, conn->ib_size);
-					if(size <= 0) {
-						break;
-					}
-					if(size == (int)conn->ib_size) {
-						conn->ib_size = 0;
-						break;
-					} else {
-						conn->ib_size -= size;
-						memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
-					}
-				}
+			// Data that was already acknowledged to the device is flushed to the
+			// client without blocking the main loop, unless the device is going
+			// away or the connection has been draining for too long already.
+			if((conn->state != CONN_DRAINING) && (conn->ib_size > 0) && (conn->dev->state != MUXDEV_DEAD) && conn_drain_timeout) {
+				connection_start_drain(conn);
+				return;
 			}
+			conn->state = CONN_DEAD;
+			if(conn->ib_size > 0)
+				connection_flush_client(conn);
+			if(conn->ib_size > 0)
+				usbmuxd_log(LL_INFO, "Dropping %d bytes of device %d connection %d->%d", conn->ib_size, conn->dev->id, conn->sport, conn->dport);
 			client_close(conn->client);
 		}
 	}
+	timer_heap_remove(conn);
 	if(conn->ib_buf)
 		free(conn->ib_buf);
-	if(conn->ob_buf)
-		free(conn->ob_buf);
 	collection_remove(&conn->dev->connections, conn);
+	if(conn->flags & CONN_SYN_SENT)
+		connection_connect_finished(conn);
 	free(conn);
 }
 
+static uint32_t device_mux_input(struct mux_device *dev, unsigned char *buffer, uint32_t length);
+
+/**
+ * Release a shard lock taken by its thread, then start the preflight
+ * workers of the devices that became active meanwhile. Those are started
+ * without the lock, as they notify clients (see the lock order above).
+ *
+ * @param shard The shard to unlock.
+ */
+static void shard_unlock(struct device_shard *shard)
+{
+	struct collection pending = {NULL, 0};
+	if(collection_count(&shard->preflight_pending) > 0) {
+		pending = shard->preflight_pending;
+		collection_init(&shard->preflight_pending);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if(!pending.list)
+		return;
+	FOREACH(struct device_info *info, &pending, struct device_info *) {
+		preflight_worker_device_add(info);
+		free(info);
+	} ENDFOREACH
+	collection_free(&pending);
+}
+
 #ifndef USE_PORTDRIVER_SOCKETS
 int device_accept_socket(int listenfd, int reject_connection)
 {
@@ -403,18 +757,10 @@ int device_accept_socket(int listenfd, int reject_connection)
 		return -1;
 	}
 
-	/* Store the socket */
-	struct mux_device * dev = NULL;
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *cdev, &device_list, struct mux_device *)
-	{
-		if (cdev->usbdev == usb_dev)
-		{
-			dev = cdev;
-			break;
-		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&device_list_mutex);
+	/* Store the socket and register it with the loop of the device's
+	 * shard, under the shard lock so device_remove can't free the device
+	 * in between */
+	struct mux_device * dev = device_lock(-1, usb_dev);
 	if (!dev)
 	{
 		usbmuxd_log(LL_WARNING, "Attempted to connect a socket to a nonexistent device");
@@ -423,88 +769,277 @@ int device_accept_socket(int listenfd, int reject_connection)
 	}
 
 	dev->rx_data_events_socket = new_sock_fd;
+	dev->rx_data_events_source = event_loop_add(dev->shard->loop, new_sock_fd, EVENT_OWNER_DEVICE, dev, POLLIN);
+	if (!dev->rx_data_events_source)
+	{
+		dev->rx_data_events_socket = INVALID_SOCKET;
+		pthread_mutex_unlock(&dev->shard->lock);
+		usbmuxd_log(LL_ERROR, "Failed to register the device socket with the event loop");
+		closesocket(new_sock_fd);
+		return -1;
+	}
+	pthread_mutex_unlock(&dev->shard->lock);
 
 	return 0;
 }
 
-int device_process_sockets(fd_set * read_fds, fd_set * write_fds)
+/**
+ * Handle a data signal on a device's rx data events socket, as reported
+ * by the loop of the device's shard.
+ *
+ * @param shard_index The shard whose loop reported the event. Must be called
+ *   by the shard's thread, with the shard locked (see device_lock_shard).
+ * @param dev The device whose socket is readable.
+ */
+int device_process_socket(int shard_index, struct mux_device *dev)
 {
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list, struct mux_device *)
+	struct device_shard *shard = &shards[shard_index];
+
+	/* The device may have been removed since the event was reported */
+	if (!shard_has_device(shard, dev) || INVALID_SOCKET == dev->rx_data_events_socket)
 	{
-		if (INVALID_SOCKET != dev->rx_data_events_socket)
-		{
-			if (FD_ISSET(dev->rx_data_events_socket, read_fds))
-			{
-				/* Read the data signal from the socket (one byte, its value 
-				 * doens't matter */
-				char result = 0;
-				if (sizeof(result) != recv(dev->rx_data_events_socket, &result, sizeof(result), 0))
-				{
-					usbmuxd_log(LL_ERROR, "recv() failed (%s)", strerror(errno));
-					continue;
-				}
+		return 0;
+	}
 
-				unsigned char * device_data = NULL;
-				uint32_t device_data_size = 0;
+	/* Read the data signal from the socket (one byte, its value 
+	 * doens't matter */
+	char result = 0;
+	if (sizeof(result) != recv(dev->rx_data_events_socket, &result, sizeof(result), 0))
+	{
+		usbmuxd_log(LL_ERROR, "recv() failed (%s)", strerror(errno));
+		return -1;
+	}
 
-				if (usb_get_read_result(dev->usbdev, (void **)&device_data, &device_data_size) < 0)
-				{
-					usbmuxd_log(LL_ERROR, "usb_get_read_result has failed");
-					continue;
-				}
+	unsigned char * device_data = NULL;
+	uint32_t device_data_size = 0;
 
-				uint32_t data_processed = 0;
-				while (data_processed < device_data_size)
-				{
-					data_processed += device_data_input(dev->usbdev, device_data + data_processed, device_data_size - data_processed);
-				}
-				
-
-				/* Tell the usb device thread we've processed the current data
-				 * (currently it doesn't really matter what we send) */
-				result = 1;
-				if (sizeof(result) != send(dev->rx_data_events_socket, &result, sizeof(result), 0))
-				{
-					usbmuxd_log(LL_ERROR, "send() failed (%s)", strerror(errno));
-				}
-			}
+	if (usb_get_read_result(dev->usbdev, (void **)&device_data, &device_data_size) < 0)
+	{
+		usbmuxd_log(LL_ERROR, "usb_get_read_result has failed");
+		return -1;
+	}
+
+	uint32_t data_processed = 0;
+	while (data_processed < device_data_size)
+	{
+		data_processed += device_mux_input(dev, device_data + data_processed, device_data_size - data_processed);
+	}
+	
+
+	/* Tell the usb device thread we've processed the current data
+	 * (currently it doesn't really matter what we send) */
+	result = 1;
+	if (sizeof(result) != send(dev->rx_data_events_socket, &result, sizeof(result), 0))
+	{
+		usbmuxd_log(LL_ERROR, "send() failed (%s)", strerror(errno));
+	}
+
+	return 0;
+}
+#endif /* USE_PORTDRIVER_SOCKETS */
+
+/**
+ * Look up the priority class configured for a destination port.
+ *
+ * @param port The destination port, in host byte order.
+ *
+ * @return The port's priority class, CONN_PRIO_NORMAL if none is set.
+ */
+enum conn_priority device_get_port_priority(uint16_t port)
+{
+	enum conn_priority priority = CONN_PRIO_NORMAL;
+	int i;
+	pthread_mutex_lock(&device_list_mutex);
+	for(i = 0; i < port_priorities_count; i++) {
+		if(port_priorities[i].port == port) {
+			priority = port_priorities[i].priority;
+			break;
 		}
-	} ENDFOREACH
+	}
 	pthread_mutex_unlock(&device_list_mutex);
+	return priority;
+}
 
-	return 0;
+/**
+ * Parse the name of a priority class ("High", "Normal" or "Bulk").
+ *
+ * @param name The name to parse.
+ *
+ * @return The matching enum conn_priority value, or -1 if the name is unknown.
+ */
+int device_parse_priority(const char *name)
+{
+	int i;
+	if(!name)
+		return -1;
+	for(i = 0; i < CONN_PRIO_COUNT; i++) {
+		if(!strcmp(name, conn_priority_names[i]))
+			return i;
+	}
+	return -1;
+}
+
+/**
+ * Get the name of a priority class.
+ *
+ * @param priority An enum conn_priority value.
+ *
+ * @return The class name, or NULL if priority is invalid.
+ */
+const char *device_priority_name(int priority)
+{
+	if((priority < 0) || (priority >= CONN_PRIO_COUNT))
+		return NULL;
+	return conn_priority_names[priority];
 }
 
-int device_add_fds(fd_set * read_fds, fd_set * write_fds)
+/**
+ * Assign a priority class to a destination port. The class applies to
+ * new connections as well as to the port's existing connections.
+ *
+ * @param port The destination port, in host byte order.
+ * @param priority The priority class to assign.
+ *
+ * @return 0 on success, -1 if too many ports are configured.
+ */
+int device_set_port_priority(uint16_t port, enum conn_priority priority)
 {
-	int fd_count = 0;
+	int i;
+
 	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list, struct mux_device *)
-	{
-		if (INVALID_SOCKET != dev->rx_data_events_socket)
-		{
-			FD_SET(dev->rx_data_events_socket, read_fds);
-			fd_count++;
+	for(i = 0; i < port_priorities_count; i++) {
+		if(port_priorities[i].port == port)
+			break;
+	}
+	if(i == port_priorities_count) {
+		if(port_priorities_count == MAX_PORT_PRIORITIES) {
+			pthread_mutex_unlock(&device_list_mutex);
+			return -1;
 		}
-	} ENDFOREACH
+		port_priorities_count++;
+	}
+	port_priorities[i].port = port;
+	port_priorities[i].priority = priority;
+	usbmuxd_log(LL_INFO, "Port %d priority set to %s", port, conn_priority_names[priority]);
 	pthread_mutex_unlock(&device_list_mutex);
 
-	return fd_count;
+	for(i = 0; i < shard_count; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		FOREACH(struct mux_device *dev, &shards[i].devices, struct mux_device *) {
+			FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
+				if(conn->dport == port) {
+					conn->priority = priority;
+					conn->deficit = 0;
+					if(conn->flags & CONN_TX_THROTTLED) {
+						conn->flags &= ~CONN_TX_THROTTLED;
+						update_connection(conn);
+					}
+				}
+			} ENDFOREACH
+		} ENDFOREACH
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+
+	return 0;
 }
-#endif /* USE_PORTDRIVER_SOCKETS */
 
-int device_start_connect(int device_id, uint16_t dport, struct mux_client *client)
+/**
+ * Load port priority classes from the MCE_PORT_PRIORITIES environment
+ * variable, formatted as a list of port=class pairs, e.g.
+ * "62078=High,1234=Bulk".
+ */
+static void load_port_priorities(void)
 {
-	struct mux_device *dev = get_mux_device_for_id(device_id);
-	if(!dev) {
-		usbmuxd_log(LL_WARNING, "Attempted to connect to nonexistent device %d", device_id);
-		return -RESULT_BADDEV;
+	char value[1024];
+	char *p = value;
+
+	if(env_get_string("MCE_PORT_PRIORITIES", value, sizeof(value)) <= 0)
+		return;
+
+	while(*p) {
+		char *end = NULL;
+		long port = strtol(p, &end, 10);
+		char *name = (*end == '=') ? end + 1 : NULL;
+		char *next = strchr(p, ',');
+		if(next)
+			*next++ = '\0';
+		int priority = name ? device_parse_priority(name) : -1;
+		if((end == p) || (port <= 0) || (port > 0xFFFF) || (priority < 0)) {
+			usbmuxd_log(LL_WARNING, "Ignoring invalid port priority '%s'", p);
+		} else if(device_set_port_priority((uint16_t)port, (enum conn_priority)priority) < 0) {
+			usbmuxd_log(LL_WARNING, "Too many port priorities, ignoring '%s'", p);
+		}
+		if(!next)
+			break;
+		p = next;
 	}
+}
 
+/**
+ * Send the SYN of a new or queued connection and move it to CONN_CONNECTING.
+ *
+ * @param conn The connection to start.
+ *
+ * @return 0 on success, a negative value if the SYN couldn't be sent.
+ */
+static int connection_send_syn(struct mux_connection *conn)
+{
+	int res = send_tcp(conn, TH_SYN, NULL, 0);
+	if(res < 0) {
+		usbmuxd_log(LL_ERROR, "Error sending TCP SYN to device %d (%d->%d)", conn->dev->id, conn->sport, conn->dport);
+		return res;
+	}
+	conn->state = CONN_CONNECTING;
+	conn->flags |= CONN_SYN_SENT;
+	conn->dev->connecting++;
+	conn->syn_retries = conn_syn_retries;
+	conn->syn_rto = conn_syn_rto;
+	conn->syn_time = mstime64() + conn->syn_rto;
+	connection_schedule_timer(conn);
+	return 0;
+}
+
+/**
+ * Start queued connections of a device, oldest first, as long as the
+ * device has free connect slots.
+ *
+ * @param dev The device whose queue to process.
+ */
+static void device_start_queued_connects(struct mux_device *dev)
+{
+	while((dev->state == MUXDEV_ACTIVE) && (dev->connecting < device_max_connecting)) {
+		struct mux_connection *next = NULL;
+		FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
+			if((conn->state == CONN_QUEUED) && (!next || (int32_t)(conn->connect_seq - next->connect_seq) < 0))
+				next = conn;
+		} ENDFOREACH
+		if(!next)
+			break;
+		if(connection_send_syn(next) < 0)
+			connection_teardown(next);
+	}
+}
+
+/**
+ * Release the connect slot held by a connection whose SYN has been
+ * answered (or given up on), and let the next queued connection go.
+ *
+ * @param conn The connection that finished connecting.
+ */
+static void connection_connect_finished(struct mux_connection *conn)
+{
+	if(!(conn->flags & CONN_SYN_SENT))
+		return;
+	conn->flags &= ~CONN_SYN_SENT;
+	conn->dev->connecting--;
+	device_start_queued_connects(conn->dev);
+}
+
+static int device_connect(struct mux_device *dev, uint16_t dport, struct mux_client *client)
+{
 	uint16_t sport = find_sport(dev);
 	if(!sport) {
-		usbmuxd_log(LL_WARNING, "Unable to allocate port for device %d", device_id);
+		usbmuxd_log(LL_WARNING, "Unable to allocate port for device %d", dev->id);
 		return -RESULT_BADDEV;
 	}
 
@@ -514,27 +1049,41 @@ int device_start_connect(int device_id, uint16_t dport, struct mux_client *clien
 
 	conn->dev = dev;
 	conn->client = client;
-	conn->state = CONN_CONNECTING;
+	conn->state = CONN_QUEUED;
 	conn->sport = sport;
 	conn->dport = dport;
 	conn->tx_seq = 0;
 	conn->tx_ack = 0;
 	conn->tx_acked = 0;
-	conn->tx_win = CONN_INBUF_SIZE;
+	conn->win_target = CONN_WIN_INIT;
+	if(conn->win_target < conn_win_min)
+		conn->win_target = conn_win_min;
+	if(conn->win_target > conn_win_max)
+		conn->win_target = conn_win_max;
+	conn->win_sample_time = mstime64();
+	conn->tx_win = conn->win_target;
+	conn->timer_index = -1;
 	conn->flags = 0;
 	conn->max_payload = MAX_MUX_PACKET_SIZE - sizeof(struct mux_header) - sizeof(struct tcphdr);
+	conn->priority = device_get_port_priority(dport);
 	
-	conn->ob_buf = (unsigned char *)malloc(CONN_OUTBUF_SIZE);
-	conn->ob_capacity = CONN_OUTBUF_SIZE;
-	conn->ib_buf = (unsigned char *)malloc(CONN_INBUF_SIZE);
-	conn->ib_capacity = CONN_INBUF_SIZE;
+	conn->ib_buf = (unsigned char *)malloc(conn->win_target);
+	conn->ib_capacity = conn->win_target;
 	conn->ib_size = 0;
 
-	int res;
+	if(conn_connect_timeout)
+		conn->connect_deadline = mstime64() + conn_connect_timeout;
+	conn->connect_seq = dev->next_connect_seq++;
 
-	res = send_tcp(conn, TH_SYN, NULL, 0);
-	if(res < 0) {
-		usbmuxd_log(LL_ERROR, "Error sending TCP SYN to device %d (%d->%d)", dev->id, sport, dport);
+	if(dev->connecting >= device_max_connecting) {
+		usbmuxd_log(LL_DEBUG, "Device %d has %d connects in flight, queueing %d->%d", dev->id, dev->connecting, sport, dport);
+		collection_add(&dev->connections, conn);
+		connection_schedule_timer(conn);
+		return 0;
+	}
+
+	if(connection_send_syn(conn) < 0) {
+		free(conn->ib_buf);
 		free(conn);
 		return -RESULT_CONNREFUSED; //bleh
 	}
@@ -543,13 +1092,125 @@ int device_start_connect(int device_id, uint16_t dport, struct mux_client *clien
 }
 
 /**
- * Examine the state of a connection's buffers and
- * update all connection flags and masks accordingly.
- * Does not do I/O.
+ * Open a connection to a port of a device on behalf of a client. On
+ * success, the client is handed over to the device's shard, which reports
+ * the outcome through client_notify_connect(). Called from the main loop.
+ *
+ * @param device_id Numeric id of the device.
+ * @param dport The destination port, in host byte order.
+ * @param client The client that asked for the connection, already in
+ *   the CONNECTING1 state.
+ *
+ * @return 0 on success, or a negative RESULT_* value.
+ */
+int device_start_connect(int device_id, uint16_t dport, struct mux_client *client)
+{
+	struct mux_device *dev = device_lock(device_id, NULL);
+	if(!dev) {
+		usbmuxd_log(LL_WARNING, "Attempted to connect to nonexistent device %d", device_id);
+		return -RESULT_BADDEV;
+	}
+
+	// a client the shard can't serve must not get a connection
+	struct event_source *source = client_register(client, dev->shard->loop);
+	if(!source) {
+		pthread_mutex_unlock(&dev->shard->lock);
+		return -RESULT_CONNREFUSED;
+	}
+
+	int res = device_connect(dev, dport, client);
+	if(res == 0)
+		client_bind(client, source, &dev->shard->lock);
+	else
+		event_loop_remove(source);
+	pthread_mutex_unlock(&dev->shard->lock);
+	return res;
+}
+
+/**
+ * Get the earliest time at which a connection needs attention from
+ * device_check_timeouts().
+ *
+ * @param conn The connection to examine.
+ *
+ * @return The deadline in mstime64() units, or 0 if there is none.
+ */
+static uint64_t connection_next_deadline(struct mux_connection *conn)
+{
+	uint64_t deadline = 0;
+
+	if(conn->state == CONN_DRAINING)
+		return conn->drain_deadline;
+
+	if((conn->state == CONN_QUEUED) || (conn->state == CONN_CONNECTING)) {
+		deadline = conn->connect_deadline;
+		if((conn->state == CONN_CONNECTING) && (conn->syn_retries > 0) && (!deadline || conn->syn_time < deadline))
+			deadline = conn->syn_time;
+		return deadline;
+	}
+
+	if(conn->state != CONN_CONNECTED)
+		return 0;
+
+	if(conn->flags & CONN_ACK_PENDING)
+		deadline = conn->last_ack_time + ACK_TIMEOUT;
+
+	if(conn->win_target > conn_win_min) {
+		uint64_t idle_deadline = conn->win_sample_time + CONN_WIN_IDLE_TIMEOUT;
+		if(!deadline || idle_deadline < deadline)
+			deadline = idle_deadline;
+	}
+
+	return deadline;
+}
+
+/**
+ * Queue, requeue or dequeue a connection in the timer heap according to
+ * its current deadlines.
+ *
+ * @param conn The connection to schedule.
+ */
+static void connection_schedule_timer(struct mux_connection *conn)
+{
+	struct conn_timer_heap *heap = &conn->dev->shard->timers;
+	uint64_t deadline = connection_next_deadline(conn);
+
+	if(!deadline) {
+		timer_heap_remove(conn);
+		return;
+	}
+
+	if(conn->timer_index >= 0) {
+		if(deadline == conn->deadline)
+			return;
+		conn->deadline = deadline;
+		timer_heap_sift_up(heap, conn->timer_index);
+		timer_heap_sift_down(heap, conn->timer_index);
+		return;
+	}
+
+	if(heap->count == heap->capacity) {
+		int capacity = heap->capacity ? heap->capacity * 2 : 64;
+		struct mux_connection **items = (struct mux_connection **)realloc(heap->items, sizeof(struct mux_connection *) * capacity);
+		if(!items) {
+			usbmuxd_log(LL_ERROR, "Out of memory while scheduling timer for connection %d->%d", conn->sport, conn->dport);
+			return;
+		}
+		heap->items = items;
+		heap->capacity = capacity;
+	}
+	conn->deadline = deadline;
+	timer_heap_set(heap, heap->count++, conn);
+	timer_heap_sift_up(heap, conn->timer_index);
+}
+
+/**
+ * Recalculate how many bytes can be sent to the device in the
+ * next segment, according to the device's window.
  *
  * @param conn The connection to update.
  */
-static void update_connection(struct mux_connection *conn)
+static void connection_update_sendable(struct mux_connection *conn)
 {
 	uint32_t sent = conn->tx_seq - conn->rx_ack;
 
@@ -558,63 +1219,355 @@ static void update_connection(struct mux_connection *conn)
 	else
 		conn->sendable = 0;
 
-	if(conn->sendable > conn->ob_capacity)
-		conn->sendable = conn->ob_capacity;
-	if(conn->sendable > conn->max_payload)
-		conn->sendable = conn->max_payload;
+	if(conn->sendable > conn->max_payload)
+		conn->sendable = conn->max_payload;
+}
+
+/**
+ * Examine the state of a connection's buffers and
+ * update all connection flags and masks accordingly.
+ * Does not do I/O.
+ *
+ * @param conn The connection to update.
+ */
+static void update_connection(struct mux_connection *conn)
+{
+	connection_update_sendable(conn);
+
+	if((conn->sendable > 0) && !(conn->flags & CONN_TX_THROTTLED))
+		conn->events |= POLLIN;
+	else
+		conn->events &= ~POLLIN;
+
+	if(conn->ib_size)
+		conn->events |= POLLOUT;
+	else
+		conn->events &= ~POLLOUT;
+
+	if(conn->tx_acked != conn->tx_ack)
+		conn->flags |= CONN_ACK_PENDING;
+	else
+		conn->flags &= ~CONN_ACK_PENDING;
+
+	usbmuxd_log(LL_SPEW, "update_connection: sendable %d, events %d, flags %d", conn->sendable, conn->events, conn->flags);
+	connection_schedule_timer(conn);
+	client_set_events(conn->client, conn->events);
+}
+
+static int send_tcp_ack(struct mux_connection *conn)
+{
+	if (send_tcp(conn, TH_ACK, NULL, 0) < 0) {
+		usbmuxd_log(LL_ERROR, "Error sending TCP ACK (%d->%d)", conn->sport, conn->dport);
+		connection_teardown(conn);
+		return -1;
+	}
+
+	update_connection(conn);
+
+	return 0;
+}
+
+/**
+ * Check whether the window has opened up far enough since it was last
+ * advertised to be worth a window update (receiver side silly window
+ * syndrome avoidance).
+ *
+ * @param conn The connection to check.
+ *
+ * @return 1 if a window update should be sent, 0 otherwise.
+ */
+static int connection_window_update_due(struct mux_connection *conn)
+{
+	uint32_t advertised = conn->win_adv_edge - conn->tx_ack;
+	uint32_t threshold = conn->win_target / 2;
+
+	// Capped at one full mux packet (0x7FFC bytes, just under 32 KiB), so
+	// large windows are updated as soon as the device can fill a packet more
+	if(threshold > MAX_MUX_PACKET_SIZE)
+		threshold = MAX_MUX_PACKET_SIZE;
+
+	return (conn->tx_win > advertised) && ((conn->tx_win - advertised) >= threshold);
+}
+
+/**
+ * Return window credit for data that was written to the client.
+ * While the connection is above its tuned window, credit is withheld
+ * until the buffer has shrunk to the target. The window already
+ * advertised to the device is never taken back.
+ *
+ * @param conn The connection to credit.
+ * @param size Number of bytes removed from the connection's in-buffer.
+ */
+static void connection_release_window(struct mux_connection *conn, uint32_t size)
+{
+	uint32_t advertised = conn->win_adv_edge - conn->tx_ack;
+	uint32_t win = conn->tx_win + size;
+
+	if(conn->ib_size + win > conn->win_target) {
+		win = (conn->win_target > conn->ib_size) ? conn->win_target - conn->ib_size : 0;
+		if(win < advertised)
+			win = advertised;
+	}
+	conn->tx_win = win;
+
+	if((conn->ib_capacity > conn->win_target) && (conn->ib_size + conn->tx_win <= conn->win_target)) {
+		unsigned char *buf = (unsigned char *)realloc(conn->ib_buf, conn->win_target);
+		if(buf) {
+			conn->ib_buf = buf;
+			conn->ib_capacity = conn->win_target;
+		}
+	}
+}
+
+/**
+ * Adapt the receive window of a connection to the rate at which its
+ * client drains data, similar to TCP receive buffer autotuning.
+ *
+ * Once per sample interval: if the device ran out of window while the
+ * client kept draining at least half of it, the window is the bottleneck
+ * and is doubled. If the client drained less than a quarter of it, the
+ * window is halved. Growth is applied (and advertised) right away,
+ * shrinking happens lazily in connection_release_window().
+ *
+ * @param conn The connection to tune.
+ * @param now The current time as returned by mstime64().
+ */
+static void connection_tune_window(struct mux_connection *conn, uint64_t now)
+{
+	uint32_t target = conn->win_target;
+
+	if((now - conn->win_sample_time) < CONN_WIN_SAMPLE_INTERVAL)
+		return;
+
+	if(conn->win_stalled && (conn->win_drained >= conn->win_target / 2))
+		target = conn->win_target * 2;
+	else if(conn->win_drained < conn->win_target / 4)
+		target = conn->win_target / 2;
+
+	if(target < conn_win_min)
+		target = conn_win_min;
+	if(target > conn_win_max)
+		target = conn_win_max;
+
+	conn->win_drained = 0;
+	conn->win_stalled = 0;
+	conn->win_sample_time = now;
+
+	if(target == conn->win_target)
+		return;
+
+	usbmuxd_log(LL_SPEW, "Tuning window of device %d connection %d->%d: %d -> %d", conn->dev->id, conn->sport, conn->dport, conn->win_target, target);
+
+	if(target > conn->ib_capacity) {
+		unsigned char *buf = (unsigned char *)realloc(conn->ib_buf, target);
+		if(!buf)
+			return;
+		conn->ib_buf = buf;
+		conn->ib_capacity = target;
+	}
+	conn->win_target = target;
+
+	if(conn->ib_size + conn->tx_win < target)
+		conn->tx_win = target - conn->ib_size;
+	else
+		connection_release_window(conn, 0);
+}
+
+/**
+ * Read data waiting on a connection's client socket and send it along
+ * to the device, until the device's window or the client socket is
+ * exhausted, or limit bytes have been sent.
+ * The data is received right after the headroom of a TX buffer,
+ * so it goes to the USB layer without any further copies.
+ *
+ * @param conn The connection to forward data for.
+ * @param limit Max number of bytes to forward.
+ *
+ * @return The number of bytes forwarded, or -1 if the connection
+ *   has been torn down.
+ */
+static int connection_forward_client_data(struct mux_connection *conn, uint32_t limit)
+{
+	uint32_t sent = 0;
+	int payload_offset = packet_header_size(conn->dev, MUX_PROTO_TCP);
+	int size;
+
+	while((conn->sendable > 0) && (sent < limit)) {
+		uint32_t to_read = (conn->sendable < (limit - sent)) ? conn->sendable : (limit - sent);
+		unsigned char *buffer = usb_alloc_tx_buffer();
+		if(!buffer) {
+			usbmuxd_log(LL_ERROR, "Failed to allocate a TX buffer for device %d", conn->dev->id);
+			break;
+		}
+		size = client_read(conn->client, buffer + payload_offset, to_read);
+		if(size <= 0) {
+			usb_free_tx_buffer(buffer);
+			if((size < 0) && (WSAGetLastError() == WSAEWOULDBLOCK)) {
+				// the socket is drained
+				conn->tx_ready = 0;
+				break;
+			}
+			if (size < 0) {
+				usbmuxd_log(LL_DEBUG, "error reading from client (%d)", size);
+			}
+			connection_teardown(conn);
+			return -1;
+		}
+		if(send_tcp_buffer(conn, TH_ACK, buffer, size) < 0) {
+			connection_teardown(conn);
+			return -1;
+		}
+		conn->tx_seq += size;
+		conn->stats.tx_bytes += size;
+		sent += size;
+		connection_update_sendable(conn);
+		if((uint32_t)size < to_read) {
+			// short read, nothing more is waiting on the socket
+			conn->tx_ready = 0;
+			break;
+		}
+	}
+
+	return (int)sent;
+}
+
+/**
+ * Schedule client data of a device's connections of one priority class
+ * onto the device, using deficit round robin. Each round, every connection
+ * with pending data and an open window is credited with conn_drr_quantum
+ * bytes and may forward up to its credit. Rounds are repeated until there
+ * is nothing left to send or the budget is used up, in which case the next
+ * call resumes with the following connection. This way a bulk upload can't
+ * delay other connections of the class by more than a quantum per round.
+ *
+ * @param dev The device to schedule. Must be called with
+ *   the device's shard locked.
+ * @param priority The priority class to schedule.
+ * @param budget Max number of bytes to forward.
+ *
+ * @return The part of the budget that is left.
+ */
+static uint32_t device_schedule_tx(struct mux_device *dev, enum conn_priority priority, uint32_t budget)
+{
+	int capacity = dev->connections.capacity;
+	int active;
+	int n;
+
+	if(capacity <= 0)
+		return budget;
+
+	do {
+		active = 0;
+		for(n = 0; (n < capacity) && (budget > 0); n++) {
+			int index = (dev->drr_next[priority] + n) % capacity;
+			struct mux_connection *conn = (struct mux_connection *)dev->connections.list[index];
+			if(!conn || (conn->priority != priority) || (conn->state != CONN_CONNECTED) || !conn->tx_ready)
+				continue;
+			if(conn->sendable == 0) {
+				// blocked by the device's window, don't bank credit meanwhile
+				conn->deficit = 0;
+				continue;
+			}
+
+			conn->deficit += conn_drr_quantum;
+			int sent = connection_forward_client_data(conn, (conn->deficit < budget) ? conn->deficit : budget);
+			if(sent < 0)
+				continue;
+			conn->deficit -= sent;
+			budget -= sent;
 
-	if(conn->sendable > 0)
-		conn->events |= POLLIN;
-	else
-		conn->events &= ~POLLIN;
+			if(!conn->tx_ready || (conn->sendable == 0))
+				conn->deficit = 0;
+			else if(sent > 0)
+				active = 1;
 
-	if(conn->ib_size)
-		conn->events |= POLLOUT;
-	else
-		conn->events &= ~POLLOUT;
+			update_connection(conn);
 
-	if(conn->tx_acked != conn->tx_ack)
-		conn->flags |= CONN_ACK_PENDING;
-	else
-		conn->flags &= ~CONN_ACK_PENDING;
+			if(budget == 0)
+				dev->drr_next[priority] = (index + 1) % capacity;
+		}
+	} while(active && (budget > 0));
 
-	usbmuxd_log(LL_SPEW, "update_connection: sendable %d, events %d, flags %d", conn->sendable, conn->events, conn->flags);
-	client_set_events(conn->client, conn->events);
+	return budget;
 }
 
-static int send_tcp_ack(struct mux_connection *conn)
+/**
+ * Hold back or release the connections of a priority class. Held back
+ * connections are not polled for client data until they are released.
+ *
+ * @param dev The device whose connections to update. Must be called
+ *   with the device's shard locked.
+ * @param priority The priority class to update.
+ * @param throttle 1 to hold the class back, 0 to release it.
+ */
+static void device_throttle_tx(struct mux_device *dev, enum conn_priority priority, int throttle)
 {
-	if (send_tcp(conn, TH_ACK, NULL, 0) < 0) {
-		usbmuxd_log(LL_ERROR, "Error sending TCP ACK (%d->%d)", conn->sport, conn->dport);
-		connection_teardown(conn);
-		return -1;
-	}
-
-	update_connection(conn);
+	FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
+		if((conn->state != CONN_CONNECTED) || (conn->priority != priority) || (!(conn->flags & CONN_TX_THROTTLED) == !throttle))
+			continue;
+		if(throttle)
+			conn->flags |= CONN_TX_THROTTLED;
+		else
+			conn->flags &= ~CONN_TX_THROTTLED;
+		update_connection(conn);
+	} ENDFOREACH
+}
 
-	return 0;
+/**
+ * Forward pending client data to the active devices of a shard.
+ * Priority classes are served in order, each one out of what the
+ * previous ones left of the device's budget. High priority connections
+ * are meant for low volume control traffic and can starve the other
+ * classes. Bulk connections are held back while the USB pipe is busy.
+ * Called from the shard's loop after client events have been processed.
+ *
+ * @param shard_index The shard to serve.
+ */
+void device_process_tx(int shard_index)
+{
+	struct device_shard *shard = &shards[shard_index];
+	int priority;
+
+	pthread_mutex_lock(&shard->lock);
+	FOREACH(struct mux_device *dev, &shard->devices, struct mux_device *) {
+		if(dev->state != MUXDEV_ACTIVE)
+			continue;
+		uint32_t budget = device_tx_budget;
+		for(priority = CONN_PRIO_HIGH; (priority < CONN_PRIO_COUNT) && (budget > 0); priority++) {
+			if(priority == CONN_PRIO_BULK) {
+				// the USB write completion wakes the shard up once the pipe drained
+				int throttle = (usb_get_tx_pending(dev->usbdev) >= bulk_tx_inflight) && usb_arm_tx_wake(dev->usbdev, bulk_tx_inflight);
+				device_throttle_tx(dev, CONN_PRIO_BULK, throttle);
+				if(throttle)
+					break;
+			}
+			budget = device_schedule_tx(dev, (enum conn_priority)priority, budget);
+		}
+	} ENDFOREACH
+	pthread_mutex_unlock(&shard->lock);
 }
 
 /**
  * Flush input and output buffers for a client connection.
  *
- * @param device_id Numeric id for the device.
- * @param client The client to flush buffers for.
+ * @param conn The connection of the client.
  * @param events event mask for the client. POLLOUT means that
  *   the client is ready to receive data, POLLIN that it has
- *   data to be read (and send along to the device).
+ *   data to be read (and send along to the device). Reading is
+ *   deferred to device_process_tx().
  */
-void device_client_process(int device_id, struct mux_client *client, short events)
+static void connection_client_process(struct mux_connection *conn, short events)
 {
-	struct mux_connection *conn = get_mux_connection(device_id, client);
+	usbmuxd_log(LL_SPEW, "device_client_process (%d)", events);
 
-	if(!conn) {
-		usbmuxd_log(LL_WARNING, "Could not find connection for device %d client %p", device_id, client);
+	if(conn->state == CONN_DRAINING) {
+		if(events & POLLOUT) {
+			if((connection_flush_client(conn) <= 0) || (conn->ib_size == 0))
+				connection_teardown(conn);
+		}
 		return;
 	}
-	usbmuxd_log(LL_SPEW, "device_client_process (%d)", events);
 
-	int res;
 	int size;
 	if((events & POLLOUT) && (conn->ib_size > 0)) {
 		// Client is ready to receive data, send what we have
@@ -622,6 +1575,8 @@ void device_client_process(int device_id, struct mux_client *client, short event
 		size = client_write(conn->client, conn->ib_buf, conn->ib_size);
 		if(size <= 0) {
 			usbmuxd_log(LL_DEBUG, "error writing to client (%d)", size);
+			// the client is gone, there is no point in draining
+			conn->ib_size = 0;
 			connection_teardown(conn);
 			return;
 		}
@@ -633,39 +1588,49 @@ void device_client_process(int device_id, struct mux_client *client, short event
 			memmove(conn->ib_buf, conn->ib_buf + size, conn->ib_size);
 		}
 
-		// Update the connection's tx window. If the current windows is small
-		// (smaller than the max packet size, for maximizing the usb transfers),
-		// we'll let the device know we've updated our window.
-		int should_advertise_new_window = conn->tx_win < MAX_MUX_PACKET_SIZE;
-		conn->tx_win += size;
+		// Update the connection's tx window and let the device know
+		// once it has opened up enough (see connection_window_update_due)
+		conn->win_drained += size;
+		connection_release_window(conn, size);
+		connection_tune_window(conn, mstime64());
 
-		if (should_advertise_new_window) {
-			send_tcp_ack(conn);
+		if(connection_window_update_due(conn)) {
+			if(send_tcp_ack(conn) < 0)
+				return;
 		}
 	}
-	if((events & POLLIN) && (conn->sendable > 0)) {
-		// There is inbound trafic on the client socket,
-		// convert it to tcp and send to the device
-		// (if the device's input buffer is not full)
-		size = client_read(conn->client, conn->ob_buf, conn->sendable);
-		if(size <= 0) {
-			if (size < 0) {
-				usbmuxd_log(LL_DEBUG, "error reading from client (%d)", size);
-			}
-			connection_teardown(conn);
-			return;
-		}
-		res = send_tcp(conn, TH_ACK, conn->ob_buf, size);
-		if(res < 0) {
-			connection_teardown(conn);
-			return;
-		}
-		conn->tx_seq += size;
+	if(events & POLLIN) {
+		// There is inbound trafic on the client socket, it will be
+		// converted to tcp and sent to the device by device_process_tx()
+		// once the connection's turn comes up.
+		conn->tx_ready = 1;
 	}
 
 	update_connection(conn);
 }
 
+/**
+ * Handle the socket events reported for a connected client.
+ *
+ * @param device_id Numeric id for the device.
+ * @param client The client to flush buffers for.
+ * @param events event mask for the client, see connection_client_process().
+ */
+void device_client_process(int device_id, struct mux_client *client, short events)
+{
+	struct mux_device *dev = device_lock(device_id, NULL);
+	struct mux_connection *conn = dev ? get_mux_connection(dev, client) : NULL;
+
+	if(!conn) {
+		usbmuxd_log(LL_WARNING, "Could not find connection for device %d client %p", device_id, client);
+		if(dev)
+			pthread_mutex_unlock(&dev->shard->lock);
+		return;
+	}
+	connection_client_process(conn, events);
+	pthread_mutex_unlock(&dev->shard->lock);
+}
+
 /**
  * Copy a payload to a connection's in-buffer and
  * set the POLLOUT event mask on the connection so
@@ -694,17 +1659,28 @@ static void connection_device_input(struct mux_connection *conn, unsigned char *
 	conn->ib_size += payload_length;
 	conn->tx_win -= payload_length;
 	conn->tx_ack += payload_length;
+	conn->stats.rx_bytes += payload_length;
+	if((conn->tx_win < conn->max_payload) && !conn->win_stalled) {
+		conn->win_stalled = 1;
+		conn->stats.window_stalls++;
+	}
 	update_connection(conn);
 }
 
 void device_abort_connect(int device_id, struct mux_client *client)
 {
-  struct mux_connection *conn = get_mux_connection(device_id, client);
+	struct mux_device *dev = device_lock(device_id, NULL);
+	struct mux_connection *conn = dev ? get_mux_connection(dev, client) : NULL;
 	if (conn) {
+		// The client is being closed by the caller, so the connection must
+		// neither drain to it nor close it again
+		conn->client = NULL;
 		connection_teardown(conn);
 	} else {
 		usbmuxd_log(LL_WARNING, "Attempted to abort for nonexistent connection for device %d", device_id);
 	}
+	if (dev)
+		pthread_mutex_unlock(&dev->shard->lock);
 }
 void logDeviceListStatus()
 {
@@ -733,15 +1709,10 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 	vh->major = ntohl(vh->major);
 	vh->minor = ntohl(vh->minor);
 	if(vh->major != 2 && vh->major != 1) {
+		// The device stays listed (and ignored) until it's unplugged, as
+		// other threads may be holding on to it
 		usbmuxd_log(LL_ERROR, "Device %d has unknown version %d.%d", dev->id, vh->major, vh->minor);
-		pthread_mutex_lock(&device_list_mutex);
-
-
-		mce_log("MUXDEV collection_remove");
-		collection_remove(&device_list, dev);
-		logDeviceListStatus();
-		pthread_mutex_unlock(&device_list_mutex);
-		free(dev);
+		dev->state = MUXDEV_DEAD;
 		return;
 	}
 	dev->version = vh->major;
@@ -751,14 +1722,22 @@ static void device_version_input(struct mux_device *dev, struct version_header *
 	}
 
 	usbmuxd_log(LL_NOTICE, "Connected to v%d.%d device %d on location 0x%x with serial number %s", dev->version, vh->minor, dev->id, usb_get_location(dev->usbdev), usb_get_serial(dev->usbdev));
+	pthread_mutex_lock(&device_list_mutex);
 	dev->state = MUXDEV_ACTIVE;
-	collection_init(&dev->connections);
-	struct device_info info;
-	info.id = dev->id;
-	info.location = usb_get_location(dev->usbdev);
-	info.serial = usb_get_serial(dev->usbdev);
-	info.pid = usb_get_pid(dev->usbdev);
-	preflight_worker_device_add(&info);
+	device_list_generation++;
+	pthread_mutex_unlock(&device_list_mutex);
+
+	// started by shard_unlock()
+	struct device_info *info = (struct device_info *)malloc(sizeof(struct device_info));
+	if(!info) {
+		usbmuxd_log(LL_ERROR, "Out of memory while starting the preflight of device %d", dev->id);
+		return;
+	}
+	info->id = dev->id;
+	info->location = usb_get_location(dev->usbdev);
+	info->serial = usb_get_serial(dev->usbdev);
+	info->pid = usb_get_pid(dev->usbdev);
+	collection_add(&dev->shard->preflight_pending, info);
 	dev->is_preflight_worker_running = 1;
 }
 
@@ -824,6 +1803,9 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 		}
 	} ENDFOREACH
 
+	if(th->th_flags & TH_RST)
+		dev->stats.rst_received++;
+
 	if(!conn) {
 		if(!(th->th_flags & TH_RST)) {
 			usbmuxd_log(LL_INFO, "No connection for device %d incoming packet %d->%d", dev->id, dport, sport);
@@ -836,6 +1818,7 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 	conn->rx_seq = ntohl(th->th_seq);
 	conn->rx_ack = ntohl(th->th_ack);
 	conn->rx_win = ntohs(th->th_win) << 8;
+	conn->stats.rx_packets++;
 
 	if(th->th_flags & TH_RST) {
 		char *buf = (char *)malloc(payload_length+1);
@@ -848,10 +1831,12 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 	}
 
 	if(conn->state == CONN_CONNECTING) {
+		connection_connect_finished(conn);
 		if(th->th_flags != (TH_SYN|TH_ACK)) {
 			if(th->th_flags & TH_RST)
 				conn->state = CONN_REFUSED;
 			usbmuxd_log(LL_INFO, "Connection refused by device %d (%d->%d)", dev->id, sport, dport);
+			dev->stats.connections_refused++;
 			connection_teardown(conn); //this also sends the notification to the client
 		} else {
 			conn->tx_seq++;
@@ -862,6 +1847,7 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 				return;
 			}
 			conn->state = CONN_CONNECTED;
+			dev->stats.connections_opened++;
 			if(client_notify_connect(conn->client, RESULT_OK) < 0) {
 				conn->client = NULL;
 				connection_teardown(conn);
@@ -869,7 +1855,9 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
 			update_connection(conn);
 		}
 	} else if(conn->state == CONN_CONNECTED) {
-		if(th->th_flags != TH_ACK) {
+		if((th->th_flags == (TH_SYN|TH_ACK)) && (conn->flags & CONN_SYN_RETRANSMITTED)) {
+			usbmuxd_log(LL_DEBUG, "Ignoring duplicate SYN/ACK from device %d (%d->%d)", dev->id, sport, dport);
+		} else if(th->th_flags != TH_ACK) {
 			usbmuxd_log(LL_INFO, "Connection reset by device %d (%d->%d)", dev->id, sport, dport);
 			if(th->th_flags & TH_RST)
 				conn->state = CONN_DYING;
@@ -892,20 +1880,44 @@ static void device_tcp_input(struct mux_device *dev, struct tcphdr *th, unsigned
  */
 uint32_t device_data_input(struct usb_device *usbdev, unsigned char *buffer, uint32_t length)
 {
-	struct mux_device *dev = NULL;
+	struct mux_device *dev = device_lock(-1, usbdev);
+	if(!dev) {
+		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+		return length;
+	}
+
+	length = device_mux_input(dev, buffer, length);
+	shard_unlock(dev->shard);
+	return length;
+}
+
+/**
+ * Called from a USB write thread once fewer bytes are pending on the pipe
+ * than the bulk in-flight limit, see usb_arm_tx_wake(). Wakes the device's
+ * shard up, which resumes its held back connections.
+ *
+ * @param usbdev The USB device whose pipe drained.
+ */
+void device_tx_drained(struct usb_device *usbdev)
+{
 	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *tdev, &device_list, struct mux_device *) {
-		if(tdev->usbdev == usbdev) {
-			dev = tdev;
+	FOREACH(struct mux_device *dev, &device_list, struct mux_device *) {
+		if(dev->usbdev == usbdev) {
+			event_loop_wake(dev->shard->loop);
 			break;
 		}
 	} ENDFOREACH
 	pthread_mutex_unlock(&device_list_mutex);
-	if(!dev) {
-		usbmuxd_log(LL_WARNING, "Cannot find device entry for RX input from USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
-		return length;
-	}
+}
 
+/**
+ * Dispatch input data of a device, see device_data_input().
+ * Must be called with the device's shard locked.
+ *
+ * @return The number of bytes consumed.
+ */
+static uint32_t device_mux_input(struct mux_device *dev, unsigned char *buffer, uint32_t length)
+{
 	if(!length)
 		return length;
 
@@ -947,7 +1959,7 @@ uint32_t device_data_input(struct usb_device *usbdev, unsigned char *buffer, uin
 	}
 
 	struct mux_header *mhdr = (struct mux_header *)buffer;
-	int mux_header_size = ((dev->version < 2) ? 8 : sizeof(struct mux_header));
+	int mux_hdrlen = mux_header_size(dev);
 	if(ntohl(mhdr->length) > length) {
 		usbmuxd_log(LL_ERROR, "Incoming packet size mismatch (dev %d, expected %d, got %d)", dev->id, ntohl(mhdr->length), length);
 		return length;
@@ -960,28 +1972,30 @@ uint32_t device_data_input(struct usb_device *usbdev, unsigned char *buffer, uin
 	if (dev->version >= 2) {
 		dev->rx_seq = ntohs(mhdr->rx_seq);
 	}
+	dev->stats.rx_packets++;
+	dev->stats.rx_bytes += ntohl(mhdr->length);
 
 	switch(ntohl(mhdr->protocol)) {
 		case MUX_PROTO_VERSION:
-			if(length < (mux_header_size + sizeof(struct version_header))) {
+			if(length < (mux_hdrlen + sizeof(struct version_header))) {
 				usbmuxd_log(LL_ERROR, "Incoming version packet is too small (%d)", length);
 				return length;
 			}
-			device_version_input(dev, (struct version_header *)((char*)mhdr+mux_header_size));
+			device_version_input(dev, (struct version_header *)((char*)mhdr+mux_hdrlen));
 			break;
 		case MUX_PROTO_CONTROL:
 			payload = (unsigned char *)(mhdr+1);
-			payload_length = length - mux_header_size;
+			payload_length = length - mux_hdrlen;
 			device_control_input(dev, payload, payload_length);
 			break;
 		case MUX_PROTO_TCP:
-			if(length < (mux_header_size + sizeof(struct tcphdr))) {
+			if(length < (mux_hdrlen + sizeof(struct tcphdr))) {
 				usbmuxd_log(LL_ERROR, "Incoming TCP packet is too small (%d)", length);
 				return length;
 			}
-			th = (struct tcphdr *)((char*)mhdr+mux_header_size);
+			th = (struct tcphdr *)((char*)mhdr+mux_hdrlen);
 			payload = (unsigned char *)(th+1);
-			payload_length = length - sizeof(struct tcphdr) - mux_header_size;
+			payload_length = length - sizeof(struct tcphdr) - mux_hdrlen;
 			device_tcp_input(dev, th, payload, payload_length);
 			break;
 		default:
@@ -1017,8 +2031,13 @@ int device_add(struct usb_device *usbdev)
 	dev->preflight_cb_data = NULL;
 	dev->is_preflight_worker_running = 0;
 	dev->version = 0;
+	memset(dev->drr_next, 0, sizeof(dev->drr_next));
+	memset(&dev->stats, 0, sizeof(dev->stats));
+	dev->connecting = 0;
+	dev->next_connect_seq = 0;
 	#ifndef USE_PORTDRIVER_SOCKETS
 		dev->rx_data_events_socket = INVALID_SOCKET;
+		dev->rx_data_events_source = NULL;
 	#endif
 
 	struct version_header vh;
@@ -1030,61 +2049,85 @@ int device_add(struct usb_device *usbdev)
 		free(dev);
 		return res;
 	}
+	collection_init(&dev->connections);
+
+	// Give the device to the shard with the fewest devices. Shard membership
+	// only changes on the main loop, so counting without the locks is fine.
+	struct device_shard *shard = &shards[0];
+	int i;
+	for(i = 1; i < shard_count; i++) {
+		if(collection_count(&shards[i].devices) < collection_count(&shard->devices))
+			shard = &shards[i];
+	}
+	dev->shard = shard;
+	usbmuxd_log(LL_DEBUG, "Device %d is served by shard %d", id, shard->index);
+
+	pthread_mutex_lock(&shard->lock);
+	collection_add(&shard->devices, dev);
 	pthread_mutex_lock(&device_list_mutex);
 	mce_log("MUXDEV collection_add");
 	collection_add(&device_list, dev);
 	logDeviceListStatus();
 	pthread_mutex_unlock(&device_list_mutex);
+	pthread_mutex_unlock(&shard->lock);
 	
 	return 0;
 }
 
 void device_remove(struct usb_device *usbdev)
 {
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list, struct mux_device *) {
-		if(dev->usbdev == usbdev) {
-			DEBUG_MCE("Removed device %d on location 0x%x", dev->id, usb_get_location(usbdev));
-			if(dev->state == MUXDEV_ACTIVE) {
-				dev->state = MUXDEV_DEAD;
-				FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
-					connection_teardown(conn);
-				} ENDFOREACH
-				
-				if (dev->visible) {
-					client_device_remove(dev->id);
-				} else {
-					DEBUG_MCE( "Removed device %d on location 0x%x was removed while invisible", dev->id, usb_get_location(usbdev));
-					device_info dev_info = { 0 };
-					dev_info.id = dev->id;
-					dev_info.serial = usb_get_serial(dev->usbdev);
-					dev_info.location = usb_get_location(dev->usbdev);
-					dev_info.pid = usb_get_pid(dev->usbdev);
-					client_device_removed_during_add(&dev_info);
-				}
-				
-				collection_free(&dev->connections);
-			}
-			if (dev->preflight_cb_data) {
-				preflight_device_remove_cb(dev->preflight_cb_data);
-			}
-			mce_log("MUXDEV collection_remove");
-			collection_remove(&device_list, dev);
-			logDeviceListStatus();
-			pthread_mutex_unlock(&device_list_mutex);
-			free(dev->pktbuf);
-			#ifndef USE_PORTDRIVER_SOCKETS
-				closesocket(dev->rx_data_events_socket);
-			#endif
-			free(dev);
-
+	struct mux_device *dev = device_lock(-1, usbdev);
+	if(!dev) {
+		usbmuxd_log(LL_WARNING, "Cannot find device entry while removing USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+		return;
+	}
 
-			return;
-		}
+	struct device_shard *shard = dev->shard;
+	int was_active = (dev->state == MUXDEV_ACTIVE);
+	DEBUG_MCE("Removed device %d on location 0x%x", dev->id, usb_get_location(usbdev));
+	dev->state = MUXDEV_DEAD;
+	FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
+		connection_teardown(conn);
 	} ENDFOREACH
+	#ifndef USE_PORTDRIVER_SOCKETS
+		event_loop_remove(dev->rx_data_events_source);
+	#endif
+	collection_remove(&shard->devices, dev);
+
+	pthread_mutex_lock(&device_list_mutex);
+	mce_log("MUXDEV collection_remove");
+	collection_remove(&device_list, dev);
+	device_list_generation++;
+	logDeviceListStatus();
+	void *preflight_cb_data = dev->preflight_cb_data;
 	pthread_mutex_unlock(&device_list_mutex);
+	pthread_mutex_unlock(&shard->lock);
+
+	// Nobody else can get to the device anymore, let the clients know
+	// without holding any locks
+	if(was_active) {
+		if (dev->visible) {
+			client_device_remove(dev->id);
+		} else {
+			DEBUG_MCE( "Removed device %d on location 0x%x was removed while invisible", dev->id, usb_get_location(usbdev));
+			device_info dev_info = { 0 };
+			dev_info.id = dev->id;
+			dev_info.serial = usb_get_serial(dev->usbdev);
+			dev_info.location = usb_get_location(dev->usbdev);
+			dev_info.pid = usb_get_pid(dev->usbdev);
+			client_device_removed_during_add(&dev_info);
+		}
+	}
+	if (preflight_cb_data) {
+		preflight_device_remove_cb(preflight_cb_data);
+	}
 
-	usbmuxd_log(LL_WARNING, "Cannot find device entry while removing USB device %p on location 0x%x", usbdev, usb_get_location(usbdev));
+	collection_free(&dev->connections);
+	free(dev->pktbuf);
+	#ifndef USE_PORTDRIVER_SOCKETS
+		closesocket(dev->rx_data_events_socket);
+	#endif
+	free(dev);
 }
 
 void device_add_failed(struct usb_device *dev)
@@ -1104,6 +2147,7 @@ void device_set_visible(int device_id)
 	FOREACH(struct mux_device *dev, &device_list, struct mux_device *) {
 		if(dev->id == device_id) {
 			dev->visible = 1;
+			device_list_generation++;
 			usb_set_device_ready(dev->usbdev);
 			break;
 		}
@@ -1140,6 +2184,20 @@ int device_get_count(int include_hidden)
 	return count;
 }
 
+/**
+ * Get a counter that changes whenever the result of device_get_list()
+ * may have, so the result can be cached.
+ *
+ * @return The current generation of the device list.
+ */
+uint32_t device_get_list_generation(void)
+{
+	pthread_mutex_lock(&device_list_mutex);
+	uint32_t generation = device_list_generation;
+	pthread_mutex_unlock(&device_list_mutex);
+	return generation;
+}
+
 int device_get_list(int include_hidden, struct device_info **devices)
 {
 	int count = 0;
@@ -1151,7 +2209,7 @@ int device_get_list(int include_hidden, struct device_info **devices)
 	*devices = (struct device_info *)malloc(sizeof(struct device_info) * dev_list.capacity);
 	struct device_info *p = *devices;
 
-	FOREACH(struct mux_device *dev, &device_list, struct mux_device *) {
+	FOREACH(struct mux_device *dev, &dev_list, struct mux_device *) {
 		if((dev->state == MUXDEV_ACTIVE) && (include_hidden || dev->visible)) {
 			p->id = dev->id;
 			p->serial = usb_get_serial(dev->usbdev);
@@ -1167,44 +2225,192 @@ int device_get_list(int include_hidden, struct device_info **devices)
 	return count;
 }
 
-int device_get_timeout(void)
+/**
+ * Take a snapshot of the traffic counters of all devices and their
+ * connections.
+ *
+ * @param stats Receives an array of device_stats that must be released
+ *   with device_free_statistics().
+ *
+ * @return The number of entries in stats.
+ */
+int device_get_statistics(struct device_stats **stats)
 {
-	uint64_t oldest = (uint64_t)-1LL;
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list, struct mux_device *) {
-		if(dev->state == MUXDEV_ACTIVE) {
+	int count = 0;
+	int capacity = 0;
+	int i;
+
+	// Shards are visited one at a time, devices are only added and removed
+	// on the main loop, which is where this is called from
+	for(i = 0; i < shard_count; i++)
+		capacity += shards[i].devices.capacity;
+	*stats = (struct device_stats *)malloc(sizeof(struct device_stats) * (capacity ? capacity : 1));
+	struct device_stats *p = *stats;
+
+	for(i = 0; i < shard_count; i++) {
+		pthread_mutex_lock(&shards[i].lock);
+		FOREACH(struct mux_device *dev, &shards[i].devices, struct mux_device *) {
+			if(dev->state != MUXDEV_ACTIVE)
+				continue;
+			*p = dev->stats;
+			p->id = dev->id;
+			p->location = usb_get_location(dev->usbdev);
+			usb_get_stats(dev->usbdev, &p->usb);
+			p->num_connections = 0;
+			p->connections = (struct connection_stats *)malloc(sizeof(struct connection_stats) * (dev->connections.capacity ? dev->connections.capacity : 1));
 			FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
-				if((conn->state == CONN_CONNECTED) && (conn->flags & CONN_ACK_PENDING) && conn->last_ack_time < oldest)
-					oldest = conn->last_ack_time;
+				struct connection_stats *cs = &p->connections[p->num_connections++];
+				*cs = conn->stats;
+				cs->sport = conn->sport;
+				cs->dport = conn->dport;
+				cs->priority = conn->priority;
+				cs->send_window = conn->rx_win;
+				cs->recv_window = conn->tx_win;
+				cs->queued = conn->ib_size;
 			} ENDFOREACH
+			count++;
+			p++;
+		} ENDFOREACH
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+
+	return count;
+}
+
+void device_free_statistics(struct device_stats *stats, int count)
+{
+	int i;
+	if(!stats)
+		return;
+	for(i = 0; i < count; i++)
+		free(stats[i].connections);
+	free(stats);
+}
+
+int device_get_timeout(int shard_index)
+{
+	struct device_shard *shard = &shards[shard_index];
+	int timeout = 100000; //meh
+	pthread_mutex_lock(&shard->lock);
+	if(shard->timers.count > 0) {
+		uint64_t deadline = shard->timers.items[0]->deadline;
+		uint64_t ct = mstime64();
+		timeout = (deadline > ct) ? (int)(deadline - ct) : 0;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return timeout;
+}
+
+/**
+ * Handle the expired deadlines of a connection that was just taken off
+ * the timer heap. The connection is requeued (or torn down) as a side
+ * effect of the actions taken.
+ *
+ * @param conn The connection whose deadline expired.
+ * @param ct The current time as returned by mstime64().
+ */
+static void connection_timer_expired(struct mux_connection *conn, uint64_t ct)
+{
+	if(conn->state == CONN_DRAINING) {
+		if(ct >= conn->drain_deadline) {
+			usbmuxd_log(LL_INFO, "Client of device %d connection %d->%d didn't drain in time", conn->dev->id, conn->sport, conn->dport);
+			connection_teardown(conn);
+		} else {
+			connection_schedule_timer(conn);
 		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&device_list_mutex);
-	uint64_t ct = mstime64();
-	if((int64_t)oldest == -1LL)
-		return 100000; //meh
-	if((ct - oldest) > ACK_TIMEOUT)
-		return 0;
-	return ACK_TIMEOUT - (ct - oldest);
+		return;
+	}
+	if((conn->state == CONN_QUEUED) || (conn->state == CONN_CONNECTING)) {
+		if(conn->connect_deadline && (ct >= conn->connect_deadline)) {
+			usbmuxd_log(LL_INFO, "Connection to device %d (%d->%d) timed out", conn->dev->id, conn->sport, conn->dport);
+			conn->dev->stats.connect_timeouts++;
+			connection_teardown(conn);
+			return;
+		}
+		if((conn->state == CONN_CONNECTING) && (conn->syn_retries > 0) && (ct >= conn->syn_time)) {
+			usbmuxd_log(LL_DEBUG, "Retransmitting SYN to device %d (%d->%d)", conn->dev->id, conn->sport, conn->dport);
+			if(send_tcp(conn, TH_SYN, NULL, 0) < 0) {
+				connection_teardown(conn);
+				return;
+			}
+			conn->flags |= CONN_SYN_RETRANSMITTED;
+			conn->syn_retries--;
+			conn->syn_rto *= 2;
+			conn->syn_time = ct + conn->syn_rto;
+		}
+		connection_schedule_timer(conn);
+		return;
+	}
+
+	if((conn->win_target > conn_win_min) && (ct - conn->win_sample_time) >= CONN_WIN_IDLE_TIMEOUT) {
+		// nothing was drained for a while, give back the idle window
+		connection_tune_window(conn, ct);
+	}
+	if((conn->flags & CONN_ACK_PENDING) && (ct - conn->last_ack_time) >= ACK_TIMEOUT) {
+		usbmuxd_log(LL_DEBUG, "Sending ACK due to expired timeout (%" PRIu64 " -> %" PRIu64 ")", conn->last_ack_time, ct);
+		conn->stats.ack_timeouts++;
+		send_tcp_ack(conn);
+		return;
+	}
+	update_connection(conn);
 }
 
-void device_check_timeouts(void)
+void device_check_timeouts(int shard_index)
 {
+	struct device_shard *shard = &shards[shard_index];
 	uint64_t ct = mstime64();
-	pthread_mutex_lock(&device_list_mutex);
-	FOREACH(struct mux_device *dev, &device_list, struct mux_device *) {
-		if(dev->state == MUXDEV_ACTIVE) {
-			FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
-				if((conn->state == CONN_CONNECTED) && 
-						(conn->flags & CONN_ACK_PENDING) && 
-						(ct - conn->last_ack_time) > ACK_TIMEOUT) {
-					usbmuxd_log(LL_DEBUG, "Sending ACK due to expired timeout (%" PRIu64 " -> %" PRIu64 ")", conn->last_ack_time, ct);
-					send_tcp_ack(conn);
-				}
-			} ENDFOREACH
-		}
-	} ENDFOREACH
-	pthread_mutex_unlock(&device_list_mutex);
+	pthread_mutex_lock(&shard->lock);
+	while((shard->timers.count > 0) && (shard->timers.items[0]->deadline <= ct)) {
+		struct mux_connection *conn = shard->timers.items[0];
+		timer_heap_remove(conn);
+		connection_timer_expired(conn, ct);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Set up the shards devices are spread over. Must be called once, after
+ * device_init() and before any device is added.
+ *
+ * @param loops The event loop of each shard, which the shard's devices and
+ *   connected clients register their sockets with.
+ * @param count Number of shards.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int device_set_shards(struct event_loop **loops, int count)
+{
+	int i;
+	shards = (struct device_shard *)malloc(sizeof(struct device_shard) * count);
+	if(!shards)
+		return -1;
+	memset(shards, 0, sizeof(struct device_shard) * count);
+	for(i = 0; i < count; i++) {
+		shards[i].index = i;
+		shards[i].loop = loops[i];
+		pthread_mutex_init(&shards[i].lock, NULL);
+		collection_init(&shards[i].devices);
+		collection_init(&shards[i].preflight_pending);
+	}
+	shard_count = count;
+	return 0;
+}
+
+/**
+ * Lock a shard for a batch of work by its thread: processing the events
+ * reported by its loop (device_process_socket, client_process) and
+ * running device_check_timeouts and device_process_tx.
+ *
+ * @param shard_index The shard to lock.
+ */
+void device_lock_shard(int shard_index)
+{
+	pthread_mutex_lock(&shards[shard_index].lock);
+}
+
+void device_unlock_shard(int shard_index)
+{
+	shard_unlock(&shards[shard_index]);
 }
 
 void device_init(void)
@@ -1213,21 +2419,75 @@ void device_init(void)
 	mce_log("MUXDEV collection_init");
 	collection_init(&device_list);
 	pthread_mutex_init(&device_list_mutex, NULL);
+	shards = NULL;
+	shard_count = 0;
 	next_device_id = 1;
+
+	// windows are advertised in units of 256 bytes
+	conn_win_min = (uint32_t)env_get_int("MCE_CONN_WIN_MIN", CONN_WIN_MIN) & ~0xFF;
+	conn_win_max = (uint32_t)env_get_int("MCE_CONN_WIN_MAX", CONN_WIN_MAX) & ~0xFF;
+	if(conn_win_max > CONN_WIN_LIMIT)
+		conn_win_max = CONN_WIN_LIMIT;
+	if(conn_win_min < MAX_MUX_PACKET_SIZE)
+		conn_win_min = MAX_MUX_PACKET_SIZE & ~0xFF;
+	if(conn_win_max < conn_win_min)
+		conn_win_max = conn_win_min;
+	usbmuxd_log(LL_DEBUG, "connection window bounds %d - %d", conn_win_min, conn_win_max);
+
+	conn_drr_quantum = (uint32_t)env_get_int("MCE_CONN_DRR_QUANTUM", CONN_DRR_QUANTUM);
+	device_tx_budget = (uint32_t)env_get_int("MCE_DEVICE_TX_BUDGET", DEVICE_TX_BUDGET);
+	if((int)conn_drr_quantum <= 0)
+		conn_drr_quantum = CONN_DRR_QUANTUM;
+	if(device_tx_budget < conn_drr_quantum)
+		device_tx_budget = conn_drr_quantum;
+	bulk_tx_inflight = (uint32_t)env_get_int("MCE_BULK_TX_INFLIGHT", BULK_TX_INFLIGHT);
+	if((int)bulk_tx_inflight <= 0)
+		bulk_tx_inflight = BULK_TX_INFLIGHT;
+	usbmuxd_log(LL_DEBUG, "tx scheduling quantum %d, budget %d, bulk in-flight limit %d", conn_drr_quantum, device_tx_budget, bulk_tx_inflight);
+
+	conn_connect_timeout = (uint32_t)env_get_int("MCE_CONN_CONNECT_TIMEOUT", CONN_CONNECT_TIMEOUT);
+	conn_syn_retries = env_get_int("MCE_CONN_SYN_RETRIES", CONN_SYN_RETRIES);
+	conn_syn_rto = (uint32_t)env_get_int("MCE_CONN_SYN_RTO", CONN_SYN_RTO);
+	device_max_connecting = env_get_int("MCE_DEVICE_MAX_CONNECTING", DEVICE_MAX_CONNECTING);
+	conn_drain_timeout = (uint32_t)env_get_int("MCE_CONN_DRAIN_TIMEOUT", CONN_DRAIN_TIMEOUT);
+	if(conn_syn_rto == 0)
+		conn_syn_rto = CONN_SYN_RTO;
+	if(device_max_connecting < 1)
+		device_max_connecting = 1;
+	usbmuxd_log(LL_DEBUG, "connect timeout %d, SYN retries %d every %d, max %d connects in flight", conn_connect_timeout, conn_syn_retries, conn_syn_rto, device_max_connecting);
+
+	port_priorities_count = 0;
+	device_set_port_priority(LOCKDOWN_PORT, CONN_PRIO_HIGH);
+	load_port_priorities();
 }
 
 void device_kill_connections(void)
 {
 	usbmuxd_log(LL_DEBUG, "device_kill_connections");
-	FOREACH(struct mux_device *dev, &device_list, struct mux_device *) {
-		if(dev->state != MUXDEV_INIT) {
-			FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
-				connection_teardown(conn);
-			} ENDFOREACH
-		}
-	} ENDFOREACH
-	// give USB a while to send the final connection RSTs and the like
-	Sleep(100);
+	int i;
+	// No shard is left to finish a drain, so connections are torn down right
+	// away, after one last write of the data they hold. Those already
+	// draining are torn down below as well.
+	conn_drain_timeout = 0;
+	for(i = 0; i < shard_count; i++) {
+		// the shard thread is gone, but usb callbacks may still come in
+		pthread_mutex_lock(&shards[i].lock);
+		FOREACH(struct mux_device *dev, &shards[i].devices, struct mux_device *) {
+			if(dev->state != MUXDEV_INIT) {
+				// drop queued connects first, so they aren't started as slots free up
+				FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
+					if(conn->state == CONN_QUEUED)
+						connection_teardown(conn);
+				} ENDFOREACH
+				FOREACH(struct mux_connection *conn, &dev->connections, struct mux_connection *) {
+					connection_teardown(conn);
+				} ENDFOREACH
+			}
+		} ENDFOREACH
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+	// The final connection RSTs and the like are flushed by usb_shutdown(),
+	// which waits for the devices' queued transfers to complete.
 }
 
 void device_shutdown(void)
@@ -1246,6 +2506,20 @@ void device_shutdown(void)
 	pthread_mutex_destroy(&device_list_mutex);
 	mce_log("MUXDEV collection_free");
 	collection_free(&device_list);
+
+	int i;
+	for(i = 0; i < shard_count; i++) {
+		FOREACH(struct device_info *info, &shards[i].preflight_pending, struct device_info *) {
+			free(info);
+		} ENDFOREACH
+		collection_free(&shards[i].preflight_pending);
+		collection_free(&shards[i].devices);
+		free(shards[i].timers.items);
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+	free(shards);
+	shards = NULL;
+	shard_count = 0;
 }
 
 void device_lock_devices()
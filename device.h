@@ -24,6 +24,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include "usb.h"
 #include "client.h"
 
+struct mux_device;
+
 struct device_info {
 	int id;
 	const char *serial;
@@ -31,13 +33,55 @@ struct device_info {
 	uint16_t pid;
 };
 
+// Scheduling class of a mux connection, assigned by destination port
+enum conn_priority {
+	CONN_PRIO_HIGH,		// control plane (e.g. lockdown), always served first
+	CONN_PRIO_NORMAL,
+	CONN_PRIO_BULK,		// file transfers, backups; held back while the USB pipe is busy
+	CONN_PRIO_COUNT
+};
+
+// Traffic counters of a mux connection, see device_get_statistics()
+struct connection_stats {
+	uint16_t sport;
+	uint16_t dport;
+	int priority;
+	uint64_t tx_bytes;		// client -> device payload
+	uint64_t rx_bytes;		// device -> client payload
+	uint64_t tx_packets;
+	uint64_t rx_packets;
+	uint32_t window_stalls;	// window samples in which the device ran out of window
+	uint32_t ack_timeouts;	// ACKs sent by the delayed ACK timer
+	uint32_t send_window;	// window currently granted by the device
+	uint32_t recv_window;	// window currently granted to the device
+	uint32_t queued;		// bytes waiting to be written to the client
+};
+
+// Traffic counters of a device and its connections, see device_get_statistics()
+struct device_stats {
+	int id;
+	uint32_t location;
+	uint64_t tx_bytes;
+	uint64_t rx_bytes;
+	uint64_t tx_packets;
+	uint64_t rx_packets;
+	uint32_t rst_sent;
+	uint32_t rst_received;
+	uint32_t connections_opened;
+	uint32_t connections_refused;
+	uint32_t connect_timeouts;
+	struct usb_stats usb;
+	int num_connections;
+	struct connection_stats *connections;
+};
+
 #ifndef USE_PORTDRIVER_SOCKETS
 	int device_accept_socket(int listenfd, int reject_connection);
-	int device_add_fds(fd_set * read_fds, fd_set * write_fds);
-	int device_process_sockets(fd_set * read_fds, fd_set * write_fds);
+	int device_process_socket(int shard, struct mux_device *dev);
 #endif
 
 uint32_t device_data_input(struct usb_device *dev, unsigned char *buf, uint32_t length);
+void device_tx_drained(struct usb_device *dev);
 
 int device_add(struct usb_device *dev);
 void device_remove(struct usb_device *dev);
@@ -49,6 +93,11 @@ int device_exists(int device_id, int lock_devices);
 
 int device_start_connect(int device_id, uint16_t port, struct mux_client *client);
 void device_client_process(int device_id, struct mux_client *client, short events);
+void device_process_tx(int shard);
+int device_parse_priority(const char *name);
+const char *device_priority_name(int priority);
+int device_set_port_priority(uint16_t port, enum conn_priority priority);
+enum conn_priority device_get_port_priority(uint16_t port);
 void device_abort_connect(int device_id, struct mux_client *client);
 
 void device_set_visible(int device_id);
@@ -56,9 +105,16 @@ void device_set_preflight_cb_data(int device_id, void* data);
 
 int device_get_count(int include_hidden);
 int device_get_list(int include_hidden, struct device_info **devices);
+uint32_t device_get_list_generation(void);
+int device_get_statistics(struct device_stats **stats);
+void device_free_statistics(struct device_stats *stats, int count);
+
+int device_get_timeout(int shard);
+void device_check_timeouts(int shard);
 
-int device_get_timeout(void);
-void device_check_timeouts(void);
+int device_set_shards(struct event_loop **loops, int count);
+void device_lock_shard(int shard);
+void device_unlock_shard(int shard);
 
 void device_init(void);
 void device_kill_connections(void);
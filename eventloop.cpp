@@ -0,0 +1,699 @@
+/******************************************************************************
+ * eventloop.cpp
+ *****************************************************************************/
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+#include "stdafx.h"
+#include "eventloop.h"
+#include "utils.h"
+#include "log.h"
+#include "SocketUtil.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/******************************************************************************
+ * Defs & Types
+ *****************************************************************************/
+#define EVENT_LOOP_INITIAL_CAPACITY (64)
+
+#define EVENT_ERROR_MASK (POLLERR | POLLHUP | POLLNVAL)
+
+struct event_source
+{
+	struct event_loop * loop;
+	SOCKET fd;
+	enum event_owner owner;
+	void * data;
+	short events;
+	int index;						// slot in the registration table, -1 once removed
+	struct event_source * next_removed;
+};
+
+struct event_ready
+{
+	struct event_source * source;
+	short revents;
+};
+
+/* Same layout as fd_set, but sized to the registration count rather than
+ * FD_SETSIZE (Winsock's select only looks at fd_count) */
+struct event_fd_set
+{
+	u_int fd_count;
+	SOCKET fd_array[1];
+};
+#define EVENT_FD_SET_SIZE(capacity) (sizeof(u_int) + ((capacity) * sizeof(SOCKET)))
+#define EVENT_READ_SET(loop) ((fd_set *)((loop)->read_set))
+#define EVENT_WRITE_SET(loop) ((fd_set *)((loop)->write_set))
+
+struct event_loop
+{
+	enum event_loop_backend backend;
+	pthread_mutex_t lock;
+
+	/* Registration table, a removal moves the last entry into the hole */
+	struct event_source ** sources;
+	int count;
+	int capacity;
+	/* Removed sources are freed by the next wait, so the ready list (and a
+	 * wait in progress on another thread) never points to freed memory */
+	struct event_source * removed;
+
+	/* Loopback datagram socket other threads wake the loop up through, its
+	 * readiness is consumed by event_loop_next */
+	SOCKET wake_socket;
+	SOCKET wake_sender;
+	struct event_source * wake_source;
+	/* Set while the loop thread waits on a snapshot of the registrations,
+	 * changes made meanwhile wake it up so they take effect right away */
+	int waiting;
+
+	/* Only touched by the thread running the loop */
+	struct event_source ** wait_sources;
+	int wait_count;
+	int wait_capacity;
+	struct event_ready * ready;
+	int ready_count;
+	int ready_pos;
+
+	/* poll backend, pollfds[i] belongs to sources[i] */
+	WSAPOLLFD * pollfds;
+	WSAPOLLFD * wait_pollfds;
+
+	/* select backend */
+	struct event_fd_set * read_set;
+	struct event_fd_set * write_set;
+};
+
+static const char * const event_loop_backend_names[] = { "select", "poll" };
+
+/******************************************************************************
+ * Internal Functions
+ *****************************************************************************/
+/******************************************************************************
+ * event_loop_default_backend Function
+ *****************************************************************************/
+static enum event_loop_backend event_loop_default_backend(void)
+{
+	return EVENT_LOOP_POLL;
+}
+
+/******************************************************************************
+ * event_loop_get_backend Function
+ *****************************************************************************/
+static enum event_loop_backend event_loop_get_backend(void)
+{
+	char name[16];
+	if (env_get_string("MCE_EVENT_LOOP_BACKEND", name, sizeof(name)) <= 0)
+	{
+		return event_loop_default_backend();
+	}
+
+	for (int i = 0; i < (int)(sizeof(event_loop_backend_names) / sizeof(event_loop_backend_names[0])); i++)
+	{
+		if (0 == strcmp(name, event_loop_backend_names[i]))
+		{
+			return (enum event_loop_backend)i;
+		}
+	}
+
+	usbmuxd_log(LL_WARNING, "Event loop backend %s is not available, using %s", name, event_loop_backend_names[event_loop_default_backend()]);
+	return event_loop_default_backend();
+}
+
+/******************************************************************************
+ * event_to_poll_events Function
+ *****************************************************************************/
+static short event_to_poll_events(short events)
+{
+	return events & (POLLIN | POLLOUT);
+}
+
+/******************************************************************************
+ * event_from_poll_events Function
+ *****************************************************************************/
+static short event_from_poll_events(struct event_source * source, short revents)
+{
+	short events = 0;
+	if (revents & EVENT_ERROR_MASK)
+	{
+		/* Let the owner find out about the error from recv/send */
+		events |= source->events & (POLLIN | POLLOUT);
+	}
+	if (revents & POLLIN)
+	{
+		events |= POLLIN;
+	}
+	if (revents & POLLOUT)
+	{
+		events |= POLLOUT;
+	}
+	return events;
+}
+
+/******************************************************************************
+ * event_loop_grow Function
+ *****************************************************************************/
+static bool event_loop_grow(struct event_loop * loop)
+{
+	int capacity = loop->capacity * 2;
+
+	struct event_source ** sources = (struct event_source **)realloc(loop->sources, capacity * sizeof(*sources));
+	if (NULL == sources)
+	{
+		return false;
+	}
+	loop->sources = sources;
+
+	if (EVENT_LOOP_POLL == loop->backend)
+	{
+		WSAPOLLFD * pollfds = (WSAPOLLFD *)realloc(loop->pollfds, capacity * sizeof(*pollfds));
+		if (NULL == pollfds)
+		{
+			return false;
+		}
+		loop->pollfds = pollfds;
+	}
+
+	loop->capacity = capacity;
+	return true;
+}
+
+/******************************************************************************
+ * event_loop_reserve_wait Function
+ *****************************************************************************/
+static bool event_loop_reserve_wait(struct event_loop * loop)
+{
+	/* Called with the lock held, by the loop thread only */
+	if ((0 != loop->wait_capacity) && (loop->wait_capacity >= loop->count))
+	{
+		return true;
+	}
+
+	int capacity = loop->capacity;
+	struct event_source ** wait_sources = (struct event_source **)realloc(loop->wait_sources, capacity * sizeof(*wait_sources));
+	if (NULL == wait_sources)
+	{
+		return false;
+	}
+	loop->wait_sources = wait_sources;
+
+	struct event_ready * ready = (struct event_ready *)realloc(loop->ready, capacity * sizeof(*ready));
+	if (NULL == ready)
+	{
+		return false;
+	}
+	loop->ready = ready;
+
+	if (EVENT_LOOP_POLL == loop->backend)
+	{
+		WSAPOLLFD * wait_pollfds = (WSAPOLLFD *)realloc(loop->wait_pollfds, capacity * sizeof(*wait_pollfds));
+		if (NULL == wait_pollfds)
+		{
+			return false;
+		}
+		loop->wait_pollfds = wait_pollfds;
+	}
+	else if (EVENT_LOOP_SELECT == loop->backend)
+	{
+		struct event_fd_set * read_set = (struct event_fd_set *)realloc(loop->read_set, EVENT_FD_SET_SIZE(capacity));
+		if (NULL == read_set)
+		{
+			return false;
+		}
+		loop->read_set = read_set;
+
+		struct event_fd_set * write_set = (struct event_fd_set *)realloc(loop->write_set, EVENT_FD_SET_SIZE(capacity));
+		if (NULL == write_set)
+		{
+			return false;
+		}
+		loop->write_set = write_set;
+	}
+
+	loop->wait_capacity = capacity;
+	return true;
+}
+
+/******************************************************************************
+ * event_loop_free_removed Function
+ *****************************************************************************/
+static void event_loop_free_removed(struct event_loop * loop)
+{
+	while (NULL != loop->removed)
+	{
+		struct event_source * source = loop->removed;
+		loop->removed = source->next_removed;
+		free(source);
+	}
+}
+
+/******************************************************************************
+ * event_loop_should_wake Function
+ *****************************************************************************/
+static bool event_loop_should_wake(struct event_loop * loop)
+{
+	/* Called with the lock held after a registration change. The loop thread
+	 * itself never gets here while waiting */
+	return (0 != loop->waiting);
+}
+
+/******************************************************************************
+ * event_loop_wait_done Function
+ *****************************************************************************/
+static void event_loop_wait_done(struct event_loop * loop)
+{
+	pthread_mutex_lock(&(loop->lock));
+	loop->waiting = 0;
+	pthread_mutex_unlock(&(loop->lock));
+}
+
+/******************************************************************************
+ * event_loop_wait_poll Function
+ *****************************************************************************/
+static int event_loop_wait_poll(struct event_loop * loop, int timeout)
+{
+	/* Poll a copy of the table, so the owners may change their registrations
+	 * while we're waiting */
+	pthread_mutex_lock(&(loop->lock));
+	if (false == event_loop_reserve_wait(loop))
+	{
+		pthread_mutex_unlock(&(loop->lock));
+		usbmuxd_log(LL_ERROR, "Failed to grow the event loop wait buffers");
+		return -1;
+	}
+	memcpy(loop->wait_pollfds, loop->pollfds, loop->count * sizeof(WSAPOLLFD));
+	memcpy(loop->wait_sources, loop->sources, loop->count * sizeof(struct event_source *));
+	loop->wait_count = loop->count;
+	loop->waiting = 1;
+	pthread_mutex_unlock(&(loop->lock));
+
+	int res = WSAPoll(loop->wait_pollfds, loop->wait_count, timeout);
+	event_loop_wait_done(loop);
+	if (SOCKET_ERROR == res)
+	{
+		usbmuxd_log(LL_ERROR, "WSAPoll failed: %d", WSAGetLastError());
+		return -1;
+	}
+
+	for (int i = 0; (i < loop->wait_count) && (loop->ready_count < res); i++)
+	{
+		if (0 != loop->wait_pollfds[i].revents)
+		{
+			loop->ready[loop->ready_count].source = loop->wait_sources[i];
+			loop->ready[loop->ready_count].revents = event_from_poll_events(loop->wait_sources[i], loop->wait_pollfds[i].revents);
+			loop->ready_count++;
+		}
+	}
+
+	return res;
+}
+
+/******************************************************************************
+ * event_loop_wait_select Function
+ *****************************************************************************/
+static int event_loop_wait_select(struct event_loop * loop, int timeout)
+{
+	pthread_mutex_lock(&(loop->lock));
+	if (false == event_loop_reserve_wait(loop))
+	{
+		pthread_mutex_unlock(&(loop->lock));
+		usbmuxd_log(LL_ERROR, "Failed to grow the event loop wait buffers");
+		return -1;
+	}
+	loop->read_set->fd_count = 0;
+	loop->write_set->fd_count = 0;
+	for (int i = 0; i < loop->count; i++)
+	{
+		struct event_source * source = loop->sources[i];
+		loop->wait_sources[i] = source;
+		if (source->events & POLLIN)
+		{
+			loop->read_set->fd_array[loop->read_set->fd_count++] = source->fd;
+		}
+		if (source->events & POLLOUT)
+		{
+			loop->write_set->fd_array[loop->write_set->fd_count++] = source->fd;
+		}
+	}
+	loop->wait_count = loop->count;
+	loop->waiting = 1;
+	pthread_mutex_unlock(&(loop->lock));
+
+	timeval select_timeout;
+	select_timeout.tv_sec = timeout / 1000;
+	select_timeout.tv_usec = (timeout % 1000) * 1000;
+
+	/* Winsock fails select without any socket to wait on */
+	if ((0 == loop->read_set->fd_count) && (0 == loop->write_set->fd_count))
+	{
+		Sleep(timeout);
+		event_loop_wait_done(loop);
+		return 0;
+	}
+	int res = select(0, EVENT_READ_SET(loop), EVENT_WRITE_SET(loop), NULL, (timeout < 0) ? NULL : &select_timeout);
+	event_loop_wait_done(loop);
+	if (SOCKET_ERROR == res)
+	{
+		usbmuxd_log(LL_ERROR, "select failed: %d", WSAGetLastError());
+		return -1;
+	}
+	if (0 == res)
+	{
+		return 0;
+	}
+
+	/* Winsock leaves only the ready sockets in the sets, so each FD_ISSET
+	 * only scans the ready ones */
+	for (int i = 0; i < loop->wait_count; i++)
+	{
+		struct event_source * source = loop->wait_sources[i];
+		short revents = 0;
+		if (FD_ISSET(source->fd, EVENT_READ_SET(loop)))
+		{
+			revents |= POLLIN;
+		}
+		if (FD_ISSET(source->fd, EVENT_WRITE_SET(loop)))
+		{
+			revents |= POLLOUT;
+		}
+		if (0 != revents)
+		{
+			loop->ready[loop->ready_count].source = source;
+			loop->ready[loop->ready_count].revents = revents;
+			loop->ready_count++;
+		}
+	}
+
+	return loop->ready_count;
+}
+
+/******************************************************************************
+ * Functions
+ *****************************************************************************/
+/******************************************************************************
+ * event_loop_create Function
+ *****************************************************************************/
+struct event_loop * event_loop_create(void)
+{
+	struct event_loop * loop = (struct event_loop *)malloc(sizeof(struct event_loop));
+	if (NULL == loop)
+	{
+		return NULL;
+	}
+	memset(loop, 0, sizeof(struct event_loop));
+	loop->wake_socket = INVALID_SOCKET;
+	loop->wake_sender = INVALID_SOCKET;
+
+	loop->backend = event_loop_get_backend();
+	loop->capacity = EVENT_LOOP_INITIAL_CAPACITY;
+	loop->sources = (struct event_source **)malloc(loop->capacity * sizeof(struct event_source *));
+	if (NULL == loop->sources)
+	{
+		goto lblCleanup;
+	}
+
+	switch (loop->backend)
+	{
+	case EVENT_LOOP_POLL:
+		loop->pollfds = (WSAPOLLFD *)malloc(loop->capacity * sizeof(WSAPOLLFD));
+		if (NULL == loop->pollfds)
+		{
+			goto lblCleanup;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	pthread_mutex_init(&(loop->lock), NULL);
+
+	/* Create and register the wake socket, from here on the loop is complete
+	 * enough for event_loop_destroy to clean it up */
+	USHORT wake_port = 0;
+	if (FALSE == CreateWakeSocket(&(loop->wake_socket), &wake_port))
+	{
+		usbmuxd_log(LL_ERROR, "Failed to create the event loop wake socket");
+		event_loop_destroy(loop);
+		return NULL;
+	}
+	loop->wake_sender = ConnectSocket(LOCALHOST_ADDR, wake_port, CONNECT_SOCKET_TYPE_UDP);
+	u_long non_blocking = 1;
+	if ((INVALID_SOCKET == loop->wake_sender) || (SOCKET_ERROR == ioctlsocket(loop->wake_sender, FIONBIO, &non_blocking)))
+	{
+		usbmuxd_log(LL_ERROR, "Failed to connect to the event loop wake socket");
+		event_loop_destroy(loop);
+		return NULL;
+	}
+	loop->wake_source = event_loop_add(loop, loop->wake_socket, EVENT_OWNER_WAKE, loop, POLLIN);
+	if (NULL == loop->wake_source)
+	{
+		event_loop_destroy(loop);
+		return NULL;
+	}
+
+	usbmuxd_log(LL_INFO, "Using the %s event loop backend", event_loop_backend_names[loop->backend]);
+	return loop;
+
+lblCleanup:
+	free(loop->pollfds);
+	free(loop->sources);
+	free(loop);
+	return NULL;
+}
+
+/******************************************************************************
+ * event_loop_destroy Function
+ *****************************************************************************/
+void event_loop_destroy(struct event_loop * loop)
+{
+	if (NULL == loop)
+	{
+		return;
+	}
+
+	/* Sockets still registered belong to their owners, only drop our records */
+	for (int i = 0; i < loop->count; i++)
+	{
+		free(loop->sources[i]);
+	}
+	event_loop_free_removed(loop);
+
+	free(loop->read_set);
+	free(loop->write_set);
+	free(loop->pollfds);
+	free(loop->wait_pollfds);
+	free(loop->wait_sources);
+	free(loop->ready);
+	free(loop->sources);
+	SAFE_CLOSE_SOCKET(loop->wake_sender);
+	SAFE_CLOSE_SOCKET(loop->wake_socket);
+	pthread_mutex_destroy(&(loop->lock));
+	free(loop);
+}
+
+/******************************************************************************
+ * event_loop_backend_name Function
+ *****************************************************************************/
+const char * event_loop_backend_name(struct event_loop * loop)
+{
+	return event_loop_backend_names[loop->backend];
+}
+
+/******************************************************************************
+ * event_loop_add Function
+ *****************************************************************************/
+struct event_source * event_loop_add(struct event_loop * loop, SOCKET fd, enum event_owner owner, void * data, short events)
+{
+	struct event_source * source = (struct event_source *)malloc(sizeof(struct event_source));
+	if (NULL == source)
+	{
+		return NULL;
+	}
+	source->loop = loop;
+	source->fd = fd;
+	source->owner = owner;
+	source->data = data;
+	source->events = events;
+	source->next_removed = NULL;
+
+	pthread_mutex_lock(&(loop->lock));
+	if ((loop->count == loop->capacity) && (false == event_loop_grow(loop)))
+	{
+		pthread_mutex_unlock(&(loop->lock));
+		usbmuxd_log(LL_ERROR, "Failed to grow the event loop table");
+		free(source);
+		return NULL;
+	}
+
+	source->index = loop->count;
+	loop->sources[loop->count] = source;
+	if (EVENT_LOOP_POLL == loop->backend)
+	{
+		loop->pollfds[loop->count].fd = fd;
+		loop->pollfds[loop->count].events = event_to_poll_events(events);
+		loop->pollfds[loop->count].revents = 0;
+	}
+	loop->count++;
+	bool wake = event_loop_should_wake(loop);
+	pthread_mutex_unlock(&(loop->lock));
+
+	if (wake)
+	{
+		event_loop_wake(loop);
+	}
+	return source;
+}
+
+/******************************************************************************
+ * event_loop_modify Function
+ *****************************************************************************/
+int event_loop_modify(struct event_source * source, short events)
+{
+	if (NULL == source)
+	{
+		return -1;
+	}
+
+	struct event_loop * loop = source->loop;
+	int res = 0;
+
+	pthread_mutex_lock(&(loop->lock));
+	if ((source->events == events) || (-1 == source->index))
+	{
+		pthread_mutex_unlock(&(loop->lock));
+		return 0;
+	}
+	source->events = events;
+
+	switch (loop->backend)
+	{
+	case EVENT_LOOP_POLL:
+		loop->pollfds[source->index].events = event_to_poll_events(events);
+		break;
+
+	default:
+		/* select builds its sets from the sources on each wait */
+		break;
+	}
+	bool wake = event_loop_should_wake(loop);
+	pthread_mutex_unlock(&(loop->lock));
+
+	if (wake)
+	{
+		event_loop_wake(loop);
+	}
+	return res;
+}
+
+/******************************************************************************
+ * event_loop_remove Function
+ *****************************************************************************/
+void event_loop_remove(struct event_source * source)
+{
+	if (NULL == source)
+	{
+		return;
+	}
+
+	struct event_loop * loop = source->loop;
+
+	/* Must be called before the socket is closed */
+	pthread_mutex_lock(&(loop->lock));
+	if (-1 == source->index)
+	{
+		pthread_mutex_unlock(&(loop->lock));
+		return;
+	}
+
+	int last = loop->count - 1;
+	if (source->index != last)
+	{
+		loop->sources[source->index] = loop->sources[last];
+		loop->sources[source->index]->index = source->index;
+		if (EVENT_LOOP_POLL == loop->backend)
+		{
+			loop->pollfds[source->index] = loop->pollfds[last];
+		}
+	}
+	loop->count--;
+
+	source->index = -1;
+	source->next_removed = loop->removed;
+	loop->removed = source;
+	pthread_mutex_unlock(&(loop->lock));
+}
+
+/******************************************************************************
+ * event_loop_wait Function
+ *****************************************************************************/
+int event_loop_wait(struct event_loop * loop, int timeout)
+{
+	/* Nothing can refer to the sources removed before the previous wait
+	 * anymore */
+	pthread_mutex_lock(&(loop->lock));
+	event_loop_free_removed(loop);
+	pthread_mutex_unlock(&(loop->lock));
+
+	loop->ready_count = 0;
+	loop->ready_pos = 0;
+
+	switch (loop->backend)
+	{
+	case EVENT_LOOP_POLL:
+		return event_loop_wait_poll(loop, timeout);
+
+	default:
+		return event_loop_wait_select(loop, timeout);
+	}
+}
+
+/******************************************************************************
+ * event_loop_next Function
+ *****************************************************************************/
+int event_loop_next(struct event_loop * loop, enum event_owner * owner, void ** data, short * revents)
+{
+	pthread_mutex_lock(&(loop->lock));
+	while (loop->ready_pos < loop->ready_count)
+	{
+		struct event_ready * ready = &(loop->ready[loop->ready_pos++]);
+		if ((-1 == ready->source->index) || (0 == ready->revents))
+		{
+			/* Removed by an earlier handler (or another thread) */
+			continue;
+		}
+		if (ready->source == loop->wake_source)
+		{
+			/* Waking up was all it was for */
+			char wake_buffer[16];
+			while (0 < recv(loop->wake_socket, wake_buffer, sizeof(wake_buffer), 0));
+			continue;
+		}
+
+		*owner = ready->source->owner;
+		*data = ready->source->data;
+		*revents = ready->revents;
+		pthread_mutex_unlock(&(loop->lock));
+		return 1;
+	}
+	pthread_mutex_unlock(&(loop->lock));
+
+	return 0;
+}
+
+/******************************************************************************
+ * event_loop_wake Function
+ *****************************************************************************/
+void event_loop_wake(struct event_loop * loop)
+{
+	char flag = 1;
+	if ((SOCKET_ERROR == send(loop->wake_sender, &flag, sizeof(flag), 0)) && (WSAEWOULDBLOCK != WSAGetLastError()))
+	{
+		usbmuxd_log(LL_ERROR, "Failed to wake the event loop up: %d", WSAGetLastError());
+	}
+}
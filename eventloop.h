@@ -0,0 +1,60 @@
+/******************************************************************************
+ * eventloop.h
+ *****************************************************************************/
+#ifndef __USBMUXD_EVENTLOOP_H__
+#define __USBMUXD_EVENTLOOP_H__
+
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+#ifdef _MSC_VER
+	#include <WinSock2.h>
+#endif
+
+/******************************************************************************
+ * Defs & Types
+ *****************************************************************************/
+/* What a registered socket belongs to, used by the main loop to dispatch */
+enum event_owner {
+	EVENT_OWNER_LISTEN,			// clients listening socket
+	EVENT_OWNER_DEVICE_LISTEN,	// devices listening socket
+	EVENT_OWNER_WAKE,			// the loop's own wake socket, never returned
+	EVENT_OWNER_CLIENT,			// struct mux_client
+	EVENT_OWNER_DEVICE,			// struct mux_device rx data events socket
+	EVENT_OWNER_USB,			// port driver endpoint socket, data is the SOCKET
+};
+
+enum event_loop_backend {
+	EVENT_LOOP_SELECT,
+	EVENT_LOOP_POLL,
+};
+
+struct event_loop;
+struct event_source;
+
+/******************************************************************************
+ * Functions
+ *****************************************************************************/
+/* The backend is taken from MCE_EVENT_LOOP_BACKEND ("select" or "poll"), by
+ * default WSAPoll */
+struct event_loop * event_loop_create(void);
+void event_loop_destroy(struct event_loop * loop);
+const char * event_loop_backend_name(struct event_loop * loop);
+
+/* Registrations persist until removed, events is a mask of POLLIN/POLLOUT.
+ * add, modify and remove may be called from any thread, changes made while
+ * the loop waits take effect right away */
+struct event_source * event_loop_add(struct event_loop * loop, SOCKET fd, enum event_owner owner, void * data, short events);
+int event_loop_modify(struct event_source * source, short events);
+void event_loop_remove(struct event_source * source);
+
+/* Wait up to timeout milliseconds, returns the number of ready sockets, 0 on
+ * timeout or -1 on error. Ready sockets are then fetched with event_loop_next,
+ * which skips the ones removed in the meantime */
+int event_loop_wait(struct event_loop * loop, int timeout);
+int event_loop_next(struct event_loop * loop, enum event_owner * owner, void ** data, short * revents);
+
+/* Make a wait in progress (or the next one) return early, from any thread */
+void event_loop_wake(struct event_loop * loop);
+
+#endif /* __USBMUXD_EVENTLOOP_H__ */
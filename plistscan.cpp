@@ -0,0 +1,531 @@
+/******************************************************************************
+ * plistscan.cpp
+ *****************************************************************************/
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+#include "stdafx.h"
+#include "plistscan.h"
+
+#include <string.h>
+
+/******************************************************************************
+ * Defs & Types
+ *****************************************************************************/
+#define PLIST_SCAN_MAX_DIGITS (19)
+
+#define BPLIST_MAGIC_SIZE (8)
+#define BPLIST_TRAILER_SIZE (32)
+
+/* Object markers, the high nibble of an object's first byte */
+#define BPLIST_SIMPLE (0x0)
+#define BPLIST_INT (0x1)
+#define BPLIST_STRING (0x5)
+#define BPLIST_DICT (0xD)
+#define BPLIST_FALSE (0x08)
+#define BPLIST_TRUE (0x09)
+
+enum plist_scan_type {
+	PLIST_SCAN_STRING,
+	PLIST_SCAN_INTEGER,
+	PLIST_SCAN_BOOLEAN,
+};
+
+struct plist_scan_value {
+	enum plist_scan_type type;
+	const char * string;
+	uint32_t string_length;
+	uint64_t integer;
+};
+
+struct xml_scanner {
+	const char * cur;
+	const char * end;
+};
+
+struct bplist_scanner {
+	const unsigned char * data;
+	uint64_t offset_table;
+	uint64_t num_objects;
+	uint32_t offset_size;
+	uint32_t ref_size;
+};
+
+/******************************************************************************
+ * Internal Functions
+ *****************************************************************************/
+/******************************************************************************
+ * plist_scan_key_is Function
+ *****************************************************************************/
+static int plist_scan_key_is(const char * key, uint32_t key_length, const char * name)
+{
+	size_t name_length = strlen(name);
+	return ((key_length == name_length) && (0 == memcmp(key, name, name_length)));
+}
+
+/******************************************************************************
+ * plist_scan_set_field Function
+ * Keep the value of the keys the fast path knows about, and ignore the rest
+ *****************************************************************************/
+static int plist_scan_set_field(struct plist_command * command, const char * key, uint32_t key_length, const struct plist_scan_value * value)
+{
+	if (plist_scan_key_is(key, key_length, "MessageType"))
+	{
+		if (PLIST_SCAN_STRING != value->type)
+		{
+			return -1;
+		}
+		command->message_type = value->string;
+		command->message_type_length = value->string_length;
+	}
+	else if (plist_scan_key_is(key, key_length, "DeviceID"))
+	{
+		if (PLIST_SCAN_INTEGER != value->type)
+		{
+			return -1;
+		}
+		command->device_id = value->integer;
+		command->fields |= PLIST_COMMAND_DEVICE_ID;
+	}
+	else if (plist_scan_key_is(key, key_length, "PortNumber"))
+	{
+		if (PLIST_SCAN_INTEGER != value->type)
+		{
+			return -1;
+		}
+		command->port_number = value->integer;
+		command->fields |= PLIST_COMMAND_PORT_NUMBER;
+	}
+	else if (plist_scan_key_is(key, key_length, "SharedMemoryRing"))
+	{
+		/* Like the libplist path, a ring size of another type is ignored */
+		if (PLIST_SCAN_INTEGER == value->type)
+		{
+			command->shared_memory_ring = value->integer;
+			command->fields |= PLIST_COMMAND_SHARED_MEMORY_RING;
+		}
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * xml_skip_space Function
+ *****************************************************************************/
+static void xml_skip_space(struct xml_scanner * scanner)
+{
+	while ((scanner->cur < scanner->end) &&
+		((' ' == *scanner->cur) || ('\t' == *scanner->cur) || ('\r' == *scanner->cur) || ('\n' == *scanner->cur)))
+	{
+		scanner->cur++;
+	}
+}
+
+/******************************************************************************
+ * xml_skip_literal Function
+ *****************************************************************************/
+static int xml_skip_literal(struct xml_scanner * scanner, const char * literal)
+{
+	size_t length = strlen(literal);
+	if (((size_t)(scanner->end - scanner->cur) < length) || (0 != memcmp(scanner->cur, literal, length)))
+	{
+		return -1;
+	}
+
+	scanner->cur += length;
+	return 0;
+}
+
+/******************************************************************************
+ * xml_skip_past Function
+ *****************************************************************************/
+static int xml_skip_past(struct xml_scanner * scanner, char c)
+{
+	const char * found = (const char *)memchr(scanner->cur, c, scanner->end - scanner->cur);
+	if (NULL == found)
+	{
+		return -1;
+	}
+
+	scanner->cur = found + 1;
+	return 0;
+}
+
+/******************************************************************************
+ * xml_skip_prolog Function
+ * Skip the XML declaration and the DOCTYPE, comments are left to libplist
+ *****************************************************************************/
+static int xml_skip_prolog(struct xml_scanner * scanner)
+{
+	for (;;)
+	{
+		xml_skip_space(scanner);
+		if (0 == xml_skip_literal(scanner, "<?"))
+		{
+			if (0 != xml_skip_past(scanner, '>'))
+			{
+				return -1;
+			}
+		}
+		else if (0 == xml_skip_literal(scanner, "<!--"))
+		{
+			return -1;
+		}
+		else if (0 == xml_skip_literal(scanner, "<!"))
+		{
+			if (0 != xml_skip_past(scanner, '>'))
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			return 0;
+		}
+	}
+}
+
+/******************************************************************************
+ * xml_text Function
+ * Take the text up to the next tag, text with entities is left to libplist
+ *****************************************************************************/
+static int xml_text(struct xml_scanner * scanner, const char ** text, uint32_t * length)
+{
+	const char * start = scanner->cur;
+	while ((scanner->cur < scanner->end) && ('<' != *scanner->cur))
+	{
+		if ('&' == *scanner->cur)
+		{
+			return -1;
+		}
+		scanner->cur++;
+	}
+	if (scanner->cur == scanner->end)
+	{
+		return -1;
+	}
+
+	*text = start;
+	*length = (uint32_t)(scanner->cur - start);
+	return 0;
+}
+
+/******************************************************************************
+ * xml_integer Function
+ *****************************************************************************/
+static int xml_integer(const char * text, uint32_t length, uint64_t * integer)
+{
+	if ((0 == length) || (PLIST_SCAN_MAX_DIGITS < length))
+	{
+		return -1;
+	}
+
+	*integer = 0;
+	for (uint32_t i = 0; i < length; i++)
+	{
+		if ((text[i] < '0') || (text[i] > '9'))
+		{
+			return -1;
+		}
+		*integer = (*integer * 10) + (text[i] - '0');
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * xml_value Function
+ *****************************************************************************/
+static int xml_value(struct xml_scanner * scanner, struct plist_scan_value * value)
+{
+	if (0 == xml_skip_literal(scanner, "<string>"))
+	{
+		value->type = PLIST_SCAN_STRING;
+		if (0 != xml_text(scanner, &(value->string), &(value->string_length)))
+		{
+			return -1;
+		}
+		return xml_skip_literal(scanner, "</string>");
+	}
+	if (0 == xml_skip_literal(scanner, "<string/>"))
+	{
+		value->type = PLIST_SCAN_STRING;
+		value->string = scanner->cur;
+		value->string_length = 0;
+		return 0;
+	}
+	if (0 == xml_skip_literal(scanner, "<integer>"))
+	{
+		const char * text = NULL;
+		uint32_t length = 0;
+		value->type = PLIST_SCAN_INTEGER;
+		if ((0 != xml_text(scanner, &text, &length)) || (0 != xml_integer(text, length, &(value->integer))))
+		{
+			return -1;
+		}
+		return xml_skip_literal(scanner, "</integer>");
+	}
+	if ((0 == xml_skip_literal(scanner, "<true/>")) || (0 == xml_skip_literal(scanner, "<false/>")))
+	{
+		value->type = PLIST_SCAN_BOOLEAN;
+		return 0;
+	}
+
+	return -1;
+}
+
+/******************************************************************************
+ * xml_scan_command Function
+ *****************************************************************************/
+static int xml_scan_command(const char * data, uint32_t size, struct plist_command * command)
+{
+	struct xml_scanner scanner = { data, data + size };
+
+	if ((0 != xml_skip_prolog(&scanner)) || (0 != xml_skip_literal(&scanner, "<plist")) || (0 != xml_skip_past(&scanner, '>')) || ('/' == scanner.cur[-2]))
+	{
+		return -1;
+	}
+	xml_skip_space(&scanner);
+	if (0 != xml_skip_literal(&scanner, "<dict>"))
+	{
+		return -1;
+	}
+
+	for (;;)
+	{
+		const char * key = NULL;
+		uint32_t key_length = 0;
+		struct plist_scan_value value = { PLIST_SCAN_BOOLEAN, NULL, 0, 0 };
+
+		xml_skip_space(&scanner);
+		if (0 == xml_skip_literal(&scanner, "</dict>"))
+		{
+			break;
+		}
+		if ((0 != xml_skip_literal(&scanner, "<key>")) || (0 != xml_text(&scanner, &key, &key_length)) || (0 != xml_skip_literal(&scanner, "</key>")))
+		{
+			return -1;
+		}
+		xml_skip_space(&scanner);
+		if ((0 != xml_value(&scanner, &value)) || (0 != plist_scan_set_field(command, key, key_length, &value)))
+		{
+			return -1;
+		}
+	}
+
+	xml_skip_space(&scanner);
+	if (0 != xml_skip_literal(&scanner, "</plist>"))
+	{
+		return -1;
+	}
+	/* Some clients count a terminating NUL in the payload */
+	while ((scanner.cur < scanner.end) && ('\0' == *scanner.cur))
+	{
+		scanner.cur++;
+	}
+	xml_skip_space(&scanner);
+
+	return (scanner.cur == scanner.end) ? 0 : -1;
+}
+
+/******************************************************************************
+ * bplist_read_be Function
+ *****************************************************************************/
+static uint64_t bplist_read_be(const unsigned char * p, uint32_t size)
+{
+	uint64_t value = 0;
+	for (uint32_t i = 0; i < size; i++)
+	{
+		value = (value << 8) | p[i];
+	}
+
+	return value;
+}
+
+/******************************************************************************
+ * bplist_object_offset Function
+ *****************************************************************************/
+static int bplist_object_offset(const struct bplist_scanner * scanner, uint64_t ref, uint64_t * offset)
+{
+	if (ref >= scanner->num_objects)
+	{
+		return -1;
+	}
+
+	*offset = bplist_read_be(scanner->data + scanner->offset_table + (ref * scanner->offset_size), scanner->offset_size);
+	return ((BPLIST_MAGIC_SIZE <= *offset) && (*offset < scanner->offset_table)) ? 0 : -1;
+}
+
+/******************************************************************************
+ * bplist_object_length Function
+ * Get the length of the object at offset, and where its contents start. A
+ * length nibble of 0xF means the length follows as an int object
+ *****************************************************************************/
+static int bplist_object_length(const struct bplist_scanner * scanner, uint64_t offset, uint64_t * length, uint64_t * start)
+{
+	unsigned char marker = scanner->data[offset];
+	*start = offset + 1;
+	if (0xF != (marker & 0xF))
+	{
+		*length = marker & 0xF;
+		return 0;
+	}
+
+	if (*start >= scanner->offset_table)
+	{
+		return -1;
+	}
+	unsigned char int_marker = scanner->data[*start];
+	uint32_t int_size = 1 << (int_marker & 0xF);
+	if ((BPLIST_INT != (int_marker >> 4)) || (8 < int_size) || ((*start + 1 + int_size) > scanner->offset_table))
+	{
+		return -1;
+	}
+	*length = bplist_read_be(scanner->data + *start + 1, int_size);
+	*start += 1 + int_size;
+
+	return 0;
+}
+
+/******************************************************************************
+ * bplist_value Function
+ *****************************************************************************/
+static int bplist_value(const struct bplist_scanner * scanner, uint64_t ref, struct plist_scan_value * value)
+{
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	uint64_t start = 0;
+	if (0 != bplist_object_offset(scanner, ref, &offset))
+	{
+		return -1;
+	}
+
+	unsigned char marker = scanner->data[offset];
+	switch (marker >> 4)
+	{
+	case BPLIST_SIMPLE:
+		if ((BPLIST_FALSE != marker) && (BPLIST_TRUE != marker))
+		{
+			return -1;
+		}
+		value->type = PLIST_SCAN_BOOLEAN;
+		return 0;
+
+	case BPLIST_INT:
+		/* 1, 2, 4 or 8 bytes, 16 byte ints are left to libplist */
+		length = (uint64_t)1 << (marker & 0xF);
+		if ((8 < length) || ((offset + 1 + length) > scanner->offset_table))
+		{
+			return -1;
+		}
+		value->type = PLIST_SCAN_INTEGER;
+		value->integer = bplist_read_be(scanner->data + offset + 1, (uint32_t)length);
+		return 0;
+
+	case BPLIST_STRING:
+		if ((0 != bplist_object_length(scanner, offset, &length, &start)) || (length > (scanner->offset_table - start)))
+		{
+			return -1;
+		}
+		value->type = PLIST_SCAN_STRING;
+		value->string = (const char *)(scanner->data + start);
+		value->string_length = (uint32_t)length;
+		return 0;
+
+	default:
+		return -1;
+	}
+}
+
+/******************************************************************************
+ * bplist_scan_command Function
+ *****************************************************************************/
+static int bplist_scan_command(const char * data, uint32_t size, struct plist_command * command)
+{
+	struct bplist_scanner scanner = { 0 };
+	uint64_t offset = 0;
+	uint64_t count = 0;
+	uint64_t refs = 0;
+
+	if ((BPLIST_MAGIC_SIZE + BPLIST_TRAILER_SIZE) > size)
+	{
+		return -1;
+	}
+
+	const unsigned char * trailer = (const unsigned char *)data + size - BPLIST_TRAILER_SIZE;
+	scanner.data = (const unsigned char *)data;
+	scanner.offset_size = trailer[6];
+	scanner.ref_size = trailer[7];
+	scanner.num_objects = bplist_read_be(trailer + 8, 8);
+	uint64_t top_object = bplist_read_be(trailer + 16, 8);
+	scanner.offset_table = bplist_read_be(trailer + 24, 8);
+
+	uint64_t table_space = size - BPLIST_TRAILER_SIZE;
+	if ((0 == scanner.offset_size) || (8 < scanner.offset_size) || (0 == scanner.ref_size) || (8 < scanner.ref_size) ||
+		(BPLIST_MAGIC_SIZE > scanner.offset_table) || (table_space <= scanner.offset_table) ||
+		(scanner.num_objects > ((table_space - scanner.offset_table) / scanner.offset_size)))
+	{
+		return -1;
+	}
+
+	/* The top object has to be a dict */
+	if ((0 != bplist_object_offset(&scanner, top_object, &offset)) || (BPLIST_DICT != (scanner.data[offset] >> 4)) ||
+		(0 != bplist_object_length(&scanner, offset, &count, &refs)) ||
+		(count > ((scanner.offset_table - refs) / scanner.ref_size / 2)))
+	{
+		return -1;
+	}
+
+	/* Key refs first, then value refs */
+	for (uint64_t i = 0; i < count; i++)
+	{
+		struct plist_scan_value key = { PLIST_SCAN_BOOLEAN, NULL, 0, 0 };
+		struct plist_scan_value value = { PLIST_SCAN_BOOLEAN, NULL, 0, 0 };
+		uint64_t key_ref = bplist_read_be(scanner.data + refs + (i * scanner.ref_size), scanner.ref_size);
+		uint64_t value_ref = bplist_read_be(scanner.data + refs + ((count + i) * scanner.ref_size), scanner.ref_size);
+
+		if ((0 != bplist_value(&scanner, key_ref, &key)) || (PLIST_SCAN_STRING != key.type) ||
+			(0 != bplist_value(&scanner, value_ref, &value)) ||
+			(0 != plist_scan_set_field(command, key.string, key.string_length, &value)))
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * Functions
+ *****************************************************************************/
+/******************************************************************************
+ * plist_scan_command Function
+ *****************************************************************************/
+int plist_scan_command(const char * data, uint32_t size, enum plist_format_t format, struct plist_command * command)
+{
+	int res = -1;
+
+	memset(command, 0, sizeof(*command));
+	if (PLIST_FORMAT_BINARY == format)
+	{
+		res = bplist_scan_command(data, size, command);
+	}
+	else
+	{
+		res = xml_scan_command(data, size, command);
+	}
+	if ((0 != res) || (NULL == command->message_type))
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ * plist_command_is Function
+ *****************************************************************************/
+int plist_command_is(const struct plist_command * command, const char * message)
+{
+	return plist_scan_key_is(command->message_type, command->message_type_length, message);
+}
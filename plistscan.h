@@ -0,0 +1,44 @@
+/******************************************************************************
+ * plistscan.h
+ *****************************************************************************/
+#ifndef __USBMUXD_PLISTSCAN_H__
+#define __USBMUXD_PLISTSCAN_H__
+
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+#include <stdint.h>
+
+#include "utils.h"
+
+/******************************************************************************
+ * Defs & Types
+ *****************************************************************************/
+/* Bits of plist_command.fields, set for the fields the command carries */
+#define PLIST_COMMAND_DEVICE_ID (0x1)
+#define PLIST_COMMAND_PORT_NUMBER (0x2)
+#define PLIST_COMMAND_SHARED_MEMORY_RING (0x4)
+
+/* The fields of a client command that don't need a parsed plist */
+struct plist_command {
+	const char * message_type;		// points into the payload, not NUL terminated
+	uint32_t message_type_length;
+	uint32_t fields;
+	uint64_t device_id;
+	uint64_t port_number;
+	uint64_t shared_memory_ring;
+};
+
+/******************************************************************************
+ * Functions
+ *****************************************************************************/
+/* Scan a plist command in place, without allocating. Only a top level dict of
+ * strings, integers and booleans with a MessageType is understood, anything
+ * else (nested values, entities, UTF-16 strings, ...) returns -1, and the
+ * payload should go through libplist instead. Returns 0 on success */
+int plist_scan_command(const char * data, uint32_t size, enum plist_format_t format, struct plist_command * command);
+
+/* Whether the scanned MessageType is message */
+int plist_command_is(const struct plist_command * command, const char * message);
+
+#endif /* __USBMUXD_PLISTSCAN_H__ */
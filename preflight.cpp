@@ -41,18 +41,18 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 #include <libimobiledevice/notification_proxy.h>
 #endif
 
-#ifdef _MSC_VER
-	#define sleep(x) Sleep((x) * 1000)
-#endif
-
 #include "preflight.h"
 #include "device.h"
 #include "client.h"
 #include "conf.h"
 #include "log.h"
+#include "utils.h"
 
 #define DEVICE_MONITOR_CHANGE_TIMEOUT (3000)
 #define LOCKDOWN_RECREATION_ATTEMPTS (3)
+#define PREFLIGHT_WORKERS (4)
+#define PREFLIGHT_POLL_INTERVAL_MIN (1000)
+#define PREFLIGHT_POLL_INTERVAL_MAX (16000)
 
 #ifdef HAVE_LIBIMOBILEDEVICE
 enum connection_type {
@@ -87,6 +87,46 @@ struct cb_data {
 										SetEvent((pcb)->is_paired_signal);\
 									}
 
+enum preflight_state {
+	PREFLIGHT_START,		// lockdown handshake not done yet
+	PREFLIGHT_WAIT_TRUST,	// waiting for the user to trust this computer
+};
+
+/* The preflight of a device. It only holds a worker while it runs a step,
+ * a job waiting for trust is woken by np_callback() or its next pair poll */
+struct preflight_job {
+	struct device_info *info;
+	idevice_t dev;
+	enum preflight_state state;
+	int running;
+	lockdownd_client_t lockdown;
+	struct cb_data cbdata;
+	int lockdown_recreation_attempts;
+	uint32_t poll_interval;		// grows up to PREFLIGHT_POLL_INTERVAL_MAX
+	uint64_t next_poll;
+};
+
+// Jobs not over yet, and the workers running them. There are at most
+// MCE_PREFLIGHT_WORKERS workers, which exit once no job is left for them
+static struct collection preflight_jobs;
+static pthread_mutex_t preflight_mutex;
+static CONDITION_VARIABLE preflight_cond;
+static int preflight_workers;
+static int preflight_sleeping_workers;
+static int preflight_max_workers;
+
+/**
+ * Have the workers look at the jobs again, after something a waiting job
+ * waits for happened. Taking the lock makes sure a worker that looked at the
+ * jobs before the change is asleep by now, and gets the wakeup.
+ */
+static void preflight_wake(void)
+{
+	pthread_mutex_lock(&preflight_mutex);
+	WakeAllConditionVariable(&preflight_cond);
+	pthread_mutex_unlock(&preflight_mutex);
+}
+
 static void lockdownd_set_untrusted_host_buid(lockdownd_client_t lockdown)
 {
 	char* system_buid = NULL;
@@ -102,9 +142,10 @@ void preflight_device_remove_cb(void *data)
 		return;
 	struct cb_data *cbdata = (struct cb_data*)data;
 	cbdata->is_device_connected = 0;
+	preflight_wake();
 }
 
-static void np_callback(const char* notification, void* userdata)
+static void np_handle_notification(const char* notification, void* userdata)
 {
 	usbmuxd_log(LL_INFO, "%s: in", __func__);
 	struct cb_data *cbdata = (struct cb_data*)userdata;
@@ -162,6 +203,12 @@ static void np_callback(const char* notification, void* userdata)
 	}
 }
 
+static void np_callback(const char* notification, void* userdata)
+{
+	np_handle_notification(notification, userdata);
+	preflight_wake();
+}
+
 static int itunes_setup_has_completed(lockdownd_client_t lockdown)
 {
 	plist_t setup_completed_node = NULL;
@@ -180,22 +227,21 @@ static int itunes_setup_has_completed(lockdownd_client_t lockdown)
 	return ret;
 }
 
-#ifdef _MSC_VER
-static void preflight_worker_handle_device_add(void* userdata)
-#else
-static void* preflight_worker_handle_device_add(void* userdata)
-#endif
+/**
+ * Run the first step of a preflight: the lockdown handshake, and pairing if
+ * the device allows it without the user.
+ *
+ * @param job The preflight, in the PREFLIGHT_START state.
+ *
+ * @return 1 once the preflight is over, 0 if it now waits for the user to
+ *   trust this computer, see preflight_poll_trust().
+ */
+static int preflight_start(struct preflight_job *job)
 {
-	struct device_info *info = (struct device_info*)userdata;
-	struct idevice_private *_dev = (struct idevice_private*)malloc(sizeof(struct idevice_private));
-	_dev->udid = strdup(info->serial);
-	_dev->mux_id = info->id;
-	_dev->conn_type = CONNECTION_USBMUXD;
-	_dev->conn_data = NULL;
-	_dev->version = 0;
-
-
-	idevice_t dev = (idevice_t)_dev;
+	struct device_info *info = job->info;
+	idevice_t dev = job->dev;
+	struct idevice_private *_dev = (struct idevice_private*)dev;
+	int done = 1;
 
 	lockdownd_client_t lockdown = NULL;
 	lockdownd_error_t lerr;
@@ -367,19 +413,20 @@ retry:
 		/* Let clients know we are waiting for the user to trust this computer */
 		client_device_trust_pending(info);
 
-		struct cb_data cbdata = { 0 };
-		cbdata.dev = dev;
-		cbdata.np = np;
-		cbdata.version_major = version_major;
-		cbdata.is_device_connected = 1;
-		//pthread_mutex_init(&(cbdata.pairing_lock));
-		cbdata.is_paired_signal = CreateEvent(NULL, TRUE, FALSE, NULL);
-		if (FALSE == IS_VALID_HANDLE(cbdata.is_paired_signal)) {
+		struct cb_data *cbdata = &job->cbdata;
+		cbdata->dev = dev;
+		cbdata->np = np;
+		cbdata->version_major = version_major;
+		cbdata->is_device_connected = 1;
+		cbdata->is_paired_signal = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (FALSE == IS_VALID_HANDLE(cbdata->is_paired_signal)) {
+			np_client_free(np);
+			cbdata->np = NULL;
 			goto leave;
 		}
 
-		np_set_notify_callback(np, np_callback, (void*)&cbdata);
-		device_set_preflight_cb_data(info->id, (void*)&cbdata);
+		np_set_notify_callback(np, np_callback, (void*)cbdata);
+		device_set_preflight_cb_data(info->id, (void*)cbdata);
 
 		const char* spec[] = {
 			"com.apple.mobile.lockdown.request_pair",
@@ -399,80 +446,11 @@ retry:
 		 * make device visible anyways */
 		/*client_device_add(info);*/
 
-		int nLockdownRecreationAttempts = LOCKDOWN_RECREATION_ATTEMPTS;
-		while (cbdata.np && (cbdata.is_device_connected == 1) && (FALSE == IS_PAIRED(&cbdata)) && (nLockdownRecreationAttempts >= 0))
-		{
-			if (8 <= version_major){
-				if (WAIT_TIMEOUT != WaitForSingleObject(cbdata.is_paired_signal, 1000)) {
-					break;
-				}
-			} else {
-				sleep(1);
-			}
-			
-			//pthread_mutex_lock(&(cbdata.pairing_lock));
-			//if (cbdata.is_paired == 0)
-			//{
-				/* To detect if the user has denied pairing, we must poll the device */
-				lerr = lockdownd_pair(lockdown, NULL);
-				if (LOCKDOWN_E_USER_DENIED_PAIRING == lerr)
-				{
-					usbmuxd_log(LL_INFO, "%s: User has denied pairing on device %s", __func__, _dev->udid);
-					client_device_user_denied_pairing(info);
-					DEBUG_MCE("SetDeviceMonitoring client_device_user_denied_pairing  location:%d %s", info->location, MONITOR_STATE(DEVICE_MONITOR_DISABLE));
-					/* Cancel the the device monitoring */
-					(void)usb_set_device_monitoring(info->location, DEVICE_MONITOR_DISABLE, DEVICE_MONITOR_CHANGE_TIMEOUT);
-
-					//pthread_mutex_unlock(&(cbdata.pairing_lock));
-					break;
-				}
-				else if (LOCKDOWN_E_MUX_ERROR == lerr) //TBX-36464 passlocked iOS 9 after restart - must refresh lockdown client, np call back isn't called
-				{
-					usbmuxd_log(LL_INFO, "%s: lockdown pair mux error on device %s, creating a new lockdown client", __func__, _dev->udid);
-					nLockdownRecreationAttempts--;
-					lockdownd_client_free(lockdown);
-					lockdown = NULL;
-					lerr = lockdownd_client_new(dev, &lockdown, "usbmuxd");
-					if (LOCKDOWN_E_SUCCESS != lerr)
-					{
-						usbmuxd_log(LL_INFO, "%s: creating a new lockdown client failed on device %s", __func__, _dev->udid);
-					}
-				}
-				else if (LOCKDOWN_E_SUCCESS == lerr)
-				{
-					IOS_8_SIGNAL_IS_PAIRED(&cbdata);
-				}
-				else
-				{
-					usbmuxd_log(LL_INFO, "%s: lockdown pair error with device %s", __func__, _dev->udid);
-				}
-			//}
-			//pthread_mutex_unlock(&(cbdata.pairing_lock));
-		}
-
-		if (lockdown) {
-			lockdownd_client_free(lockdown);
-			lockdown = NULL;
-		}
-
-		usbmuxd_log(LL_INFO, "%s: Finished waiting for notification from device %s, is_device_connected %d", __func__, _dev->udid, cbdata.is_device_connected);
-
-		device_set_preflight_cb_data(info->id, NULL);
-		if (cbdata.np) {
-			np_set_notify_callback(cbdata.np, NULL, NULL);
-			np_client_free(cbdata.np);
-		}
-
-		/* On iOS 8, it seems like the pairing completes with a reconnection */
-		if ((8 <= version_major) && IS_PAIRED(&cbdata)) {
-			//lerr = lockdownd_pair(lockdown, NULL);
-			client_device_add(info);
-			DEBUG_MCE("SetDeviceMonitoring 8<version_major location:%d %s", info->location, MONITOR_STATE(DEVICE_MONITOR_DISABLE));
-			(void)usb_set_device_monitoring(info->location, DEVICE_MONITOR_DISABLE, DEVICE_MONITOR_CHANGE_TIMEOUT);
-		}
-
-		CloseHandle(cbdata.is_paired_signal);
-		//pthread_mutex_destroy(&(cbdata.pairing_lock));
+		job->lockdown_recreation_attempts = LOCKDOWN_RECREATION_ATTEMPTS;
+		job->poll_interval = PREFLIGHT_POLL_INTERVAL_MIN;
+		job->next_poll = mstime64() + job->poll_interval;
+		job->state = PREFLIGHT_WAIT_TRUST;
+		done = 0;
 	} else {
 		/* iOS 6.x and earlier */
 		lerr = lockdownd_pair(lockdown, NULL);
@@ -519,16 +497,190 @@ leave:
 		plist_free(value);
 	if (version_str)
 		libimobiledevice_free(version_str);
-	if (lockdown)
-		lockdownd_client_free(lockdown);
-	if (dev) {
-		free(_dev->udid);
-		free(_dev);
+	if (done) {
+		if (lockdown)
+			lockdownd_client_free(lockdown);
+	} else {
+		job->lockdown = lockdown;
 	}
 
-	device_preflight_finished(info->id);
+	return done;
+}
 
-	free(info);
+/**
+ * Stop waiting for the user to trust this computer, and make the device
+ * visible if it got paired.
+ *
+ * @param job The preflight, in the PREFLIGHT_WAIT_TRUST state.
+ */
+static void preflight_finish_trust_wait(struct preflight_job *job)
+{
+	struct device_info *info = job->info;
+	struct idevice_private *_dev = (struct idevice_private*)job->dev;
+	struct cb_data *cbdata = &job->cbdata;
+
+	if (job->lockdown) {
+		lockdownd_client_free(job->lockdown);
+		job->lockdown = NULL;
+	}
+
+	usbmuxd_log(LL_INFO, "%s: Finished waiting for notification from device %s, is_device_connected %d", __func__, _dev->udid, cbdata->is_device_connected);
+
+	device_set_preflight_cb_data(info->id, NULL);
+	if (cbdata->np) {
+		np_set_notify_callback(cbdata->np, NULL, NULL);
+		np_client_free(cbdata->np);
+	}
+
+	/* On iOS 8, it seems like the pairing completes with a reconnection */
+	if ((8 <= cbdata->version_major) && IS_PAIRED(cbdata)) {
+		//lerr = lockdownd_pair(lockdown, NULL);
+		client_device_add(info);
+		DEBUG_MCE("SetDeviceMonitoring 8<version_major location:%d %s", info->location, MONITOR_STATE(DEVICE_MONITOR_DISABLE));
+		(void)usb_set_device_monitoring(info->location, DEVICE_MONITOR_DISABLE, DEVICE_MONITOR_CHANGE_TIMEOUT);
+	}
+
+	CloseHandle(cbdata->is_paired_signal);
+}
+
+/**
+ * Poll the pairing of a device waiting for trust. The user trusting this
+ * computer is reported by np_callback(), the poll is only needed to find out
+ * that the user denied it, so it backs off up to PREFLIGHT_POLL_INTERVAL_MAX.
+ *
+ * @param job The preflight, in the PREFLIGHT_WAIT_TRUST state.
+ *
+ * @return 1 once the preflight is over, 0 if it keeps waiting.
+ */
+static int preflight_poll_trust(struct preflight_job *job)
+{
+	struct device_info *info = job->info;
+	idevice_t dev = job->dev;
+	struct idevice_private *_dev = (struct idevice_private*)dev;
+	struct cb_data *cbdata = &job->cbdata;
+	lockdownd_error_t lerr;
+
+	if (!cbdata->np || (cbdata->is_device_connected != 1) || IS_PAIRED(cbdata) || (job->lockdown_recreation_attempts < 0)) {
+		preflight_finish_trust_wait(job);
+		return 1;
+	}
+
+	/* To detect if the user has denied pairing, we must poll the device */
+	lerr = lockdownd_pair(job->lockdown, NULL);
+	if (LOCKDOWN_E_USER_DENIED_PAIRING == lerr)
+	{
+		usbmuxd_log(LL_INFO, "%s: User has denied pairing on device %s", __func__, _dev->udid);
+		client_device_user_denied_pairing(info);
+		DEBUG_MCE("SetDeviceMonitoring client_device_user_denied_pairing  location:%d %s", info->location, MONITOR_STATE(DEVICE_MONITOR_DISABLE));
+		/* Cancel the the device monitoring */
+		(void)usb_set_device_monitoring(info->location, DEVICE_MONITOR_DISABLE, DEVICE_MONITOR_CHANGE_TIMEOUT);
+		preflight_finish_trust_wait(job);
+		return 1;
+	}
+	else if (LOCKDOWN_E_MUX_ERROR == lerr) //TBX-36464 passlocked iOS 9 after restart - must refresh lockdown client, np call back isn't called
+	{
+		usbmuxd_log(LL_INFO, "%s: lockdown pair mux error on device %s, creating a new lockdown client", __func__, _dev->udid);
+		job->lockdown_recreation_attempts--;
+		lockdownd_client_free(job->lockdown);
+		job->lockdown = NULL;
+		lerr = lockdownd_client_new(dev, &job->lockdown, "usbmuxd");
+		if (LOCKDOWN_E_SUCCESS != lerr)
+		{
+			usbmuxd_log(LL_INFO, "%s: creating a new lockdown client failed on device %s", __func__, _dev->udid);
+		}
+	}
+	else if (LOCKDOWN_E_SUCCESS == lerr)
+	{
+		IOS_8_SIGNAL_IS_PAIRED(cbdata);
+	}
+	else
+	{
+		usbmuxd_log(LL_INFO, "%s: lockdown pair error with device %s", __func__, _dev->udid);
+	}
+
+	job->next_poll = mstime64() + job->poll_interval;
+	job->poll_interval = (job->poll_interval * 2 > PREFLIGHT_POLL_INTERVAL_MAX) ? PREFLIGHT_POLL_INTERVAL_MAX : job->poll_interval * 2;
+	return 0;
+}
+
+/**
+ * Get the time a job has its next step due.
+ *
+ * @param job The preflight.
+ *
+ * @return The mstime64() time of the next step, 0 if it is due now.
+ */
+static uint64_t preflight_job_due(struct preflight_job *job)
+{
+	if (job->state == PREFLIGHT_START)
+		return 0;
+	if (!job->cbdata.np || (job->cbdata.is_device_connected != 1) || IS_PAIRED(&job->cbdata))
+		return 0;
+	return job->next_poll;
+}
+
+static void preflight_job_free(struct preflight_job *job)
+{
+	struct idevice_private *_dev = (struct idevice_private*)job->dev;
+	if (job->lockdown)
+		lockdownd_client_free(job->lockdown);
+	free(_dev->udid);
+	free(_dev);
+
+	device_preflight_finished(job->info->id);
+
+	free(job->info);
+	free(job);
+}
+
+#ifdef _MSC_VER
+static void preflight_worker(void* userdata)
+#else
+static void* preflight_worker(void* userdata)
+#endif
+{
+	pthread_mutex_lock(&preflight_mutex);
+	for (;;) {
+		struct preflight_job *job = NULL;
+		uint64_t now = mstime64();
+		uint64_t next = (uint64_t)-1;
+		FOREACH(struct preflight_job *j, &preflight_jobs, struct preflight_job *) {
+			if (j->running)
+				continue;
+			uint64_t due = preflight_job_due(j);
+			if (due <= now) {
+				job = j;
+				break;
+			}
+			if (due < next)
+				next = due;
+		} ENDFOREACH
+
+		if (job) {
+			job->running = 1;
+			pthread_mutex_unlock(&preflight_mutex);
+			int done = (job->state == PREFLIGHT_START) ? preflight_start(job) : preflight_poll_trust(job);
+			pthread_mutex_lock(&preflight_mutex);
+			job->running = 0;
+			if (done) {
+				collection_remove(&preflight_jobs, job);
+				pthread_mutex_unlock(&preflight_mutex);
+				preflight_job_free(job);
+				pthread_mutex_lock(&preflight_mutex);
+			}
+			continue;
+		}
+
+		/* The jobs being run are left to their workers */
+		if (next == (uint64_t)-1)
+			break;
+
+		preflight_sleeping_workers++;
+		SleepConditionVariableCS(&preflight_cond, &preflight_mutex, (DWORD)(next - now));
+		preflight_sleeping_workers--;
+	}
+	preflight_workers--;
+	pthread_mutex_unlock(&preflight_mutex);
 
 	#ifndef _MSC_VER
 		return NULL;
@@ -540,15 +692,66 @@ void preflight_device_remove_cb(void *data)
 }
 #endif
 
+void preflight_init(void)
+{
+#ifdef HAVE_LIBIMOBILEDEVICE
+	collection_init(&preflight_jobs);
+	pthread_mutex_init(&preflight_mutex, NULL);
+	InitializeConditionVariable(&preflight_cond);
+	preflight_workers = 0;
+	preflight_sleeping_workers = 0;
+	preflight_max_workers = env_get_int("MCE_PREFLIGHT_WORKERS", PREFLIGHT_WORKERS);
+	if (preflight_max_workers < 1)
+		preflight_max_workers = 1;
+#endif
+}
+
 void preflight_worker_device_add(struct device_info* info)
 {
 #ifdef HAVE_LIBIMOBILEDEVICE
+	struct preflight_job *job = (struct preflight_job*)malloc(sizeof(struct preflight_job));
+	struct idevice_private *_dev = (struct idevice_private*)malloc(sizeof(struct idevice_private));
 	struct device_info *infocopy = (struct device_info*)malloc(sizeof(struct device_info));
+	if (!job || !_dev || !infocopy) {
+		usbmuxd_log(LL_ERROR, "%s: Out of memory, no preflight for device %d", __func__, info->id);
+		free(job);
+		free(_dev);
+		free(infocopy);
+		device_preflight_finished(info->id);
+		return;
+	}
 
 	memcpy(infocopy, info, sizeof(struct device_info));
 
-	pthread_t th;
-	pthread_create(&th, NULL, preflight_worker_handle_device_add, infocopy);
+	_dev->udid = strdup(info->serial);
+	_dev->mux_id = info->id;
+	_dev->conn_type = CONNECTION_USBMUXD;
+	_dev->conn_data = NULL;
+	_dev->version = 0;
+
+	memset(job, 0, sizeof(struct preflight_job));
+	job->info = infocopy;
+	job->dev = (idevice_t)_dev;
+	job->state = PREFLIGHT_START;
+
+	/* Hand the job to a sleeping worker, or to a new one while under the limit.
+	 * Otherwise it waits for a busy worker to be done with its current step */
+	pthread_mutex_lock(&preflight_mutex);
+	collection_add(&preflight_jobs, job);
+	if (preflight_sleeping_workers > 0) {
+		WakeConditionVariable(&preflight_cond);
+	} else if (preflight_workers < preflight_max_workers) {
+		pthread_t th;
+		preflight_workers++;
+		/* pthread_create() only assigns the handle, _beginthread() fails with -1 */
+		pthread_create(&th, NULL, preflight_worker, NULL);
+		if ((pthread_t)-1L == th) {
+			/* The job waits for the next worker, the busy ones pick it up */
+			preflight_workers--;
+			usbmuxd_log(LL_ERROR, "%s: Could not start a preflight worker for device %d", __func__, info->id);
+		}
+	}
+	pthread_mutex_unlock(&preflight_mutex);
 #else
 	client_device_add(info);
 #endif
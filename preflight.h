@@ -26,6 +26,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 extern void userpref_get_system_buid(char **systembuid);
 extern void userpref_device_record_get_host_id(const char *udid, char **host_id);
 
+void preflight_init(void);
 void preflight_device_remove_cb(void *data);
 void preflight_worker_device_add(struct device_info* info);
 
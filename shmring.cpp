@@ -0,0 +1,355 @@
+/******************************************************************************
+ * shmring.cpp
+ *****************************************************************************/
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+#include "stdafx.h"
+#include "shmring.h"
+#include "log.h"
+#include "WindowsUtil.h"
+#include "SocketUtil.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/******************************************************************************
+ * Defs & Types
+ *****************************************************************************/
+#define SHM_RING_NAME_FORMAT ("Local\\usbmuxd-ring-{%s}")
+
+struct shm_ring
+{
+	HANDLE mapping;
+	struct shm_ring_area * area;
+	unsigned char * data[SHM_RING_COUNT];
+	uint32_t size;
+	int corrupt;
+	char name[64];
+};
+
+/******************************************************************************
+ * Internal Functions
+ *****************************************************************************/
+/******************************************************************************
+ * shm_ring_round_size Function
+ *****************************************************************************/
+static uint32_t shm_ring_round_size(uint32_t size)
+{
+	uint32_t rounded = SHM_RING_MIN_SIZE;
+	while ((rounded < size) && (rounded < SHM_RING_MAX_SIZE))
+	{
+		rounded <<= 1;
+	}
+
+	return rounded;
+}
+
+/******************************************************************************
+ * shm_ring_arm Function
+ * Set a waiting flag, then check the ring again. The full barrier makes
+ * sure the peer either sees the flag or has already moved its index.
+ *****************************************************************************/
+static void shm_ring_arm(volatile uint32_t * waiting)
+{
+	(void)InterlockedExchange((volatile LONG *)waiting, 1);
+}
+
+/******************************************************************************
+ * shm_ring_should_kick Function
+ *****************************************************************************/
+static int shm_ring_should_kick(volatile uint32_t * waiting)
+{
+	MemoryBarrier();
+	if (0 == *waiting)
+	{
+		return 0;
+	}
+
+	return (1 == InterlockedExchange((volatile LONG *)waiting, 0));
+}
+
+/******************************************************************************
+ * shm_ring_check_used Function
+ * The client can write anything to the indexes, never trust more bytes in use
+ * than the ring holds. Once it lied, the ring stays corrupt.
+ *****************************************************************************/
+static int shm_ring_check_used(struct shm_ring * ring, uint32_t used)
+{
+	if (ring->corrupt)
+	{
+		return 0;
+	}
+	if (used > ring->size)
+	{
+		usbmuxd_log(LL_ERROR, "Shared memory ring %s is corrupt", ring->name);
+		ring->corrupt = 1;
+		return 0;
+	}
+
+	return 1;
+}
+
+/******************************************************************************
+ * Functions
+ *****************************************************************************/
+/******************************************************************************
+ * shm_ring_create Function
+ *****************************************************************************/
+struct shm_ring * shm_ring_create(uint32_t size, int client_fd)
+{
+	SECURITY_ATTRIBUTES tSecurityAttributes = { 0 };
+	CStringA strUuid;
+	DWORD dwClientPid = 0;
+	DWORD dwSectionSize = 0;
+
+	struct shm_ring * ring = (struct shm_ring *)calloc(1, sizeof(struct shm_ring));
+	if (NULL == ring)
+	{
+		return NULL;
+	}
+
+	/* The section carries the client's device stream, so only the client's
+	 * user may open it, and its name is random rather than a counter */
+	dwClientPid = SocketGetPeerProcessId((SOCKET)client_fd);
+	if (0 == dwClientPid)
+	{
+		usbmuxd_log(LL_ERROR, "Could not find the process of client %d", client_fd);
+		goto lblCleanup;
+	}
+	if (FALSE == CreateProcessUserSecurityAttributes(dwClientPid, FILE_MAP_ALL_ACCESS, &tSecurityAttributes))
+	{
+		usbmuxd_log(LL_ERROR, "Could not restrict a shared memory section to process %u", dwClientPid);
+		goto lblCleanup;
+	}
+	if (FALSE == CreateUuidString(strUuid))
+	{
+		usbmuxd_log(LL_ERROR, "CreateUuidString has failed");
+		goto lblCleanup;
+	}
+
+	ring->size = shm_ring_round_size(size);
+	(void)StringCchPrintfA(ring->name, sizeof(ring->name), SHM_RING_NAME_FORMAT, (LPCSTR)strUuid);
+
+	dwSectionSize = sizeof(struct shm_ring_area) + (SHM_RING_COUNT * ring->size);
+	ring->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, &tSecurityAttributes, PAGE_READWRITE, 0, dwSectionSize, ring->name);
+	if (NULL == ring->mapping)
+	{
+		usbmuxd_log(LL_ERROR, "CreateFileMapping of %s has failed: %u", ring->name, GetLastError());
+		goto lblCleanup;
+	}
+	if (ERROR_ALREADY_EXISTS == GetLastError())
+	{
+		/* Someone else took the name, don't share their section */
+		usbmuxd_log(LL_ERROR, "Shared memory section %s already exists", ring->name);
+		goto lblCleanup;
+	}
+
+	ring->area = (struct shm_ring_area *)MapViewOfFile(ring->mapping, FILE_MAP_ALL_ACCESS, 0, 0, dwSectionSize);
+	if (NULL == ring->area)
+	{
+		usbmuxd_log(LL_ERROR, "MapViewOfFile of %s has failed: %u", ring->name, GetLastError());
+		goto lblCleanup;
+	}
+
+	/* New sections are zero filled */
+	ring->area->magic = SHM_RING_MAGIC;
+	ring->area->version = SHM_RING_VERSION;
+	ring->area->ring_size = ring->size;
+	for (int i = 0; i < SHM_RING_COUNT; i++)
+	{
+		ring->data[i] = (unsigned char *)(ring->area + 1) + (i * ring->size);
+	}
+
+	FreeNullSecurityAttributes(&tSecurityAttributes);
+	return ring;
+
+lblCleanup:
+	FreeNullSecurityAttributes(&tSecurityAttributes);
+	shm_ring_destroy(ring);
+	return NULL;
+}
+
+/******************************************************************************
+ * shm_ring_destroy Function
+ *****************************************************************************/
+void shm_ring_destroy(struct shm_ring * ring)
+{
+	if (NULL == ring)
+	{
+		return;
+	}
+
+	if (NULL != ring->area)
+	{
+		(void)UnmapViewOfFile(ring->area);
+	}
+	if (NULL != ring->mapping)
+	{
+		(void)CloseHandle(ring->mapping);
+	}
+	free(ring);
+}
+
+/******************************************************************************
+ * shm_ring_name Function
+ *****************************************************************************/
+const char * shm_ring_name(struct shm_ring * ring)
+{
+	return ring->name;
+}
+
+/******************************************************************************
+ * shm_ring_size Function
+ *****************************************************************************/
+uint32_t shm_ring_size(struct shm_ring * ring)
+{
+	return ring->size;
+}
+
+/******************************************************************************
+ * shm_ring_write Function
+ *****************************************************************************/
+uint32_t shm_ring_write(struct shm_ring * ring, const void * buf, uint32_t len, int * kick)
+{
+	struct shm_ring_header * header = &(ring->area->rings[SHM_RING_TO_CLIENT]);
+	unsigned char * data = ring->data[SHM_RING_TO_CLIENT];
+	uint32_t head = header->head;
+	uint32_t written = 0;
+	int armed = 0;
+
+	*kick = 0;
+	while (written < len)
+	{
+		uint32_t used = head - header->tail;
+		if (0 == shm_ring_check_used(ring, used))
+		{
+			break;
+		}
+		uint32_t space = ring->size - used;
+		if (0 == space)
+		{
+			if (armed)
+			{
+				break;
+			}
+			shm_ring_arm(&(header->producer_waiting));
+			armed = 1;
+			continue;
+		}
+
+		uint32_t chunk = (space < (len - written)) ? space : (len - written);
+		uint32_t offset = head & (ring->size - 1);
+		uint32_t first = ((ring->size - offset) < chunk) ? (ring->size - offset) : chunk;
+		memcpy(data + offset, (const unsigned char *)buf + written, first);
+		memcpy(data, (const unsigned char *)buf + written + first, chunk - first);
+
+		/* Publish the data before the new head */
+		MemoryBarrier();
+		head += chunk;
+		header->head = head;
+		written += chunk;
+	}
+
+	if (0 < written)
+	{
+		*kick = shm_ring_should_kick(&(header->consumer_waiting));
+	}
+
+	return written;
+}
+
+/******************************************************************************
+ * shm_ring_read Function
+ *****************************************************************************/
+uint32_t shm_ring_read(struct shm_ring * ring, void * buf, uint32_t len, int * kick)
+{
+	struct shm_ring_header * header = &(ring->area->rings[SHM_RING_FROM_CLIENT]);
+	unsigned char * data = ring->data[SHM_RING_FROM_CLIENT];
+	uint32_t tail = header->tail;
+	uint32_t read = 0;
+	int armed = 0;
+
+	*kick = 0;
+	while (read < len)
+	{
+		uint32_t used = header->head - tail;
+		if (0 == shm_ring_check_used(ring, used))
+		{
+			break;
+		}
+		if (0 == used)
+		{
+			if (armed)
+			{
+				break;
+			}
+			shm_ring_arm(&(header->consumer_waiting));
+			armed = 1;
+			continue;
+		}
+
+		/* Read the data only after the head that covers it */
+		MemoryBarrier();
+		uint32_t chunk = (used < (len - read)) ? used : (len - read);
+		uint32_t offset = tail & (ring->size - 1);
+		uint32_t first = ((ring->size - offset) < chunk) ? (ring->size - offset) : chunk;
+		memcpy((unsigned char *)buf + read, data + offset, first);
+		memcpy((unsigned char *)buf + read + first, data, chunk - first);
+
+		/* Done with the data before giving its space back */
+		MemoryBarrier();
+		tail += chunk;
+		header->tail = tail;
+		read += chunk;
+	}
+
+	if (0 < read)
+	{
+		*kick = shm_ring_should_kick(&(header->producer_waiting));
+	}
+
+	return read;
+}
+
+/******************************************************************************
+ * shm_ring_poll_write Function
+ *****************************************************************************/
+int shm_ring_poll_write(struct shm_ring * ring)
+{
+	struct shm_ring_header * header = &(ring->area->rings[SHM_RING_TO_CLIENT]);
+	uint32_t used = header->head - header->tail;
+	if ((0 == shm_ring_check_used(ring, used)) || (ring->size != used))
+	{
+		return 1;
+	}
+
+	shm_ring_arm(&(header->producer_waiting));
+	used = header->head - header->tail;
+	return ((0 == shm_ring_check_used(ring, used)) || (ring->size != used));
+}
+
+/******************************************************************************
+ * shm_ring_poll_read Function
+ *****************************************************************************/
+int shm_ring_poll_read(struct shm_ring * ring)
+{
+	struct shm_ring_header * header = &(ring->area->rings[SHM_RING_FROM_CLIENT]);
+	uint32_t used = header->head - header->tail;
+	if ((0 == shm_ring_check_used(ring, used)) || (0 != used))
+	{
+		return 1;
+	}
+
+	shm_ring_arm(&(header->consumer_waiting));
+	used = header->head - header->tail;
+	return ((0 == shm_ring_check_used(ring, used)) || (0 != used));
+}
+
+/******************************************************************************
+ * shm_ring_corrupt Function
+ *****************************************************************************/
+int shm_ring_corrupt(struct shm_ring * ring)
+{
+	return ring->corrupt;
+}
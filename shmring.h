@@ -0,0 +1,89 @@
+/******************************************************************************
+ * shmring.h
+ *****************************************************************************/
+#ifndef __USBMUXD_SHMRING_H__
+#define __USBMUXD_SHMRING_H__
+
+/******************************************************************************
+ * Includes
+ *****************************************************************************/
+#include <stdint.h>
+
+/******************************************************************************
+ * Defs & Types
+ *****************************************************************************/
+/* A pair of single producer single consumer byte rings in a named shared
+ * memory section, through which a connected client and usbmuxd exchange the
+ * connection's data instead of going through the client socket.
+ *
+ * The section starts with a struct shm_ring_area, followed by the data of the
+ * rings, ring_size bytes each, in the order of enum shm_ring_direction. head
+ * and tail count the bytes produced and consumed so far (modulo 2^32), and
+ * only the producer moves head and only the consumer moves tail.
+ *
+ * A side that finds its ring empty (consumer) or full (producer) sets the
+ * matching waiting flag and checks the ring again. The other side clears the
+ * flag once it moved head or tail, and if it was set, wakes its peer up by
+ * sending a single byte on the client socket. That socket carries nothing
+ * else, and closing it ends the connection */
+#define SHM_RING_MAGIC (0x474e5253) /* "SRNG" */
+#define SHM_RING_VERSION (1)
+#define SHM_RING_MIN_SIZE (0x10000)
+#define SHM_RING_MAX_SIZE (0x400000)
+
+enum shm_ring_direction {
+	SHM_RING_TO_CLIENT,		// device -> client data, produced by usbmuxd
+	SHM_RING_FROM_CLIENT,	// client -> device data, consumed by usbmuxd
+	SHM_RING_COUNT
+};
+
+/* Each ring's indexes get a cache line of their own */
+struct shm_ring_header {
+	volatile uint32_t head;
+	volatile uint32_t producer_waiting;
+	uint32_t reserved0[14];
+	volatile uint32_t tail;
+	volatile uint32_t consumer_waiting;
+	uint32_t reserved1[14];
+};
+
+struct shm_ring_area {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t ring_size;
+	uint32_t reserved[13];
+	struct shm_ring_header rings[SHM_RING_COUNT];
+};
+
+struct shm_ring;
+
+/******************************************************************************
+ * Functions
+ *****************************************************************************/
+/* size is rounded up to a power of two within [SHM_RING_MIN_SIZE,
+ * SHM_RING_MAX_SIZE]. The section's name is what the client opens, only the
+ * user of the process at the other end of client_fd may open it */
+struct shm_ring * shm_ring_create(uint32_t size, int client_fd);
+void shm_ring_destroy(struct shm_ring * ring);
+const char * shm_ring_name(struct shm_ring * ring);
+uint32_t shm_ring_size(struct shm_ring * ring);
+
+/* Copy up to len bytes in or out of a ring, returning the number of bytes
+ * copied. Less than len are only copied once the ring ran full (write) or
+ * empty (read), in which case the peer has been asked to wake us up, or once
+ * the ring turned out corrupt. kick is set if the peer asked us to wake it
+ * up */
+uint32_t shm_ring_write(struct shm_ring * ring, const void * buf, uint32_t len, int * kick);
+uint32_t shm_ring_read(struct shm_ring * ring, void * buf, uint32_t len, int * kick);
+
+/* Whether a write (read) would return right now, copying something or finding
+ * the ring corrupt. If not, the peer has been asked to wake us up once it
+ * would */
+int shm_ring_poll_write(struct shm_ring * ring);
+int shm_ring_poll_read(struct shm_ring * ring);
+
+/* Whether the peer broke the ring's indexes. A corrupt ring copies nothing
+ * anymore, and the connection should be closed */
+int shm_ring_corrupt(struct shm_ring * ring);
+
+#endif /* __USBMUXD_SHMRING_H__ */
@@ -44,6 +44,9 @@ int usb_init(uint32_t hub_address, LPCWSTR pLuginPath)
 	g_next_usb_device_id = 1;
 	collection_init(&g_device_list);
 	InitializeCriticalSection(&g_pending_devices_lock);
+	InitializeCriticalSection(&g_tx_buffer_pool_lock);
+	g_tx_buffer_pool = NULL;
+	g_tx_buffer_pool_count = 0;
 	
 	DEBUG_MCE("USBDEV INIT list collection_init !!");
 	return 0;
@@ -86,6 +89,16 @@ void usb_shutdown(void)
 
 	DeleteCriticalSection(&g_pending_devices_lock);
 	collection_free(&g_device_list);
+
+	/* Release the pooled TX buffers (all the devices are gone by now) */
+	while (NULL != g_tx_buffer_pool)
+	{
+		void * next = *(void **)g_tx_buffer_pool;
+		free(g_tx_buffer_pool);
+		g_tx_buffer_pool = next;
+	}
+	g_tx_buffer_pool_count = 0;
+	DeleteCriticalSection(&g_tx_buffer_pool_lock);
 	DEBUG_MCE("USBDEV usb_shutdown  collection_free !!");
 	com_plugin_deinit();
 }
@@ -420,11 +433,100 @@ int usb_set_device_monitoring_immediately(uint32_t device_location, enum device_
 
 		*buf = dev->rx.buffer;
 		*buf_data_size = dev->rx.data_size;
+		dev->stats.rx_transfers++;
+		dev->stats.rx_bytes += dev->rx.data_size;
 	
 		return 0;
 	}
 #endif /* USE_PORTDRIVER_SOCKETS */
 
+/******************************************************************************
+ * usb_alloc_tx_buffer Function
+ * Get a USB_TX_BUFFER_SIZE bytes buffer for usb_send. The buffer is owned by
+ * the usb layer from the moment it's passed to usb_send, and is returned to 
+ * the pool once the transfer completes.
+ *****************************************************************************/
+unsigned char * usb_alloc_tx_buffer(void)
+{
+	void * buffer = NULL;
+
+	EnterCriticalSection(&g_tx_buffer_pool_lock);
+	if (NULL != g_tx_buffer_pool)
+	{
+		buffer = g_tx_buffer_pool;
+		g_tx_buffer_pool = *(void **)buffer;
+		g_tx_buffer_pool_count--;
+	}
+	LeaveCriticalSection(&g_tx_buffer_pool_lock);
+
+	if (NULL == buffer)
+	{
+		buffer = malloc(USB_TX_BUFFER_SIZE);
+	}
+
+	return (unsigned char *)buffer;
+}
+
+/******************************************************************************
+ * usb_free_tx_buffer Function
+ *****************************************************************************/
+void usb_free_tx_buffer(unsigned char * buf)
+{
+	if (NULL == buf)
+	{
+		return;
+	}
+
+	EnterCriticalSection(&g_tx_buffer_pool_lock);
+	if (g_tx_buffer_pool_count < TX_BUFFER_POOL_MAX_COUNT)
+	{
+		*(void **)buf = g_tx_buffer_pool;
+		g_tx_buffer_pool = buf;
+		g_tx_buffer_pool_count++;
+		buf = NULL;
+	}
+	LeaveCriticalSection(&g_tx_buffer_pool_lock);
+
+	if (NULL != buf)
+	{
+		free(buf);
+	}
+}
+
+/******************************************************************************
+ * usb_get_tx_pending Function
+ *****************************************************************************/
+uint32_t usb_get_tx_pending(struct usb_device * dev)
+{
+	#ifdef USE_PORTDRIVER_SOCKETS
+		return 0;
+	#else
+		return (uint32_t)dev->tx.pending_bytes;
+	#endif
+}
+
+/******************************************************************************
+ * usb_arm_tx_wake Function
+ *****************************************************************************/
+int usb_arm_tx_wake(struct usb_device * dev, uint32_t below)
+{
+	#ifdef USE_PORTDRIVER_SOCKETS
+		UNREFERENCED_PARAMETER(dev);
+		UNREFERENCED_PARAMETER(below);
+		return 0;
+	#else
+		/* Arm first, then check, the write thread decrements first, then checks.
+		 * Both are full barriers, so one of us sees the other */
+		(void)InterlockedExchange(&(dev->tx.wake_below), (LONG)below);
+		if ((uint32_t)dev->tx.pending_bytes < below)
+		{
+			(void)InterlockedExchange(&(dev->tx.wake_below), 0);
+			return 0;
+		}
+		return 1;
+	#endif
+}
+
 /******************************************************************************
  * usb_send Function
  *****************************************************************************/
@@ -440,12 +542,13 @@ int usb_set_device_monitoring_immediately(uint32_t device_location, enum device_
 		e.theOverLapped->hEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
 	}
 	e.buffer = (void*)buff;
+	e.length = 0;
 }
 
 void ReUseTXQElement(struct usb_device * dev, usb_device_tx_q_element& e){
 
 	if (e.buffer)
-		free(e.buffer);
+		usb_free_tx_buffer((unsigned char *)e.buffer);
 	e.buffer = NULL;
 	dev->tx.pool.enqueue(e);
 }
@@ -455,6 +558,7 @@ int usb_send(struct usb_device * dev, const unsigned char * buf, int length)
 	int iRet = -1;
 	usb_device_tx_q_element e;
 	GetTXQElement(dev, e, buf);
+	e.length = length;
 
 	/* Try to perform */
 	DWORD dwBytesTransferred = 0;
@@ -480,6 +584,7 @@ int usb_send(struct usb_device * dev, const unsigned char * buf, int length)
 			if (dev->tx.thread)
 			{
 				iRet = 0;
+				InterlockedExchangeAdd(&(dev->tx.pending_bytes), (LONG)length);
 				dev->tx.q.enqueue(e);
 			}
 			else //write thread not started will do transfer result here
@@ -518,12 +623,20 @@ int usb_send(struct usb_device * dev, const unsigned char * buf, int length)
 		ExitProcess(1);
 	}
 
+	dev->stats.tx_transfers++;
+	dev->stats.tx_bytes += length;
+	if (usb_get_tx_pending(dev) > dev->stats.tx_pending_max)
+	{
+		dev->stats.tx_pending_max = usb_get_tx_pending(dev);
+	}
+
 	/* If needed - send a zero length packet */
 	if ((0 == iRet) && (0 == (length % dev->info.tx_max_packet_size)))
 	{
 		DWORD dwEmptyBulk = 0;
 		usb_device_tx_q_element ze;
 		GetTXQElement(dev, ze,NULL);
+		dev->stats.tx_zlps++;
 
 		if (COM_OK == com_plugin_transfer(&(dev->port), FALSE, dev->info.ep_out, ze.buffer, 0, &dwEmptyBulk, NULL, 0, ze.theOverLapped))
 		{
@@ -560,6 +673,24 @@ int usb_send(struct usb_device * dev, const unsigned char * buf, int length)
 	return iRet;
 }
 
+/******************************************************************************
+ * usb_get_stats Function
+ *
+ * The counters are updated by the shard thread owning the device, the caller
+ * must hold that shard's lock.
+ *****************************************************************************/
+void usb_get_stats(struct usb_device * dev, struct usb_stats * stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	if (NULL == dev)
+	{
+		return;
+	}
+
+	*stats = dev->stats;
+	stats->tx_pending = usb_get_tx_pending(dev);
+}
+
 /******************************************************************************
  * usb_get_serial Function
  *****************************************************************************/
@@ -844,6 +975,9 @@ void usb_set_device_ready(struct usb_device *dev)
 	 *****************************************************************************/
 	static void usb_disconnect(struct usb_device * dev, bool manual_remove)
 	{
+		uint64_t ullPhaseStart = mstime64();
+		bool write_thread_running = false;
+
 		/* Signal the read thread to stop event */
 		if (IS_VALID_HANDLE(dev->rx.thread))
 		{
@@ -853,6 +987,13 @@ void usb_set_device_ready(struct usb_device *dev)
 				DEBUG_PRINT_WIN32_ERROR("SetEvent");
 			}
 
+			/* The thread might be blocked on the data events socket, waiting for 
+			 * the main thread (which may be gone already) - wake it up */
+			if (INVALID_SOCKET != dev->rx.data_events_socket)
+			{
+				(void)shutdown(dev->rx.data_events_socket, SD_BOTH);
+			}
+
 			/* Wait for the read thread to finish */
 			DWORD dwWaitResult = WaitForSingleObject(dev->rx.thread, READ_THREAD_SHUTDOWN_TIMEOUT);
 			switch (dwWaitResult)
@@ -877,21 +1018,31 @@ void usb_set_device_ready(struct usb_device *dev)
 				DEBUG_PRINT_WIN32_ERROR("WaitForSingleObject");
 				return;
 			}
+			DEBUG_PRINT("Read thread of device %d stopped in %llu ms", dev->id, (unsigned long long)(mstime64() - ullPhaseStart));
+			ullPhaseStart = mstime64();
 		}
 
 		if (dev->tx.writeThreadStop)
 		{
-			SetEvent(dev->tx.writeThreadStop);
+			/* The stop element is queued behind the pending transfers (e.g. the 
+			 * connections' RSTs), so the write thread completes them first */
 			usb_device_tx_q_element stop = { 0 };
-			dev->tx.q.enqueue(stop);//
+			dev->tx.q.enqueue(stop);
 
-			
-			
-			if(WaitForSingleObject(dev->tx.thread,5000)!=WAIT_OBJECT_0)
+			if(WaitForSingleObject(dev->tx.thread, WRITE_THREAD_SHUTDOWN_TIMEOUT)!=WAIT_OBJECT_0)
 			{
 				DEBUG_PRINT_ERROR("waiting for write thread to stop failed");
+				SetEvent(dev->tx.writeThreadStop);
+
+				/* The thread uses the device until it returns (e.g. device_tx_drained),
+				 * the device mustn't be freed under it */
+				if (WaitForSingleObject(dev->tx.thread, WRITE_THREAD_ABORT_TIMEOUT) != WAIT_OBJECT_0)
+				{
+					DEBUG_PRINT_ERROR("Write thread of device %d didn't stop", dev->id);
+					write_thread_running = true;
+				}
 			}
-			else
+			if (false == write_thread_running)
 			{
 				DEBUG_PRINT_ERROR("waiting for write thread to stop success");
 				usb_device_tx_q_element freePoll;
@@ -909,6 +1060,7 @@ void usb_set_device_ready(struct usb_device *dev)
 				}
 				DEBUG_PRINT_ERROR("deliting pool finished");
 			}
+			DEBUG_PRINT("Write thread of device %d stopped in %llu ms", dev->id, (unsigned long long)(mstime64() - ullPhaseStart));
 
 
 		}
@@ -922,6 +1074,16 @@ void usb_set_device_ready(struct usb_device *dev)
 		SAFE_CLOSE_SOCKET(dev->rx.data_events_socket);
 		SAFE_CLOSE_HANDLE(dev->rx.thread);
 
+		/* A write thread that is still running keeps the device, which is
+		 * leaked rather than freed or reused. Closing the port above fails its
+		 * pending transfers, so it's likely to return eventually */
+		if (write_thread_running)
+		{
+			DEBUG_PRINT_ERROR("Leaking device %d, its write thread is still running", dev->id);
+			collection_remove(&g_device_list, dev);
+			return;
+		}
+
 		/* If wer're really removing the device, we'll cleanup 
 		 * everything. But, if this was a removal of a monitored device, 
 		 * we'll just reset it's state */
@@ -1046,11 +1208,18 @@ void usb_set_device_ready(struct usb_device *dev)
 			usb_device_tx_q_element e = { 0 }; 
 			dev->tx.q.wait_dequeue(e);
 
-			if (WaitForSingleObject(dev->tx.writeThreadStop, 0) == WAIT_OBJECT_0)
+			/* The stop element (see usb_disconnect) */
+			if (NULL == e.theOverLapped)
 			{
 				DEBUG_PRINT("usb_write_thread_proc signalled to stop");
 				break;
+			}
 
+			/* Abort, without waiting for the rest of the queue */
+			if (WaitForSingleObject(dev->tx.writeThreadStop, 0) == WAIT_OBJECT_0)
+			{
+				DEBUG_PRINT("usb_write_thread_proc aborted");
+				break;
 			}
 			WaitForSingleObject(g_hTransferresultMutex, INFINITE);
 			if (e.theOverLapped != NULL)
@@ -1064,7 +1233,16 @@ void usb_set_device_ready(struct usb_device *dev)
 				{
 					DEBUG_PRINT_WIN32_ERROR("PortPortGetTransferResult");
 				}
+				LONG pending = InterlockedExchangeAdd(&(dev->tx.pending_bytes), -(LONG)e.length) - (LONG)e.length;
 				ReUseTXQElement(dev, e);
+
+				/* Wake the device layer up if it waits for the pipe to drain */
+				LONG wake_below = dev->tx.wake_below;
+				if ((0 != wake_below) && (pending < wake_below) &&
+					(wake_below == InterlockedCompareExchange(&(dev->tx.wake_below), 0, wake_below)))
+				{
+					device_tx_drained(dev);
+				}
 			}
 			ReleaseMutex(g_hTransferresultMutex);
 
@@ -1075,7 +1253,7 @@ void usb_set_device_ready(struct usb_device *dev)
 		while (dev->tx.q.try_dequeue(e))
 		{
 			if(e.buffer)
-				free((void *)e.buffer);
+				usb_free_tx_buffer((unsigned char *)e.buffer);
 			if(e.theOverLapped && e.theOverLapped->hEvent)
 				CloseHandle(e.theOverLapped->hEvent);
 			if (e.theOverLapped)
@@ -1401,12 +1579,6 @@ static int usb_add_pending_device(PENDING_DEVICE_COMMAND_SOURCE source,
 
 		DEBUG_MCE("Adding a pending device: %s", port_name);
 		usb_dev = new usb_device;
-
-		#ifndef USE_PORTDRIVER_SOCKETS
-			/* Reset data_events_socket to INVALID_SOCKET (SAFE_CLOSE_SOCKET doesn't
-			 * check for NULL) */
-			usb_dev->rx.data_events_socket = INVALID_SOCKET;
-		#endif
 	}
 	else
 	{
@@ -14,9 +14,16 @@
 #define READ_WAIT_TIMEOUT (5000)
 
 #define READ_THREAD_SHUTDOWN_TIMEOUT (3000)
+/* Upper bound for completing the transfers queued to the write thread */
+#define WRITE_THREAD_SHUTDOWN_TIMEOUT (5000)
+/* Upper bound for the write thread to stop once it's told to abort */
+#define WRITE_THREAD_ABORT_TIMEOUT (1000)
 
 #define DEVICE_RX_BUFFER_SIZE (0x8008)
 
+/* Max number of idle TX buffers kept for reuse by usb_alloc_tx_buffer */
+#define TX_BUFFER_POOL_MAX_COUNT (64)
+
 #ifdef USE_PORTDRIVER_SOCKETS
 	#define NUM_RX_LOOPS (3)
 #else
@@ -35,7 +42,7 @@
 			data_size(0),
 			thread_stop_event(0),
 			thread(0),
-			data_events_socket(0)
+			data_events_socket(INVALID_SOCKET)
 		{
 			memset(&overlapped,0,sizeof(OVERLAPPED)); 
 		}
@@ -43,6 +50,7 @@
 	struct usb_device_tx_q_element
 	{
 		void* buffer;
+		uint32_t length;
 		OVERLAPPED*  theOverLapped;
 	};
 	struct usb_device_tx
@@ -51,9 +59,13 @@
 		HANDLE		thread;
 		moodycamel::BlockingReaderWriterQueue<usb_device_tx_q_element> q;
 		moodycamel::BlockingReaderWriterQueue<usb_device_tx_q_element> pool;
+		volatile LONG pending_bytes;	/* bytes queued to the write thread and not yet completed */
+		volatile LONG wake_below;		/* see usb_arm_tx_wake, 0 when disarmed */
 		usb_device_tx() :
 			writeThreadStop(0),
-			thread(0)
+			thread(0),
+			pending_bytes(0),
+			wake_below(0)
 		{
 
 		}
@@ -111,6 +123,9 @@ struct usb_device
 
 	HANDLE device_ready_event;
 
+	/* Updated by usb_send() and usb_get_read_result(), both called with the
+	 * device's shard lock held, which usb_get_stats() requires as well */
+	struct usb_stats stats;
 
 
 	usb_device() :
@@ -121,6 +136,7 @@ struct usb_device
 					device_ready_event(0)
 	{
 		memset(&port, 0, sizeof(COMHANDLE));
+		memset(&stats, 0, sizeof(stats));
 	}
 };
 
@@ -162,6 +178,9 @@ static int g_next_usb_device_id;
 static CAtlList<PENDING_DEVICE_COMMAND *> g_pending_devices;
 static CRITICAL_SECTION g_pending_devices_lock;
 static HANDLE g_port_notification_callback_cookie;
+static CRITICAL_SECTION g_tx_buffer_pool_lock;
+static void * g_tx_buffer_pool;		/* Free list, the next pointer is kept in each buffer */
+static int g_tx_buffer_pool_count;
 
 /******************************************************************************
  * Internal Functions Declarations
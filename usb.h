@@ -44,12 +44,26 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 
 #define USB_PACKET_SIZE 512
 
+// size of every buffer handed to usb_send(), see usb_alloc_tx_buffer()
+#define USB_TX_BUFFER_SIZE USB_MTU
+
 #define VID_APPLE 0x5ac
 #define PID_RANGE_LOW 0x1290
 #define PID_RANGE_MAX 0x12af
 
 struct usb_device;
 
+// Traffic counters of a USB device, see usb_get_stats()
+struct usb_stats {
+	uint64_t tx_bytes;
+	uint64_t tx_transfers;
+	uint64_t tx_zlps;
+	uint64_t rx_bytes;
+	uint64_t rx_transfers;
+	uint32_t tx_pending;		// bytes currently in flight
+	uint32_t tx_pending_max;	// high watermark of tx_pending
+};
+
 enum device_monitor_state
 {
 	DEVICE_MONITOR_ONCE,
@@ -64,6 +78,15 @@ enum device_monitor_state
 int usb_init(uint32_t hub_address, LPCWSTR pLuginPath);
 void usb_shutdown(void);
 int usb_send(struct usb_device *dev, const unsigned char *buf, int length);
+unsigned char *usb_alloc_tx_buffer(void);
+void usb_free_tx_buffer(unsigned char *buf);
+// bytes handed to usb_send() whose transfer hasn't completed yet
+uint32_t usb_get_tx_pending(struct usb_device *dev);
+// have device_tx_drained() called once fewer than below bytes are pending,
+// returns 0 (and doesn't arm) if that is already the case
+int usb_arm_tx_wake(struct usb_device *dev, uint32_t below);
+// must be called with the device's shard lock held, see device_get_statistics()
+void usb_get_stats(struct usb_device *dev, struct usb_stats *stats);
 int usb_add_device(uint32_t device_location, void * completion_event);
 int usb_remove_device(uint32_t device_location, void * completion_event);
 usb_device * usb_get_device_by_id(int id);
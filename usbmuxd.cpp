@@ -8,8 +8,11 @@
 #include "usbmuxd.h"
 #include "usbmuxd_internal.h"
 #include "client.h"
+#include "conf.h"
 #include "device.h"
+#include "preflight.h"
 #include "usb.h"
+#include "eventloop.h"
 #include <libimobiledevice\libimobiledevice.h>
 
 /* MCE Includes */
@@ -53,12 +56,10 @@ USBMUXD_API BOOL usbmuxd_Start(WORD wPort, DWORD dwHubAddress, LPCWSTR pPluginPa
 
 	/* Initiailzie usbmuxd's modules */
 	//LOG_TRACE("Initializing usbmuxd");
+	config_init();
 	client_init();
 	device_init();
-	if (usb_init(dwHubAddress, pPluginPath) < 0)
-	{
-		return FALSE;
-	}
+	preflight_init();
 	
 	/* Initialize our global context */
 	SecureZeroMemory((void *)&g_tContext, sizeof(g_tContext));
@@ -73,6 +74,28 @@ USBMUXD_API BOOL usbmuxd_Start(WORD wPort, DWORD dwHubAddress, LPCWSTR pPluginPa
 		goto lblCleanup;
 	}
 
+	/* Create the event loop the main thread waits on, the listening sockets
+	 * and the clients that aren't connected to a device register with it */
+	g_tContext.ptEventLoop = event_loop_create();
+	if (NULL == g_tContext.ptEventLoop)
+	{
+		DEBUG_PRINT_ERROR("event_loop_create has failed");
+		goto lblCleanup;
+	}
+
+	/* Create the shards the devices are spread over, before the usb layer
+	 * starts adding devices */
+	if (FALSE == CreateShards(&g_tContext))
+	{
+		DEBUG_PRINT_ERROR("CreateShards has failed");
+		goto lblCleanup;
+	}
+
+	if (usb_init(dwHubAddress, pPluginPath) < 0)
+	{
+		return FALSE;
+	}
+
 	/* Start the main thread */
 	g_hMainThread = CREATE_THREAD(MainThreadProc, &g_tContext);
 	if (FALSE == IS_VALID_HANDLE(g_hMainThread))
@@ -81,6 +104,13 @@ USBMUXD_API BOOL usbmuxd_Start(WORD wPort, DWORD dwHubAddress, LPCWSTR pPluginPa
 		goto lblCleanup;
 	}
 
+	/* Start the threads serving the devices and their connections */
+	if (FALSE == StartShardThreads(&g_tContext))
+	{
+		DEBUG_PRINT_ERROR("StartShardThreads has failed");
+		goto lblCleanup;
+	}
+
 	/* Wait for the main thread to finish its initialization */
 	DWORD tim = INIT_TIMEOUT;
 	tim = 20000;
@@ -114,44 +144,49 @@ USBMUXD_API BOOL usbmuxd_Shutdown()
 		return FALSE;
 	}
 
-	/* Signal the shutdown event */
+	/* Signal the shutdown event, and wake the main thread up so it doesn't 
+	 * wait for its select interval to see it */
 	DEBUG_PRINT("Terminating usbmuxd");
+	uint64_t ullShutdownStart = mstime64();
+	uint64_t ullPhaseStart = ullShutdownStart;
 	if (FALSE == SetEvent(g_tContext.hShutdownEvent))
 	{
 		DEBUG_PRINT_WIN32_ERROR("SetEvent");
 		return FALSE;
 	}
+	event_loop_wake(g_tContext.ptEventLoop);
 
 	/* Wait for the main thread to finish */
-	DWORD dwWaitResult = WaitForSingleObject(g_hMainThread, SHUTDOWN_TIMEOUT);
-	switch (dwWaitResult)
+	if (FALSE == WaitForThread(g_hMainThread, "usbmuxd"))
 	{
-	/* The thread has been terminated */
-	case WAIT_OBJECT_0:
-		DEBUG_PRINT("usbmuxd thread was terminated");
-		break;
-
-	/* Timeout */
-	case WAIT_TIMEOUT:
-		DEBUG_PRINT("Timeout while waiting to usbmuxd's thread to terminate, killing the thread...");
-		if (FALSE == TerminateThread(g_hMainThread, 0))
-		{
-			DEBUG_PRINT_WIN32_ERROR("TerminateThread");
-		}
-		break;
-
-	/* Error */
-	default:
-		DEBUG_PRINT_WIN32_ERROR("WaitForSingleObject");
 		return FALSE;
 	}
+	LogShutdownPhase("main thread", &ullPhaseStart);
+
+	/* Then for the shard threads, which the shutdown event stops as well */
+	StopShards(&g_tContext);
+	LogShutdownPhase("shard threads", &ullPhaseStart);
 	
+	/* The connections' RSTs are queued to the devices here, and usb_shutdown
+	 * waits for the queued transfers to complete before closing the devices */
 	device_kill_connections();
+	LogShutdownPhase("device_kill_connections", &ullPhaseStart);
 	usb_shutdown();
+	LogShutdownPhase("usb_shutdown", &ullPhaseStart);
 	device_shutdown();
+	LogShutdownPhase("device_shutdown", &ullPhaseStart);
 	client_shutdown();
+	LogShutdownPhase("client_shutdown", &ullPhaseStart);
+	config_shutdown();
+	LogShutdownPhase("config_shutdown", &ullPhaseStart);
+	for (int i = 0; i < g_tContext.iShardCount; i++)
+	{
+		event_loop_destroy(g_tContext.atShards[i].ptEventLoop);
+	}
+	event_loop_destroy(g_tContext.ptEventLoop);
 
 	(void)WSACleanup();
+	DEBUG_PRINT("usbmuxd shutdown took %llu ms", (unsigned long long)(mstime64() - ullShutdownStart));
 
 	/* Cleanup */
 	SAFE_CLOSE_HANDLE(g_hMainThread);
@@ -245,55 +280,7 @@ USBMUXD_API BOOL usbmuxd_HasDevices()
 /******************************************************************************
  * Private Functions
  *****************************************************************************/
-#ifdef USE_PORTDRIVER_SOCKETS
-	/******************************************************************************
-	 * CreateFdSets Function
-	 *****************************************************************************/
-	static int CreateFdSets(USBMUXD_SOCKETS * ptSockets, fd_set * pReadFds, fd_set * pWriteFds)
-	{
-		ATLASSERT(NULL != pReadFds);
-
-		FD_ZERO(pReadFds);
-		FD_ZERO(pWriteFds);
-
-		/* Add the listening socket to the read fd set */
-		int iFdCount = 1;
-		FD_SET(ptSockets->hClientsListenSocket, pReadFds);
-
-		/* Add the clients sockets */
-		iFdCount += client_add_fds(pReadFds, pWriteFds);
-
-		/* Add the devices sockets */
-		iFdCount += usb_add_fds(pReadFds, pWriteFds);
-
-		return iFdCount;
-	}
-#else
-	/******************************************************************************
-	 * CreateFdSets Function
-	 *****************************************************************************/
-	static int CreateFdSets(USBMUXD_SOCKETS * ptSockets, fd_set * pReadFds, fd_set * pWriteFds)
-	{
-		ATLASSERT(NULL != pReadFds);
-
-
-		FD_ZERO(pReadFds);
-		FD_ZERO(pWriteFds);
-
-		/* Add the listening sockets to the read fd set */
-		int iFdCount = 2;
-		FD_SET(ptSockets->hClientsListenSocket, pReadFds);
-		FD_SET(ptSockets->hDevicesListenSocket, pReadFds);
-
-		/* Add the clients sockets */
-		iFdCount += client_add_fds(pReadFds, pWriteFds);
-
-		/* Add the devices sockets */
-		iFdCount += device_add_fds(pReadFds, pWriteFds);
-
-		return iFdCount;
-	}
-
+#ifndef USE_PORTDRIVER_SOCKETS
 	/******************************************************************************
 	 * CreateListenSockets Function
 	 *****************************************************************************/
@@ -306,8 +293,6 @@ USBMUXD_API BOOL usbmuxd_HasDevices()
 			DEBUG_PRINT_ERROR("CreateListenSocket has failed");
 			return false;
 		}
-		SocketSetNonBlocking(ptSockets->hClientsListenSocket, TRUE);
-
 		DEBUG_PRINT("usbmuxd is listening for clients on port %u", ptContext->wClientsPort);
 
 		/* Create the device listening socket */
@@ -322,21 +307,224 @@ USBMUXD_API BOOL usbmuxd_HasDevices()
 
 		return true;
 	}	
+#else
+	/******************************************************************************
+	 * SyncUsbSources Function
+	 * The port driver's endpoint sockets come and go with the devices, so the
+	 * event loop is brought up to date with them before each wait
+	 *****************************************************************************/
+	static void SyncUsbSources(struct event_loop * ptEventLoop, USBMUXD_SOCKETS * ptSockets)
+	{
+		fd_set tReadFds;
+		fd_set tWriteFds;
+		FD_ZERO(&tReadFds);
+		FD_ZERO(&tWriteFds);
+		(void)usb_add_fds(&tReadFds, &tWriteFds);
+
+		/* Drop the sockets of the devices that are gone */
+		int i = 0;
+		while (i < ptSockets->iUsbSourceCount)
+		{
+			if (FD_ISSET(ptSockets->ahUsbSockets[i], &tReadFds))
+			{
+				i++;
+				continue;
+			}
+			event_loop_remove(ptSockets->aptUsbSources[i]);
+			ptSockets->iUsbSourceCount--;
+			ptSockets->ahUsbSockets[i] = ptSockets->ahUsbSockets[ptSockets->iUsbSourceCount];
+			ptSockets->aptUsbSources[i] = ptSockets->aptUsbSources[ptSockets->iUsbSourceCount];
+		}
+
+		/* Then register the new ones */
+		for (u_int j = 0; j < tReadFds.fd_count; j++)
+		{
+			SOCKET hSocket = tReadFds.fd_array[j];
+			bool bRegistered = false;
+			for (i = 0; i < ptSockets->iUsbSourceCount; i++)
+			{
+				if (hSocket == ptSockets->ahUsbSockets[i])
+				{
+					bRegistered = true;
+					break;
+				}
+			}
+			if ((bRegistered) || (FD_SETSIZE <= ptSockets->iUsbSourceCount))
+			{
+				continue;
+			}
+
+			struct event_source * ptSource = event_loop_add(ptEventLoop, hSocket, EVENT_OWNER_USB, (void *)hSocket, POLLIN);
+			if (NULL == ptSource)
+			{
+				DEBUG_PRINT_ERROR("Failed to register a USB endpoint socket");
+				continue;
+			}
+			ptSockets->ahUsbSockets[ptSockets->iUsbSourceCount] = hSocket;
+			ptSockets->aptUsbSources[ptSockets->iUsbSourceCount] = ptSource;
+			ptSockets->iUsbSourceCount++;
+		}
+	}
 #endif
 
+/******************************************************************************
+ * WaitForThread Function
+ *****************************************************************************/
+static BOOL WaitForThread(HANDLE hThread, LPCSTR pszName)
+{
+	DWORD dwWaitResult = WaitForSingleObject(hThread, SHUTDOWN_TIMEOUT);
+	switch (dwWaitResult)
+	{
+	/* The thread has been terminated */
+	case WAIT_OBJECT_0:
+		DEBUG_PRINT("%s thread was terminated", pszName);
+		return TRUE;
+
+	/* Timeout */
+	case WAIT_TIMEOUT:
+		DEBUG_PRINT("Timeout while waiting to %s's thread to terminate, killing the thread...", pszName);
+		if (FALSE == TerminateThread(hThread, 0))
+		{
+			DEBUG_PRINT_WIN32_ERROR("TerminateThread");
+		}
+		return TRUE;
+
+	/* Error */
+	default:
+		DEBUG_PRINT_WIN32_ERROR("WaitForSingleObject");
+		return FALSE;
+	}
+}
+
+/******************************************************************************
+ * CreateShards Function
+ *****************************************************************************/
+static BOOL CreateShards(USBMUXD_CONTEXT * ptContext)
+{
+	struct event_loop * aptLoops[MAX_EVENT_LOOP_SHARDS] = { 0 };
+	int iShardCount = env_get_int("MCE_EVENT_LOOP_SHARDS", DEFAULT_EVENT_LOOP_SHARDS);
+	if (iShardCount < 1)
+	{
+		iShardCount = 1;
+	}
+	else if (iShardCount > MAX_EVENT_LOOP_SHARDS)
+	{
+		iShardCount = MAX_EVENT_LOOP_SHARDS;
+	}
+
+	for (int i = 0; i < iShardCount; i++)
+	{
+		aptLoops[i] = event_loop_create();
+		if (NULL == aptLoops[i])
+		{
+			DEBUG_PRINT_ERROR("event_loop_create has failed");
+			goto lblCleanup;
+		}
+	}
+
+	if (0 != device_set_shards(aptLoops, iShardCount))
+	{
+		DEBUG_PRINT_ERROR("device_set_shards has failed");
+		goto lblCleanup;
+	}
+
+	for (int i = 0; i < iShardCount; i++)
+	{
+		ptContext->atShards[i].iIndex = i;
+		ptContext->atShards[i].ptEventLoop = aptLoops[i];
+		ptContext->atShards[i].ptContext = ptContext;
+	}
+	ptContext->iShardCount = iShardCount;
+	DEBUG_PRINT("Serving devices on %d %s event loop(s)", iShardCount, event_loop_backend_name(aptLoops[0]));
+
+	return TRUE;
+
+lblCleanup:
+	for (int i = 0; i < iShardCount; i++)
+	{
+		if (NULL != aptLoops[i])
+		{
+			event_loop_destroy(aptLoops[i]);
+		}
+	}
+	return FALSE;
+}
+
+/******************************************************************************
+ * StartShardThreads Function
+ *****************************************************************************/
+static BOOL StartShardThreads(USBMUXD_CONTEXT * ptContext)
+{
+	/* With several shards, pin each thread to its own processor, so a
+	 * device's connections keep their caches warm */
+	SYSTEM_INFO tSystemInfo = { 0 };
+	GetSystemInfo(&tSystemInfo);
+	for (int i = 0; i < ptContext->iShardCount; i++)
+	{
+		USBMUXD_SHARD * ptShard = &(ptContext->atShards[i]);
+		ptShard->hThread = CREATE_THREAD_EX(NULL, ShardThreadProc, ptShard, CREATE_SUSPENDED, NULL);
+		if (FALSE == IS_VALID_HANDLE(ptShard->hThread))
+		{
+			DEBUG_PRINT_WIN32_ERROR("_beginthreadex");
+			return FALSE;
+		}
+		if (1 < ptContext->iShardCount)
+		{
+			DWORD_PTR dwpAffinity = ((DWORD_PTR)1) << (i % tSystemInfo.dwNumberOfProcessors);
+			if (0 == SetThreadAffinityMask(ptShard->hThread, dwpAffinity))
+			{
+				DEBUG_PRINT_WIN32_ERROR("SetThreadAffinityMask");
+			}
+		}
+		(void)ResumeThread(ptShard->hThread);
+	}
+
+	return TRUE;
+}
+
+/******************************************************************************
+ * StopShards Function
+ *****************************************************************************/
+static void StopShards(USBMUXD_CONTEXT * ptContext)
+{
+	for (int i = 0; i < ptContext->iShardCount; i++)
+	{
+		event_loop_wake(ptContext->atShards[i].ptEventLoop);
+	}
+	for (int i = 0; i < ptContext->iShardCount; i++)
+	{
+		USBMUXD_SHARD * ptShard = &(ptContext->atShards[i]);
+		if (IS_VALID_HANDLE(ptShard->hThread))
+		{
+			(void)WaitForThread(ptShard->hThread, "shard");
+			SAFE_CLOSE_HANDLE(ptShard->hThread);
+		}
+	}
+}
+
+/******************************************************************************
+ * LogShutdownPhase Function
+ *****************************************************************************/
+static void LogShutdownPhase(LPCSTR pszPhase, uint64_t * pullPhaseStart)
+{
+	uint64_t ullNow = mstime64();
+	DEBUG_PRINT("Shutdown: %s took %llu ms", pszPhase, (unsigned long long)(ullNow - *pullPhaseStart));
+	*pullPhaseStart = ullNow;
+}
+
 /******************************************************************************
  * GetCurrentIterationTimeout Function
  *****************************************************************************/
-static void GetCurrentIterationTimeout(timeval * ptSelectTimeout)
+static int GetCurrentIterationTimeout(int iShard)
 {
 	int iTimeout = SOCKETS_SELECT_INTERVAL;
-	int iDeviceTimeout = device_get_timeout();
+	int iDeviceTimeout = device_get_timeout(iShard);
 	if (iDeviceTimeout < iTimeout)
 	{
 		iTimeout = iDeviceTimeout;
 	}
 
-	MS_TIMEOUT_TO_TIMEVAL(*ptSelectTimeout, iTimeout);
+	return iTimeout;
 }
 
 /******************************************************************************
@@ -361,22 +549,83 @@ static DWORD WINAPI MainThreadProc(void * pvParam)
 		DEBUG_PRINT_ERROR("CreateListenSocket has failed");
 		EXIT_THREAD(0);
 	}
+	/* The clients' socket buffer sizes, 0 lets the OS autotune them */
+	int iClientsBuffersSize = env_get_int("MCE_CLIENT_SOCKET_BUFFERS_SIZE", CLIENT_SOCKET_BUFFERS_SIZE);
+	if (0 != client_setup_listen_socket(tSockets.hClientsListenSocket, iClientsBuffersSize))
+	{
+		DEBUG_PRINT_ERROR("client_setup_listen_socket has failed");
+		EXIT_THREAD(0);
+	}
 	DEBUG_PRINT("usbmuxd is listening for clients on port %u", ptContext->wClientsPort);
 
+	/* Local clients may also connect through a unix socket, which spares them
+	 * the loopback TCP stack. The TCP port stays, libimobiledevice uses it */
+	CHAR szClientsSocketFile[MAX_PATH] = { 0 };
+	tSockets.hClientsUnixListenSocket = INVALID_SOCKET;
+	if (0 < env_get_string("MCE_USBMUXD_SOCKET_FILE", szClientsSocketFile, sizeof(szClientsSocketFile)))
+	{
+		if (FALSE == CreateUnixListenSocket(&(tSockets.hClientsUnixListenSocket), szClientsSocketFile))
+		{
+			DEBUG_PRINT_ERROR("CreateUnixListenSocket has failed");
+			szClientsSocketFile[0] = '\0';
+		}
+		else if (0 != client_setup_listen_socket(tSockets.hClientsUnixListenSocket, 0))
+		{
+			DEBUG_PRINT_ERROR("client_setup_listen_socket has failed");
+			SAFE_CLOSE_SOCKET(tSockets.hClientsUnixListenSocket);
+			(void)DeleteFileA(szClientsSocketFile);
+			szClientsSocketFile[0] = '\0';
+		}
+		else
+		{
+			DEBUG_PRINT("usbmuxd is listening for clients on %s", szClientsSocketFile);
+		}
+	}
+
+	/* Register the listening sockets, they stay registered for the thread's
+	 * lifetime. The loop wakes us up on shutdown through its own socket */
+	struct event_loop * ptEventLoop = ptContext->ptEventLoop;
+	struct event_source * ptClientsListenSource = event_loop_add(ptEventLoop, tSockets.hClientsListenSocket, EVENT_OWNER_LISTEN, &(tSockets.hClientsListenSocket), POLLIN);
+	if (NULL == ptClientsListenSource)
+	{
+		DEBUG_PRINT_ERROR("Failed to register the clients listening socket");
+		EXIT_THREAD(0);
+	}
+	struct event_source * ptClientsUnixListenSource = NULL;
+	if (INVALID_SOCKET != tSockets.hClientsUnixListenSocket)
+	{
+		ptClientsUnixListenSource = event_loop_add(ptEventLoop, tSockets.hClientsUnixListenSocket, EVENT_OWNER_LISTEN, &(tSockets.hClientsUnixListenSocket), POLLIN);
+		if (NULL == ptClientsUnixListenSource)
+		{
+			DEBUG_PRINT_ERROR("Failed to register the clients unix listening socket");
+		}
+	}
+	#ifndef USE_PORTDRIVER_SOCKETS
+		struct event_source * ptDevicesListenSource = event_loop_add(ptEventLoop, tSockets.hDevicesListenSocket, EVENT_OWNER_DEVICE_LISTEN, NULL, POLLIN);
+		if (NULL == ptDevicesListenSource)
+		{
+			DEBUG_PRINT_ERROR("Failed to register the devices listening socket");
+			EXIT_THREAD(0);
+		}
+	#endif
+
 	/* Set libusmuxd's port to our port (the preflight module uses libimobiledevice) */
 	idevice_set_usbmuxd_port(ptContext->wClientsPort);
 	
 	/* Signal usbmuxd_Start we're ready */
 	(void)SetEvent(ptContext->hReadyEvent);
 
-	int iCurFdCount = 0;
-	fd_set readFds;
-	fd_set writeFds;
-
 	/* In order to check the shutdown event while waiting for socket events,
-	 * and allow the device layer to handle data timeouts, we'll run "select" 
-	 * in intervals */
-	timeval tSelectTimeout = { 0 };
+	 * we'll wait on the event loop in intervals. The devices, their timeouts
+	 * and the connected clients are served by the shard threads */
+	enum event_owner eOwner = EVENT_OWNER_LISTEN;
+	void * pvOwnerData = NULL;
+	short sEvents = 0;
+
+	#ifdef USE_PORTDRIVER_SOCKETS
+		fd_set tUsbReadFds;
+		tSockets.iUsbSourceCount = 0;
+	#endif
 
 	bool bShouldStop = false;
 	int iRes = -1;
@@ -407,74 +656,84 @@ static DWORD WINAPI MainThreadProc(void * pvParam)
 			break;
 		}
 
-		/* Wait for a "read" event on the listening and client sockets */
-		GetCurrentIterationTimeout(&tSelectTimeout);
-		iCurFdCount = CreateFdSets(&tSockets, &readFds, &writeFds);
-		iRes = select(0, &readFds, &writeFds, NULL, &tSelectTimeout);
-		if (SOCKET_ERROR == iRes)
+		#ifdef USE_PORTDRIVER_SOCKETS
+			SyncUsbSources(ptEventLoop, &tSockets);
+			FD_ZERO(&tUsbReadFds);
+		#endif
+
+		/* Wait for events on the registered sockets */
+		iRes = event_loop_wait(ptEventLoop, SOCKETS_SELECT_INTERVAL);
+		if (iRes < 0)
 		{
-			DEBUG_PRINT_WSA_ERROR("select");
+			DEBUG_PRINT_ERROR("event_loop_wait has failed");
 			break;
 		}
-		else if (0 == iRes)
-		{
-			/* select has timed out */
-			usb_process(NULL);
-			device_check_timeouts();
-			continue;
-		}
 
-		/* Check for an event on the clients listening socket */
-		if (FD_ISSET(tSockets.hClientsListenSocket, &readFds))
-		{
-			/* Make sure we have room for a new socket in our fdsets */
-			BOOL bShouldRejectClient = FALSE;
-			if ((iCurFdCount + 1) > FD_SETSIZE)
-			{
-				DEBUG_PRINT_ERROR("We have a new client, but we cannot handle more than %d sockets simultaneously", FD_SETSIZE);
-				bShouldRejectClient = TRUE;
-			}
+		/* Take back the clients whose connect was refused */
+		client_process_handbacks();
 
-			if (client_accept(tSockets.hClientsListenSocket, bShouldRejectClient) < 0)
+		/* Dispatch the ready sockets to their owners */
+		while (0 != event_loop_next(ptEventLoop, &eOwner, &pvOwnerData, &sEvents))
+		{
+			switch (eOwner)
 			{
-				DEBUG_PRINT_WSA_ERROR("accept");
+			case EVENT_OWNER_LISTEN:
+				/* Take in a whole burst of clients, what is left over is
+				 * still pending on the next iteration */
+				if (client_accept_pending(ptEventLoop, *(SOCKET *)pvOwnerData, MAX_ACCEPTS_PER_ITERATION) < 0)
+				{
+					DEBUG_PRINT_WSA_ERROR("accept");
+				}
+				break;
+
+			case EVENT_OWNER_CLIENT:
+				client_process((struct mux_client *)pvOwnerData, sEvents);
+				break;
+
+			#ifdef USE_PORTDRIVER_SOCKETS
+				case EVENT_OWNER_USB:
+					FD_SET((SOCKET)pvOwnerData, &tUsbReadFds);
+					break;
+			#else
+				case EVENT_OWNER_DEVICE_LISTEN:
+					if (device_accept_socket(tSockets.hDevicesListenSocket, FALSE) < 0)
+					{
+						//LOG_WSA_ERROR("accept");
+					}
+					break;
+			#endif
+
+			default:
+				break;
 			}
 		}
 
+		/* Handle usb events, the port driver's pending transfers are only
+		 * processed once one of their sockets is ready */
 		#ifdef USE_PORTDRIVER_SOCKETS
-			/* Handle usb events */
-			usb_process(&readFds);
+			usb_process((0 < tUsbReadFds.fd_count) ? &tUsbReadFds : NULL);
 		#else
-			/* Check for an event on the devices listening socket */
-			if (FD_ISSET(tSockets.hDevicesListenSocket, &readFds))
-			{
-				/* Make sure we have room for a new socket in our fdsets */
-				BOOL bShouldRejectClient = FALSE;
-				if ((iCurFdCount + 1) > FD_SETSIZE)
-				{
-					//LOG_ERROR("We have a device socket, but we cannot handle more than %d sockets simultaneously", FD_SETSIZE);
-					bShouldRejectClient = TRUE;
-				}
-
-				if (device_accept_socket(tSockets.hDevicesListenSocket, bShouldRejectClient) < 0)
-				{
-					//LOG_WSA_ERROR("accept");
-				}
-			}
-
-			/* Handle device socket events */
-			device_process_sockets(&readFds, &writeFds);
-
-			/* Handle usb events */
 			usb_process(NULL);
 		#endif
-		
-		/* Handle client socket events */
-		client_process(&readFds, &writeFds);
 	}
 
 	//LOG_TRACE("usbmuxd thread is terminating");
+	event_loop_remove(ptClientsListenSource);
+	event_loop_remove(ptClientsUnixListenSource);
+	#ifdef USE_PORTDRIVER_SOCKETS
+		for (int i = 0; i < tSockets.iUsbSourceCount; i++)
+		{
+			event_loop_remove(tSockets.aptUsbSources[i]);
+		}
+	#else
+		event_loop_remove(ptDevicesListenSource);
+	#endif
 	closesocket(tSockets.hClientsListenSocket);
+	SAFE_CLOSE_SOCKET(tSockets.hClientsUnixListenSocket);
+	if ('\0' != szClientsSocketFile[0])
+	{
+		(void)DeleteFileA(szClientsSocketFile);
+	}
 	#ifndef USE_PORTDRIVER_SOCKETS
 		closesocket(tSockets.hDevicesListenSocket);
 	#endif
@@ -482,6 +741,59 @@ static DWORD WINAPI MainThreadProc(void * pvParam)
 	EXIT_THREAD(0);
 }
 
+/******************************************************************************
+ * ShardThreadProc Function
+ *****************************************************************************/
+static DWORD WINAPI ShardThreadProc(void * pvParam)
+{
+	USBMUXD_SHARD * ptShard = (USBMUXD_SHARD *)pvParam;
+	struct event_loop * ptEventLoop = ptShard->ptEventLoop;
+	enum event_owner eOwner = EVENT_OWNER_DEVICE;
+	void * pvOwnerData = NULL;
+	short sEvents = 0;
+
+	while (WAIT_TIMEOUT == WaitForSingleObject(ptShard->ptContext->hShutdownEvent, 0))
+	{
+		/* Wait for events on the shard's devices and clients, or for its
+		 * nearest connection deadline */
+		if (0 > event_loop_wait(ptEventLoop, GetCurrentIterationTimeout(ptShard->iIndex)))
+		{
+			DEBUG_PRINT_ERROR("event_loop_wait has failed");
+			break;
+		}
+
+		/* The devices and clients are only freed with the shard locked, so
+		 * keep it while fetching and dispatching the ready sockets */
+		device_lock_shard(ptShard->iIndex);
+		while (0 != event_loop_next(ptEventLoop, &eOwner, &pvOwnerData, &sEvents))
+		{
+			switch (eOwner)
+			{
+			case EVENT_OWNER_CLIENT:
+				client_process((struct mux_client *)pvOwnerData, sEvents);
+				break;
+
+			#ifndef USE_PORTDRIVER_SOCKETS
+				case EVENT_OWNER_DEVICE:
+					(void)device_process_socket(ptShard->iIndex, (struct mux_device *)pvOwnerData);
+					break;
+			#endif
+
+			default:
+				break;
+			}
+		}
+
+		/* Handle connection timeouts, then forward pending client data to
+		 * the devices */
+		device_check_timeouts(ptShard->iIndex);
+		device_process_tx(ptShard->iIndex);
+		device_unlock_shard(ptShard->iIndex);
+	}
+
+	EXIT_THREAD(0);
+}
+
 /******************************************************************************
  * SetDeviceMonitoring Function
  *****************************************************************************/
@@ -13,6 +13,14 @@
 #define SHUTDOWN_TIMEOUT (5000)
 #define DEVICE_MONITORING_CHANGE_TIMEOUT (3000)
 
+/* The most clients taken in from a listening socket per loop iteration */
+#define MAX_ACCEPTS_PER_ITERATION (64)
+
+/* Devices are spread over MCE_EVENT_LOOP_SHARDS threads, each running its own
+ * event loop */
+#define DEFAULT_EVENT_LOOP_SHARDS (1)
+#define MAX_EVENT_LOOP_SHARDS (64)
+
 #define IS_USBMUXD_RUNNING() (IS_VALID_HANDLE(g_hMainThread))
 
 #define VERIFY_USBMUXD_IS_RUNNING() if (FALSE == IS_USBMUXD_RUNNING())\
@@ -22,19 +30,38 @@
 
 #define MCE_PORT_NAME_FORMAT ("MCE%u")
 
-typedef struct _USBMUXD_CONTEXT
+typedef struct _USBMUXD_CONTEXT USBMUXD_CONTEXT;
+
+typedef struct _USBMUXD_SHARD
+{
+	int iIndex;
+	HANDLE hThread;
+	struct event_loop * ptEventLoop;
+	USBMUXD_CONTEXT * ptContext;
+} USBMUXD_SHARD;
+
+struct _USBMUXD_CONTEXT
 {
 	HANDLE hReadyEvent;
 	HANDLE hShutdownEvent;
 	WORD wClientsPort;
 	WORD wDevicesPort;
-} USBMUXD_CONTEXT;
+	struct event_loop * ptEventLoop;
+	int iShardCount;
+	USBMUXD_SHARD atShards[MAX_EVENT_LOOP_SHARDS];
+};
 
 typedef struct _USBMUXD_SOCKETS
 {
 	SOCKET hClientsListenSocket;
+	SOCKET hClientsUnixListenSocket;
 	#ifndef USE_PORTDRIVER_SOCKETS
 		SOCKET hDevicesListenSocket;
+	#else
+		/* The port driver's endpoint sockets, registered with the event loop */
+		SOCKET ahUsbSockets[FD_SETSIZE];
+		struct event_source * aptUsbSources[FD_SETSIZE];
+		int iUsbSourceCount;
 	#endif
 	
 	CAtlList<SOCKET> devicesSockets;
@@ -49,27 +76,59 @@ static USBMUXD_CONTEXT g_tContext = { 0 };
 /******************************************************************************
  * Internal Functions Declarations
  *****************************************************************************/
-/******************************************************************************
- * CreateFdSets Function
- *****************************************************************************/
-static int CreateFdSets(fd_set * pReadFds, SOCKET hListenSocket, const CAtlList<SOCKET>& clientSockets);
-
 /******************************************************************************
  * GetCurrentIterationTimeout Function
  *****************************************************************************/
-static void GetCurrentIterationTimeout(timeval * ptSelectTimeout);
+static int GetCurrentIterationTimeout(int iShard);
 
 /******************************************************************************
  * MainThreadProc Function
  *****************************************************************************/
 static DWORD WINAPI MainThreadProc(void * pvParam);
 
+/******************************************************************************
+ * ShardThreadProc Function
+ *****************************************************************************/
+static DWORD WINAPI ShardThreadProc(void * pvParam);
+
+/******************************************************************************
+ * CreateShards Function
+ *****************************************************************************/
+static BOOL CreateShards(USBMUXD_CONTEXT * ptContext);
+
+/******************************************************************************
+ * StartShardThreads Function
+ *****************************************************************************/
+static BOOL StartShardThreads(USBMUXD_CONTEXT * ptContext);
+
+/******************************************************************************
+ * StopShards Function
+ *****************************************************************************/
+static void StopShards(USBMUXD_CONTEXT * ptContext);
+
+/******************************************************************************
+ * WaitForThread Function
+ *****************************************************************************/
+static BOOL WaitForThread(HANDLE hThread, LPCSTR pszName);
+
 /******************************************************************************
  * CreateListenSockets Function
  *****************************************************************************/
 static bool CreateListenSockets(USBMUXD_CONTEXT * ptContext, 
 								USBMUXD_SOCKETS * ptSockets);
 
+#ifdef USE_PORTDRIVER_SOCKETS
+	/******************************************************************************
+	 * SyncUsbSources Function
+	 *****************************************************************************/
+	static void SyncUsbSources(struct event_loop * ptEventLoop, USBMUXD_SOCKETS * ptSockets);
+#endif
+
+/******************************************************************************
+ * LogShutdownPhase Function
+ *****************************************************************************/
+static void LogShutdownPhase(LPCSTR pszPhase, uint64_t * pullPhaseStart);
+
 /******************************************************************************
  * SetDeviceMonitoring Function
  *****************************************************************************/
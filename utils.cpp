@@ -284,4 +284,54 @@ uint64_t mstime64(void)
 	// Careful, avoid overflow on 32 bit systems
 	// time_t could be 4 bytes
 	return ((long long)tv.tv_sec) * 1000LL + ((long long)tv.tv_usec) / 1000LL;
-}
\ No newline at end of file
+}
+
+/**
+ * Read a string setting from the environment.
+ *
+ * @param name Name of the environment variable.
+ * @param buf Buffer receiving the value.
+ * @param size Size of buf in bytes.
+ *
+ * @return The length of the value, or -1 if the variable is unset
+ *   or does not fit in buf.
+ */
+int env_get_string(const char *name, char *buf, int size)
+{
+#ifdef _MSC_VER
+	DWORD len = GetEnvironmentVariableA(name, buf, size);
+	if (len == 0 || len >= (DWORD)size)
+		return -1;
+	return (int)len;
+#else
+	const char *env = getenv(name);
+	if (!env || strlen(env) >= (size_t)size)
+		return -1;
+	strcpy(buf, env);
+	return (int)strlen(buf);
+#endif
+}
+
+/**
+ * Read an integer setting from the environment.
+ *
+ * @param name Name of the environment variable.
+ * @param default_value Value returned if the variable is unset or invalid.
+ *
+ * @return The parsed value, or default_value.
+ */
+int env_get_int(const char *name, int default_value)
+{
+	char value[32];
+	char *end = NULL;
+	long res;
+
+	if (env_get_string(name, value, sizeof(value)) <= 0)
+		return default_value;
+
+	res = strtol(value, &end, 0);
+	if (end == value || *end != '\0')
+		return default_value;
+
+	return (int)res;
+}
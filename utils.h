@@ -72,4 +72,7 @@ int plist_write_to_filename(plist_t plist, const char *filename, enum plist_form
 
 uint64_t mstime64(void);
 
+int env_get_string(const char *name, char *buf, int size);
+int env_get_int(const char *name, int default_value);
+
 #endif